@@ -8,13 +8,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
+#include <errno.h>
 
 #define LUA_PGSQL_VERSION "1.0.0"
 
 #ifdef WIN32
 #include <winsock2.h>
 #define NO_CLIENT_LONG_LONG
+#define strncasecmp _strnicmp
+#define poll(fds, n, ms) WSAPoll((fds), (n), (ms))
+#else
+#include <pthread.h>
+#include <strings.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
 #endif
 
 #include "libpq-fe.h"
@@ -38,6 +52,9 @@
 #define LUA_PGSQL_CONN "PgSQL connection"
 #define LUA_PGSQL_RES "PgSQL result"
 #define LUA_PGSQL_LO "PgSQL large object"
+#define LUA_PGSQL_STREAM "PgSQL stream"
+#define LUA_PGSQL_POOL "PgSQL pool"
+#define LUA_PGSQL_WAITSET "PgSQL waitset"
 #define LUA_PGSQL_TABLENAME "pgsql"
 
 #define LUA_PG_DATA_LENGTH 1
@@ -53,6 +70,37 @@
 #define InvalidOid ((Oid) 0)
 #endif
 
+/* builtin type oids, see pg_type.h */
+#define PGSQL_BOOLOID      16
+#define PGSQL_BYTEAOID     17
+#define PGSQL_NAMEOID      19
+#define PGSQL_INT8OID      20
+#define PGSQL_INT2OID      21
+#define PGSQL_INT4OID      23
+#define PGSQL_TEXTOID      25
+#define PGSQL_OIDOID       26
+#define PGSQL_JSONOID      114
+#define PGSQL_FLOAT4OID    700
+#define PGSQL_FLOAT8OID    701
+#define PGSQL_BPCHAROID    1042
+#define PGSQL_VARCHAROID   1043
+#define PGSQL_DATEOID      1082
+#define PGSQL_TIMESTAMPOID 1114
+#define PGSQL_TIMESTAMPTZOID 1184
+#define PGSQL_NUMERICOID   1700
+#define PGSQL_UUIDOID      2950
+#define PGSQL_JSONBOID     3802
+
+/* days from 0000-03-01 to 2000-01-01, the epoch of binary dates */
+#define PGSQL_EPOCH_DAYS   730425
+/* days and seconds from 1970-01-01 to 2000-01-01 */
+#define PGSQL_UNIX_EPOCH_DAYS 10957
+#define PGSQL_UNIX_EPOCH_SECS 946684800
+#define PGSQL_USECS_PER_DAY 86400000000LL
+
+/* largest integer a lua_Number (double) holds exactly */
+#define PGSQL_MAX_EXACT_INT  9007199254740992LL
+
 #define PGSQL_ASSOC     1<<0
 #define PGSQL_NUM       1<<1
 #define PGSQL_BOTH      (PGSQL_ASSOC|PGSQL_NUM)
@@ -64,104 +112,430 @@
 #define PGSQL_MAX_LENGTH_OF_DOUBLE 60
 
 #define PGSQL_LO_READ_BUF_SIZE  8192
+#define PGSQL_LO_CHUNK_SIZE     262144
+#define PGSQL_COPY_BUF_SIZE     65536
+
+#define PGSQL_TYPE_CACHE_MIN_SIZE  256
+#define PGSQL_STMT_NAME_LEN        32
+#define PGSQL_PARAM_SLOT           32    /* converted value of a parameter */
+#define PGSQL_MAX_PARAMS           65535 /* a Bind message counts them in 16 bits */
+#define PGSQL_TYPE_NAME_LEN        64    /* NAMEDATALEN */
 
 #define safe_emalloc(nmemb, size, offset)  malloc((nmemb) * (size) + (offset)) 
 
+/* statements counted by db:stats() */
+#define PGSQL_KIND_SIMPLE    0
+#define PGSQL_KIND_PARAMS    1
+#define PGSQL_KIND_PREPARED  2
+#define PGSQL_KIND_PIPELINE  3
+#define PGSQL_KINDS          4
+
+/* latency histograms: exact below 16us, then 16 buckets per power of two up to 2^36us */
+#define PGSQL_HIST_SUB         16
+#define PGSQL_HIST_BUCKETS     (PGSQL_HIST_SUB * 33)
+#define PGSQL_FINGERPRINT_LEN  256
+
+/* protocol exchanges kept by default by the trace ring of a connection */
+#define PGSQL_TRACE_SIZE       64
+#define PGSQL_TRACE_NAME_LEN   48
+
+/* default retry policy: one more attempt, after 50 to 100ms */
+#define PGSQL_RETRY_ATTEMPTS   2
+#define PGSQL_RETRY_DELAY      0.1
+#define PGSQL_RETRY_MAX_DELAY  5.0
+#define PGSQL_RETRY_STATES     8
+/* seconds a reconnect may take when neither the policy nor connect_timeout bound it */
+#define PGSQL_RESET_TIMEOUT    30.0
+
+/* memory held by a result, the closest libpq tells of its wire size */
+#if defined(PG_VERSION_NUM) && PG_VERSION_NUM >= 120000
+#define luaM_result_size(res)  PQresultMemorySize(res)
+#else
+#define luaM_result_size(res)  0
+#endif
+
+/* the type caches are shared by every lua_State in the process */
+#ifdef WIN32
+#define luaM_lock()
+#define luaM_unlock()
+#else
+static pthread_mutex_t luaM_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define luaM_lock()    pthread_mutex_lock(&luaM_mutex)
+#define luaM_unlock()  pthread_mutex_unlock(&luaM_mutex)
+#endif
+
+/* live object counters of pgsql.stats() */
+#ifdef __GNUC__
+#define luaM_count(var, n)  __sync_add_and_fetch(&(var), (n))
+#else
+#define luaM_count(var, n)  ((var) += (n))
+#endif
+
 typedef struct {
     short      closed;
 } pseudo_data;
 
+/**
+* oid -> typname hash of one server (host, port, dbname and version),
+* filled lazily and never freed: reconnecting to the same server finds
+* the names already resolved.
+*/
+typedef struct lua_pg_type_cache {
+	char	*key;
+	Oid		*oids;			/* open addressing, 0 marks a free slot */
+	char	**names;
+	size_t	size;
+	size_t	used;
+	Oid		scanned;		/* every oid <= scanned has been loaded */
+	struct lua_pg_type_cache *next;
+} lua_pg_type_cache;
+
+/* a statement prepared by the query_params cache */
+typedef struct lua_pg_stmt {
+	char	*sql;
+	char	name[PGSQL_STMT_NAME_LEN];
+	unsigned int hash;
+	struct lua_pg_stmt *chain;		/* next in the hash bucket */
+	struct lua_pg_stmt *newer;		/* LRU list, most recent first */
+	struct lua_pg_stmt *older;
+} lua_pg_stmt;
+
+/**
+* sql -> prepared statement cache of a connection, bounded to
+* `capacity' statements, the least recently used being deallocated.
+*/
+typedef struct {
+	lua_pg_stmt **buckets;
+	size_t	nbuckets;			/* power of two */
+	int		capacity;
+	int		used;
+	lua_pg_stmt *newest;
+	lua_pg_stmt *oldest;
+	unsigned long serial;		/* suffix of the next statement name */
+	long	hits;
+	long	misses;
+} lua_pg_stmt_cache;
+
+/* an idle connection of a pool */
+typedef struct lua_pg_pooled {
+	PGconn	*conn;
+	lua_pg_stmt_cache *stmts;	/* kept across checkouts */
+	double	idle_since;
+	struct lua_pg_pooled *next;
+} lua_pg_pooled;
+
+/**
+* Connections to one conninfo shared by every lua_State of the process,
+* created on demand up to `max' and never freed, as the type caches.
+*/
+typedef struct lua_pg_pool {
+	char	*conninfo;
+	int		min;
+	int		max;
+	double	idle_timeout;		/* seconds, 0 to keep idle connections */
+	int		open;				/* idle and checked out */
+	int		idle;
+	lua_pg_pooled *idles;		/* most recently checked in first */
+	long	waits;
+	long	timeouts;
+	long	creations;
+	long	discards;
+	long	reaped;
+	long	broken;				/* dropped by the checkout health check */
+#ifndef WIN32
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* signaled when a connection is returned */
+#endif
+	struct lua_pg_pool *next;
+} lua_pg_pool;
+
+/**
+* Parameter arrays of a connection, grown to the largest call and
+* reused by the next ones. Numbers and binary values are written to
+* the slot of their parameter, strings are sent in place.
+*/
+typedef struct {
+	int		size;
+	int		typed;				/* some types were given or guessed */
+	const char **values;
+	int		*lengths;
+	int		*formats;
+	Oid		*types;
+	char	*slots;				/* PGSQL_PARAM_SLOT bytes per parameter */
+} lua_pg_params;
+
+/* counters of db:stats(), times in seconds */
+typedef struct {
+	long	queries[PGSQL_KINDS];
+	long	round_trips;
+	long	reconnects;
+	long	retries;			/* statements sent again, or reconnects tried again */
+	double	bytes_sent;			/* query texts and parameter values */
+	double	bytes_received;		/* size of the results */
+	double	rows;
+	double	wait_time;			/* blocked on the socket */
+	double	parse_time;			/* in libpq, reading and parsing results */
+	double	convert_time;		/* building lua rows */
+	double	since;				/* monotonic time of the last reset */
+} lua_pg_stats;
+
+/* latency histogram of one statement, times in seconds */
+typedef struct {
+	char	*key;				/* statement name or query fingerprint */
+	unsigned int hash;
+	unsigned long count;
+	double	sum;
+	double	max;
+	unsigned int buckets[PGSQL_HIST_BUCKETS];
+} lua_pg_hist;
+
+/**
+* Latency histograms of the statements of a connection: at most
+* `capacity' of them, later statements sharing the `other' one.
+*/
+typedef struct {
+	int		capacity;
+	int		used;
+	size_t	nslots;				/* power of two, at least twice capacity */
+	int		*slots;				/* index + 1 in hists, 0 when free */
+	lua_pg_hist *hists;
+	lua_pg_hist other;
+} lua_pg_latency;
+
+/* when db:query(), db:query_params(), db:execute() and db:prepare() run again */
+typedef struct {
+	int		attempts;			/* 1 never retries */
+	double	delay;				/* seconds before the second attempt, doubling */
+	double	max_delay;
+	double	timeout;			/* seconds for a reconnect, 0 for connect_timeout */
+	int		idempotent_only;	/* resend after losing the connection only when idempotent */
+	int		nstates;
+	char	states[PGSQL_RETRY_STATES][6];	/* SQLSTATEs or classes to retry on */
+} lua_pg_retry;
+
+/* one protocol exchange of the trace ring */
+typedef struct {
+	double	time;				/* monotonic seconds */
+	double	length;				/* bytes sent, or size of the result */
+	char	dir;				/* '>' sent, '<' received */
+	char	type;				/* protocol message type */
+	char	state[6];			/* SQLSTATE of an error */
+	char	name[PGSQL_TRACE_NAME_LEN];	/* statement name or start of the query */
+} lua_pg_event;
+
+/* the last `size' protocol exchanges of a connection */
+typedef struct {
+	int		size;
+	unsigned long count;		/* ever recorded, the next goes to count % size */
+	char	name[PGSQL_TRACE_NAME_LEN];	/* statement of the exchange in progress */
+	lua_pg_event events[1];
+} lua_pg_ring;
+
 typedef struct {
     short   closed;
     int     env;
 	int		field_class;
-	int		field_types;
     int		lofd;
+	int		decode;				/* default for the results of this connection */
+	int		result_format;		/* default resultFormat, 1 for binary */
+	int		nonblocking;		/* send_* leave the flushing to db:flush() */
+	int		copy_start;			/* db:send_copy_out() sent, PGRES_COPY_OUT not read yet */
+	struct lua_pg_stream *stream;	/* db:stream() or db:copy_out() iterator reading it, NULL if none */
+	int		notify;				/* reference to the channel -> handler table */
     PGconn *conn;
+	lua_pg_type_cache *types;	/* NULL until the first type lookup */
+	lua_pg_stmt_cache *stmts;	/* NULL unless enabled */
+	lua_pg_pool *pool;			/* checked out of this pool */
+	int		dirty;				/* session state changed since checkout */
+	lua_pg_params params;
+	struct lua_pg_desc *descs;	/* statements of db:prepare(), most recently used first */
+	unsigned long session;		/* bumped by every reset */
+	lua_pg_stats stats;
+	lua_pg_latency *latency;	/* NULL unless enabled */
+	double	slow;				/* seconds from which on_slow is called */
+	int		on_slow;			/* reference to the slow query function */
+	int		in_hook;			/* running it, the connection is not to be used */
+	struct lua_pg_waitset *waitset;	/* watching the socket, NULL if none */
+	unsigned int ws_events;		/* epoll events it waits for */
+	lua_pg_ring *ring;			/* NULL until the first exchange */
+	int		ring_size;			/* 0 when disabled */
+	FILE	*trace;				/* file of db:trace() */
+	lua_pg_retry retry;
+	unsigned int seed;			/* of the backoff jitter */
 } lua_pg_conn;
 
+/* push a non NULL value of a result column */
+typedef void (*lua_pg_decoder) (lua_State *L, const char *value, int len);
+
+/**
+* Shape of a statement made by db:prepare(), from PQdescribePrepared,
+* so db:execute() neither guesses parameter types nor inspects every
+* result again.
+*/
+typedef struct lua_pg_desc {
+	char	*name;
+	char	*sql;
+	unsigned int hash;
+	unsigned long session;		/* of the connection it was prepared on */
+	int		nparams;
+	Oid		*params;			/* parameter types, NULL when unknown */
+	int		numcols;			/* -1 until described */
+	Oid		*types;				/* column types */
+	int		keys;				/* reference to the column names */
+	lua_pg_decoder *decoders[2];	/* per column, for text and binary results */
+	struct lua_pg_desc *next;
+} lua_pg_desc;
+
+/**
+* A statement run by luaM_exec(), counted as `kind'. A prepared
+* statement is run when `stmtname' is set, `query' being its text if
+* known. Parameters are in the arrays of the connection.
+*/
+typedef struct {
+	int		kind;
+	const char *query;
+	const char *stmtname;
+	int		nparams;
+	int		result_format;
+} lua_pg_call;
+
 typedef struct {
     short      closed;
     int        conn;               /* reference to connection */
     int        numcols;            /* number of columns */
 	int        row;
+	int        decode;             /* push typed values and pgsql.null */
+	int        keys;               /* reference to the column names */
     PGresult *res;
+	lua_pg_conn *owner;            /* kept alive by `conn' */
+	lua_pg_decoder *decoders;      /* one per column, chosen on first fetch */
 } lua_pg_res;
 
+typedef struct lua_pg_stream {
+    short      closed;             /* set once the last row was read */
+    int        conn;               /* reference to connection */
+    int        keys;               /* reference to the column names */
+    int        numcols;
+	int        decode;
+	int        copy;               /* COPY OUT: 1 for raw lines, 2 for rows */
+	lua_pg_conn *owner;
+	lua_pg_decoder *decoders;
+} lua_pg_stream;
+
+/**
+* Encode the lua value at `idx' in the binary format of a type. Fixed
+* width values are written to `buf' (16 bytes), others point `data' to
+* the bytes of a string kept on the stack. Returns the length.
+*/
+typedef int (*lua_pg_encoder) (lua_State *L, int idx, char *buf, const char **data);
+
+/* state of a db:copy_in() */
+typedef struct {
+	PGconn	*conn;
+	char	*buf;
+	size_t	len;
+	size_t	size;
+	int		columns;			/* fixed row width, 0 to use #row */
+	long	rows;
+	int		failed;				/* PQputCopyData failed */
+	lua_pg_encoder *encoders;	/* one per column for a binary COPY */
+} lua_pg_copy;
+
+/* connections watched by an epoll instance */
+typedef struct lua_pg_waitset {
+	int		epfd;				/* -1 once closed */
+	int		conns;				/* reference to the lua_pg_conn pointer -> connection table */
+	int		count;
+	int		size;				/* of events */
+#ifdef __linux__
+	struct epoll_event *events;
+#endif
+} lua_pg_waitset;
+
+static lua_pg_type_cache *type_caches = NULL;
+static lua_pg_pool *pools = NULL;
+
+static long live_conns = 0;
+static long live_results = 0;
+
 void luaM_setmeta (lua_State *L, const char *name);
-int luaM_register (lua_State *L, const char *name, const luaL_reg *methods);
+int luaM_register (lua_State *L, const char *name, const luaL_reg *methods, lua_CFunction gc);
 int luaopen_pgsql (lua_State *L);
-int Lpg_get_field_types_hash (lua_State *L, PGconn *conn);
 int Lpg_get_field_class_hash (lua_State *L, PGconn *conn);
-void luaM_regconst(lua_State *L, const char *name, long value);
 
-/* set const */
+/* named constants accepted as strings, e.g. by fetch_array() */
+static const struct {
+	const char *name;
+	long value;
+} luaM_consts[] = {
+	/* For pg_fetch_array() */
+	{ "PGSQL_ASSOC", PGSQL_ASSOC },
+	{ "PGSQL_NUM", PGSQL_NUM },
+	{ "PGSQL_BOTH", PGSQL_BOTH },
+	/* For pg_connection_status() */
+	{ "PGSQL_CONNECTION_BAD", CONNECTION_BAD },
+	{ "PGSQL_CONNECTION_OK", CONNECTION_OK },
+	/* For pg_transaction_status() */
+	{ "PGSQL_TRANSACTION_IDLE", PQTRANS_IDLE },
+	{ "PGSQL_TRANSACTION_ACTIVE", PQTRANS_ACTIVE },
+	{ "PGSQL_TRANSACTION_INTRANS", PQTRANS_INTRANS },
+	{ "PGSQL_TRANSACTION_INERROR", PQTRANS_INERROR },
+	{ "PGSQL_TRANSACTION_UNKNOWN", PQTRANS_UNKNOWN },
+	/* For pg_set_error_verbosity() */
+	{ "PGSQL_ERRORS_TERSE", PQERRORS_TERSE },
+	{ "PGSQL_ERRORS_DEFAULT", PQERRORS_DEFAULT },
+	{ "PGSQL_ERRORS_VERBOSE", PQERRORS_VERBOSE },
+	/* For lo_seek() */
+	{ "PGSQL_SEEK_SET", SEEK_SET },
+	{ "PGSQL_SEEK_CUR", SEEK_CUR },
+	{ "PGSQL_SEEK_END", SEEK_END },
+	/* For pg_result_status() return value type */
+	{ "PGSQL_STATUS_LONG", PGSQL_STATUS_LONG },
+	{ "PGSQL_STATUS_STRING", PGSQL_STATUS_STRING },
+	/* For pg_result_status() return value */
+	{ "PGSQL_EMPTY_QUERY", PGRES_EMPTY_QUERY },
+	{ "PGSQL_COMMAND_OK", PGRES_COMMAND_OK },
+	{ "PGSQL_TUPLES_OK", PGRES_TUPLES_OK },
+	{ "PGSQL_COPY_OUT", PGRES_COPY_OUT },
+	{ "PGSQL_COPY_IN", PGRES_COPY_IN },
+	{ "PGSQL_BAD_RESPONSE", PGRES_BAD_RESPONSE },
+	{ "PGSQL_NONFATAL_ERROR", PGRES_NONFATAL_ERROR },
+	{ "PGSQL_FATAL_ERROR", PGRES_FATAL_ERROR },
+	/* For pg_result_error_field() field codes */
+	{ "PGSQL_DIAG_SEVERITY", PG_DIAG_SEVERITY },
+	{ "PGSQL_DIAG_SQLSTATE", PG_DIAG_SQLSTATE },
+	{ "PGSQL_DIAG_MESSAGE_PRIMARY", PG_DIAG_MESSAGE_PRIMARY },
+	{ "PGSQL_DIAG_MESSAGE_DETAIL", PG_DIAG_MESSAGE_DETAIL },
+	{ "PGSQL_DIAG_MESSAGE_HINT", PG_DIAG_MESSAGE_HINT },
+	{ "PGSQL_DIAG_STATEMENT_POSITION", PG_DIAG_STATEMENT_POSITION },
+	{ "PGSQL_DIAG_INTERNAL_POSITION", PG_DIAG_INTERNAL_POSITION },
+	{ "PGSQL_DIAG_INTERNAL_QUERY", PG_DIAG_INTERNAL_QUERY },
+	{ "PGSQL_DIAG_CONTEXT", PG_DIAG_CONTEXT },
+	{ "PGSQL_DIAG_SOURCE_FILE", PG_DIAG_SOURCE_FILE },
+	{ "PGSQL_DIAG_SOURCE_LINE", PG_DIAG_SOURCE_LINE },
+	{ "PGSQL_DIAG_SOURCE_FUNCTION", PG_DIAG_SOURCE_FUNCTION },
+	/* pg_convert options */
+	//{ "PGSQL_CONV_IGNORE_DEFAULT", PGSQL_CONV_IGNORE_DEFAULT },
+	//{ "PGSQL_CONV_FORCE_NULL", PGSQL_CONV_FORCE_NULL },
+	//{ "PGSQL_CONV_IGNORE_NOT_NULL", PGSQL_CONV_IGNORE_NOT_NULL },
+	/* pg_insert/update/delete/select options */
+	//{ "PGSQL_DML_NO_CONV", PGSQL_DML_NO_CONV },
+	//{ "PGSQL_DML_EXEC", PGSQL_DML_EXEC },
+	//{ "PGSQL_DML_ASYNC", PGSQL_DML_ASYNC },
+	//{ "PGSQL_DML_STRING", PGSQL_DML_STRING },
+	{ NULL, 0 }
+};
+
+/* value of the constant `defined', 0 if unknown */
 static int luaM_const (lua_State *L, const char *defined) {
+	int i;
 
-	lua_newtable(L);
-    /* For pg_fetch_array() */
-	luaM_regconst(L, "PGSQL_ASSOC", PGSQL_ASSOC);
-	luaM_regconst(L, "PGSQL_NUM", PGSQL_NUM);
-	luaM_regconst(L, "PGSQL_BOTH", PGSQL_BOTH);
-    /* For pg_connection_status() */
-	luaM_regconst(L, "PGSQL_CONNECTION_BAD", CONNECTION_BAD);
-	luaM_regconst(L, "PGSQL_CONNECTION_OK", CONNECTION_OK);
-    /* For pg_transaction_status() */
-	luaM_regconst(L, "PGSQL_TRANSACTION_IDLE", PQTRANS_IDLE);
-	luaM_regconst(L, "PGSQL_TRANSACTION_ACTIVE", PQTRANS_ACTIVE);
-	luaM_regconst(L, "PGSQL_TRANSACTION_INTRANS", PQTRANS_INTRANS);
-	luaM_regconst(L, "PGSQL_TRANSACTION_INERROR", PQTRANS_INERROR);
-	luaM_regconst(L, "PGSQL_TRANSACTION_UNKNOWN", PQTRANS_UNKNOWN);
-    /* For pg_set_error_verbosity() */
-	luaM_regconst(L, "PGSQL_ERRORS_TERSE", PQERRORS_TERSE);
-	luaM_regconst(L, "PGSQL_ERRORS_DEFAULT", PQERRORS_DEFAULT);
-	luaM_regconst(L, "PGSQL_ERRORS_VERBOSE", PQERRORS_VERBOSE);
-    /* For lo_seek() */
-	luaM_regconst(L, "PGSQL_SEEK_SET", SEEK_SET);
-	luaM_regconst(L, "PGSQL_SEEK_CUR", SEEK_CUR);
-	luaM_regconst(L, "PGSQL_SEEK_END", SEEK_END);
-    /* For pg_result_status() return value type */
-	luaM_regconst(L, "PGSQL_STATUS_LONG", PGSQL_STATUS_LONG);
-	luaM_regconst(L, "PGSQL_STATUS_STRING", PGSQL_STATUS_STRING);
-    /* For pg_result_status() return value */
-	luaM_regconst(L, "PGSQL_EMPTY_QUERY", PGRES_EMPTY_QUERY);
-	luaM_regconst(L, "PGSQL_COMMAND_OK", PGRES_COMMAND_OK);
-	luaM_regconst(L, "PGSQL_TUPLES_OK", PGRES_TUPLES_OK);
-	luaM_regconst(L, "PGSQL_COPY_OUT", PGRES_COPY_OUT);
-	luaM_regconst(L, "PGSQL_COPY_IN", PGRES_COPY_IN);
-	luaM_regconst(L, "PGSQL_BAD_RESPONSE", PGRES_BAD_RESPONSE);
-	luaM_regconst(L, "PGSQL_NONFATAL_ERROR", PGRES_NONFATAL_ERROR);
-	luaM_regconst(L, "PGSQL_FATAL_ERROR", PGRES_FATAL_ERROR);
-    /* For pg_result_error_field() field codes */
-	luaM_regconst(L, "PGSQL_DIAG_SEVERITY", PG_DIAG_SEVERITY);
-	luaM_regconst(L, "PGSQL_DIAG_SQLSTATE", PG_DIAG_SQLSTATE);
-	luaM_regconst(L, "PGSQL_DIAG_MESSAGE_PRIMARY", PG_DIAG_MESSAGE_PRIMARY);
-	luaM_regconst(L, "PGSQL_DIAG_MESSAGE_DETAIL", PG_DIAG_MESSAGE_DETAIL);
-	luaM_regconst(L, "PGSQL_DIAG_MESSAGE_HINT", PG_DIAG_MESSAGE_HINT);
-	luaM_regconst(L, "PGSQL_DIAG_STATEMENT_POSITION", PG_DIAG_STATEMENT_POSITION);
-	luaM_regconst(L, "PGSQL_DIAG_INTERNAL_POSITION", PG_DIAG_INTERNAL_POSITION);
-	luaM_regconst(L, "PGSQL_DIAG_INTERNAL_QUERY", PG_DIAG_INTERNAL_QUERY);
-	luaM_regconst(L, "PGSQL_DIAG_CONTEXT", PG_DIAG_CONTEXT);
-	luaM_regconst(L, "PGSQL_DIAG_SOURCE_FILE", PG_DIAG_SOURCE_FILE);
-	luaM_regconst(L, "PGSQL_DIAG_SOURCE_LINE", PG_DIAG_SOURCE_LINE);
-	luaM_regconst(L, "PGSQL_DIAG_SOURCE_FUNCTION", PG_DIAG_SOURCE_FUNCTION);
-    /* pg_convert options */
-	//luaM_regconst(L, "PGSQL_CONV_IGNORE_DEFAULT", PGSQL_CONV_IGNORE_DEFAULT);
-	//luaM_regconst(L, "PGSQL_CONV_FORCE_NULL", PGSQL_CONV_FORCE_NULL);
-	//luaM_regconst(L, "PGSQL_CONV_IGNORE_NOT_NULL", PGSQL_CONV_IGNORE_NOT_NULL);
-    /* pg_insert/update/delete/select options */
-	//luaM_regconst(L, "PGSQL_DML_NO_CONV", PGSQL_DML_NO_CONV);
-	//luaM_regconst(L, "PGSQL_DML_EXEC", PGSQL_DML_EXEC);
-	//luaM_regconst(L, "PGSQL_DML_ASYNC", PGSQL_DML_ASYNC);
-	//luaM_regconst(L, "PGSQL_DML_STRING", PGSQL_DML_STRING);
-
-	lua_pushstring(L, defined);	
-	lua_gettable(L, -2); 
-	
-	int ct = lua_tonumber(L, -1);
-	lua_pop(L, 1);
-
-	return ct;
+	for (i = 0; luaM_consts[i].name != NULL; i++) {
+		if (strcmp(luaM_consts[i].name, defined) == 0) {
+			return (int)luaM_consts[i].value;
+		}
+	}
+	return 0;
 }
 
 /**                   
@@ -179,11 +553,6 @@ static int luaM_tostring (lua_State *L) {
     return 1;                            
 }       
 
-void luaM_regconst(lua_State *L, const char *name, long value) {
-	lua_pushstring(L, name);
-	lua_pushnumber(L, value);
-	lua_rawset(L, -3);
-}
 
 /**
 * Define the metatable for the object on top of the stack
@@ -196,7 +565,7 @@ void luaM_setmeta (lua_State *L, const char *name) {
 /**
 * Create a metatable and leave it on top of the stack.
 */
-int luaM_register (lua_State *L, const char *name, const luaL_reg *methods) {
+int luaM_register (lua_State *L, const char *name, const luaL_reg *methods, lua_CFunction gc) {
     if (!luaL_newmetatable (L, name))
         return 0;
 
@@ -205,7 +574,7 @@ int luaM_register (lua_State *L, const char *name, const luaL_reg *methods) {
 
     /* define metamethods */
     lua_pushliteral (L, "__gc");
-    lua_pushcfunction (L, methods->func);
+    lua_pushcfunction (L, gc);
     lua_settable (L, -3);
 
     lua_pushliteral (L, "__index");
@@ -247,6 +616,120 @@ static void luaM_pushvalue (lua_State *L, void *row, long int len) {
         lua_pushlstring (L, row, len);
 }
 
+/**
+* Is the value at `idx' nil or pgsql.null?
+*/
+static int luaM_isnull (lua_State *L, int idx) {
+	return lua_isnoneornil(L, idx) || (lua_islightuserdata(L, idx) && lua_touserdata(L, idx) == NULL);
+}
+
+/* seconds on a monotonic clock */
+static double luaM_now (void) {
+#ifdef WIN32
+	return GetTickCount64() / 1000.0;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void luaM_sleep (double secs) {
+#ifdef WIN32
+	Sleep((DWORD)(secs * 1000));
+#else
+	struct timespec ts;
+	ts.tv_sec = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+#endif
+}
+
+/**
+* Trace Part
+*/
+
+/**
+* Record a protocol exchange in the trace ring of a connection,
+* allocated on first use. `name' is the statement a message is sent
+* for, NULL for what is received, which is filed under the statement
+* last sent.
+*/
+static void luaM_ring_push (lua_pg_conn *my_conn, char dir, char type, double length,
+		const char *name, const char *state) {
+	lua_pg_ring *r = my_conn->ring;
+	lua_pg_event *e;
+
+	if (r == NULL) {
+		if (my_conn->ring_size <= 0) {
+			return;
+		}
+		r = (lua_pg_ring *)calloc(1, sizeof(lua_pg_ring) + (my_conn->ring_size - 1) * sizeof(lua_pg_event));
+		if ((my_conn->ring = r) == NULL) {
+			return;
+		}
+		r->size = my_conn->ring_size;
+	}
+
+	if (name != NULL) {
+		strncpy(r->name, name, PGSQL_TRACE_NAME_LEN - 1);
+	}
+	e = &r->events[r->count++ % r->size];
+	e->time = luaM_now();
+	e->dir = dir;
+	e->type = type;
+	e->length = length;
+	memcpy(e->name, r->name, PGSQL_TRACE_NAME_LEN);
+	if (state != NULL) {
+		strncpy(e->state, state, sizeof(e->state) - 1);
+	} else {
+		e->state[0] = '\0';
+	}
+}
+
+/**
+* Record a result: T for rows, C for a command, E for an error (with
+* its SQLSTATE), I for an empty query, G/H/W when COPY starts, Z for
+* a pipeline sync. The length is the size of the result.
+*/
+static void luaM_ring_result (lua_pg_conn *my_conn, PGresult *res) {
+	char type;
+
+	switch (PQresultStatus(res)) {
+		case PGRES_TUPLES_OK:
+			type = 'T';
+			break;
+		case PGRES_SINGLE_TUPLE:
+			/* rows of db:stream() would flood the ring */
+			return;
+		case PGRES_COMMAND_OK:
+			type = 'C';
+			break;
+		case PGRES_EMPTY_QUERY:
+			type = 'I';
+			break;
+		case PGRES_COPY_IN:
+			type = 'G';
+			break;
+		case PGRES_COPY_OUT:
+			type = 'H';
+			break;
+		case PGRES_COPY_BOTH:
+			type = 'W';
+			break;
+#ifdef LIBPQ_HAS_PIPELINING
+		case PGRES_PIPELINE_SYNC:
+			type = 'Z';
+			break;
+#endif
+		default:
+			luaM_ring_push(my_conn, '<', 'E', luaM_result_size(res), NULL,
+					PQresultErrorField(res, PG_DIAG_SQLSTATE));
+			return;
+	}
+	luaM_ring_push(my_conn, '<', type, luaM_result_size(res), NULL, NULL);
+}
+
 /**
 * Handle Part
 */
@@ -258,6 +741,7 @@ static lua_pg_conn *Mget_conn (lua_State *L) {
     lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 1, LUA_PGSQL_CONN);
     luaL_argcheck (L, my_conn != NULL, 1, "connection expected");
     luaL_argcheck (L, !my_conn->closed, 1, "connection is closed");
+    luaL_argcheck (L, !my_conn->in_hook, 1, "connection in use by its slow query function");
     return my_conn;
 }
 
@@ -271,1888 +755,6865 @@ static lua_pg_res *Mget_res (lua_State *L) {
     return my_res;
 }
 
+static lua_pg_stream *Mget_stream (lua_State *L) {
+    lua_pg_stream *my_stream = (lua_pg_stream *)luaL_checkudata (L, 1, LUA_PGSQL_STREAM);
+    luaL_argcheck (L, my_stream != NULL, 1, "stream expected");
+    return my_stream;
+}
+
+/* ask the server to cancel what runs on `conn', without waiting for it */
+static void luaM_cancel (PGconn *conn) {
+	PGcancel *cancel;
+	char errbuf[256];
+
+	if ((cancel = PQgetCancel(conn)) != NULL) {
+		PQcancel(cancel, errbuf, sizeof(errbuf));
+		PQfreeCancel(cancel);
+	}
+}
+
 /**
-* PGSQL operate functions
+* Discard every pending result. A COPY in progress is ended on the way,
+* as PQgetResult would return its PGRES_COPY_* result for ever: a COPY
+* IN is aborted, a COPY OUT cancelled and read to its end. With
+* `failed', the first error result is kept there for the caller to
+* clear. Returns the number of results discarded.
 */
+static int luaM_drain (PGconn *conn, PGresult **failed) {
+	PGresult *res;
+	ExecStatusType status;
+	char *buf;
+	int n = 0, len;
+
+	while ((res = PQgetResult(conn))) {
+		n++;
+		status = PQresultStatus(res);
+		if (failed != NULL && *failed == NULL && (status == PGRES_FATAL_ERROR
+				|| status == PGRES_BAD_RESPONSE || status == PGRES_NONFATAL_ERROR)) {
+			*failed = res;
+		} else {
+			PQclear(res);
+		}
+		if (status == PGRES_COPY_OUT) {
+			luaM_cancel(conn);
+			while ((len = PQgetCopyData(conn, &buf, 0)) > 0) {
+				PQfreemem(buf);
+			}
+			if (len == -2) {
+				break;
+			}
+		} else if (status == PGRES_COPY_IN) {
+			if (PQputCopyEnd(conn, "aborted by the client") < 0) {
+				break;
+			}
+		} else if (PQstatus(conn) == CONNECTION_BAD) {
+			break;
+		}
+	}
+	return n;
+}
 
 /**
-* Open a connection to a PgSQL Server
+* Stop the stream: a query still running is cancelled and its pending
+* results are discarded, so the connection is ready for the next one.
+* Only while it is the active stream of its connection: once another
+* command ended it, what runs on the connection is no longer its own.
 */
-static int Lpg_connect (lua_State *L) {
-    const char *conninfo = luaL_optstring(L, 1, "dbname = postgres");
-
-	PGconn *conn = PQconnectdb(conninfo);
+static void luaM_stream_close (lua_State *L, lua_pg_stream *my_stream, int drain) {
+	int active;
 
-	if (conn == NULL) {
-        luaM_msg (L, 0, "Unable to connect to PostgreSQL server");
-		return 2;
+	if (my_stream->closed) {
+		return;
+	}
+	my_stream->closed = 1;
+	if ((active = my_stream->owner->stream == my_stream)) {
+		my_stream->owner->stream = NULL;
 	}
-    else if (PQstatus(conn) != CONNECTION_OK) {
-		luaM_msg(L, 0, PQerrorMessage(conn));
-        PQfinish(conn);
-        return 2;
-    }
 
-	int ft = Lpg_get_field_types_hash(L, conn);
-	int fc = Lpg_get_field_class_hash(L, conn);
+	/* luaM_drain cancels the COPY OUT of db:copy_out() */
+	if (drain && active && ! my_stream->owner->closed) {
+		if (PQisBusy(my_stream->owner->conn)) {
+			luaM_cancel(my_stream->owner->conn);
+		}
+		luaM_drain(my_stream->owner->conn, NULL);
+	}
 
-    lua_pg_conn *my_conn = (lua_pg_conn *)lua_newuserdata(L, sizeof(lua_pg_conn));
-    luaM_setmeta (L, LUA_PGSQL_CONN);
+	free(my_stream->decoders);
+	my_stream->decoders = NULL;
+	luaL_unref (L, LUA_REGISTRYINDEX, my_stream->keys);
+	luaL_unref (L, LUA_REGISTRYINDEX, my_stream->conn);
+	my_stream->keys = LUA_NOREF;
+	my_stream->conn = LUA_NOREF;
+}
 
-    /* fill in structure */
-    my_conn->closed = 0;
-    my_conn->env = LUA_NOREF;
-    my_conn->conn = conn;
-	my_conn->field_types = ft;
-	my_conn->field_class = fc;
+/**
+* The connection of a method about to run a command: the db:stream()
+* or db:copy_out() iterator still reading it, left by a `break', is
+* ended first instead of waiting for the garbage collector.
+*/
+static lua_pg_conn *Mget_idle_conn (lua_State *L) {
+	lua_pg_conn *my_conn = Mget_conn (L);
 
-	return 1;
+	if (my_conn->stream != NULL) {
+		luaM_stream_close(L, my_conn->stream, 1);
+	}
+	return my_conn;
 }
 
-int Lpg_get_field_types_hash (lua_State *L, PGconn *conn) {
-	PGresult *res;
+/**
+* Wrap `res' in a new result object and leave it on top of the stack.
+* The connection owning the result is expected at index 1.
+*/
+static lua_pg_res *Mnew_res (lua_State *L, lua_pg_conn *my_conn, PGresult *res) {
+	lua_pg_res *my_res = (lua_pg_res *)lua_newuserdata(L, sizeof(lua_pg_res));
+	luaM_setmeta (L, LUA_PGSQL_RES);
+
+	/* fill in structure */
+	my_res->closed = 0;
+	my_res->row = 0;
+	my_res->conn = LUA_NOREF;
+	my_res->numcols = PQnfields(res);
+	my_res->res = res;
+	my_res->owner = my_conn;
+	my_res->decode = my_conn->decode || PQbinaryTuples(res);
+	my_res->decoders = NULL;
+	my_res->keys = LUA_NOREF;
+	luaM_count(live_results, 1);
 
-	lua_newtable (L); /* field types result */
+	lua_pushvalue(L, 1);
 
-	/* hash all oid's */
-	if ((res = PQexec(conn, "select oid,typname from pg_type")) == NULL || PQresultStatus(res) != PGRES_TUPLES_OK) {
-		if (res) {
-			PQclear(res);
-		}
-	} else {
+	my_res->conn = luaL_ref (L, LUA_REGISTRYINDEX);
 
-		int i,num_rows;
-		int oid_offset,name_offset;
-		char *tmp_oid, *tmp_name;
+	return my_res;
+}
 
-		num_rows = PQntuples(res);
-		oid_offset = PQfnumber(res, "oid");
-		name_offset = PQfnumber(res, "typname");
+/**
+* Decoder Part
+*/
 
+static void luaM_decode_text (lua_State *L, const char *value, int len) {
+	lua_pushlstring(L, value, len);
+}
 
-		for ( i = 0; i < num_rows; i++) {
-			if ((tmp_oid = PQgetvalue(res, i, oid_offset)) == NULL) {
-				continue;
-			}
+static void luaM_decode_int (lua_State *L, const char *value, int len) {
+	lua_pushnumber(L, (lua_Number)strtol(value, NULL, 10));
+}
 
-			if ((tmp_name = PQgetvalue(res, i, name_offset)) == NULL) {
-				continue;
-			}
+static void luaM_decode_int8 (lua_State *L, const char *value, int len) {
+	long long n = strtoll(value, NULL, 10);
 
-			luaM_pushvalue(L, tmp_name, strlen(tmp_name));
-			lua_rawseti(L, -2, atoi(tmp_oid));
-		}
-		PQclear(res);
+	/* keep the digits rather than silently rounding */
+	if (n > PGSQL_MAX_EXACT_INT || n < -PGSQL_MAX_EXACT_INT) {
+		lua_pushlstring(L, value, len);
+	} else {
+		lua_pushnumber(L, (lua_Number)n);
 	}
-
-	return luaL_ref (L, LUA_REGISTRYINDEX);
 }
 
-int Lpg_get_field_class_hash (lua_State *L, PGconn *conn) {
-
-	lua_newtable (L); /* field tables result */
+static void luaM_decode_float (lua_State *L, const char *value, int len) {
+	lua_pushnumber(L, (lua_Number)strtod(value, NULL));
+}
 
-	return luaL_ref (L, LUA_REGISTRYINDEX);
+static void luaM_decode_bool (lua_State *L, const char *value, int len) {
+	lua_pushboolean(L, value[0] == 't');
 }
 
-static int Lpg_host (lua_State *L) {
-    lua_pushstring(L, PQhost(Mget_conn(L)->conn));
-    return 1;
+static unsigned int luaM_get_uint32 (const char *value) {
+	const unsigned char *p = (const unsigned char *)value;
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
 }
 
-static int Lpg_port (lua_State *L) {
-    lua_pushstring(L, PQport(Mget_conn(L)->conn));
-    return 1;
+static long long luaM_get_int64 (const char *value) {
+	return (long long)(((unsigned long long)luaM_get_uint32(value) << 32) | luaM_get_uint32(value + 4));
 }
 
-static int Lpg_dbname (lua_State *L) {
-    lua_pushstring(L, PQdb(Mget_conn(L)->conn));
-    return 1;
+static void luaM_decode_bin_int2 (lua_State *L, const char *value, int len) {
+	const unsigned char *p = (const unsigned char *)value;
+	lua_pushnumber(L, (short)((p[0] << 8) | p[1]));
 }
 
-static int Lpg_tty (lua_State *L) {
-    lua_pushstring(L, PQtty(Mget_conn(L)->conn));
-    return 1;
+static void luaM_decode_bin_int4 (lua_State *L, const char *value, int len) {
+	lua_pushnumber(L, (int)luaM_get_uint32(value));
 }
 
-static int Lpg_get_pid (lua_State *L) {
-    lua_pushnumber(L, PQbackendPID(Mget_conn(L)->conn));
-    return 1;
+static void luaM_decode_bin_oid (lua_State *L, const char *value, int len) {
+	lua_pushnumber(L, luaM_get_uint32(value));
 }
 
-static int Lpg_do_get_field_name (lua_State *L, Oid oid) {
-	lua_rawgeti (L, LUA_REGISTRYINDEX, Mget_conn(L)->field_types);
+static void luaM_decode_bin_int8 (lua_State *L, const char *value, int len) {
+	long long n = luaM_get_int64(value);
 
-    if ( ! lua_istable(L, -1)) {
-		lua_pushboolean(L, 0);
-		lua_pushstring(L, "get `field_types' info error!");
-		return 2;
+	if (n > PGSQL_MAX_EXACT_INT || n < -PGSQL_MAX_EXACT_INT) {
+		char buf[PGSQL_MAX_LENGTH_OF_LONG];
+		snprintf(buf, sizeof(buf), "%lld", n);
+		lua_pushstring(L, buf);
+	} else {
+		lua_pushnumber(L, (lua_Number)n);
 	}
+}
 
-	if ( ! oid) return 1; /* return all field name in a table */
-
-	lua_pushnumber(L, oid);
-	lua_gettable(L, -2); 
+static void luaM_decode_bin_float4 (lua_State *L, const char *value, int len) {
+	union { unsigned int i; float f; } u;
+	u.i = luaM_get_uint32(value);
+	lua_pushnumber(L, u.f);
+}
 
-	return 1;
+static void luaM_decode_bin_float8 (lua_State *L, const char *value, int len) {
+	union { long long i; double f; } u;
+	u.i = luaM_get_int64(value);
+	lua_pushnumber(L, u.f);
 }
 
-static int Lpg_get_field_name (lua_State *L) {
-    lua_Number oid = luaL_optnumber(L, 2, 0);
-	return Lpg_do_get_field_name (L, oid);
+static void luaM_decode_bin_bool (lua_State *L, const char *value, int len) {
+	lua_pushboolean(L, value[0] != 0);
 }
 
-static int Lpg_do_get_field_table (lua_State *L, Oid oid, int force) {
-	const char *sql;
-	PGresult *res;
+static void luaM_decode_bin_uuid (lua_State *L, const char *value, int len) {
+	static const char hex[] = "0123456789abcdef";
+	char buf[36];
+	int i, j = 0;
 
-	if (! oid) {
-		return 1;
+	for (i = 0; i < 16; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10) {
+			buf[j++] = '-';
+		}
+		buf[j++] = hex[((unsigned char)value[i]) >> 4];
+		buf[j++] = hex[((unsigned char)value[i]) & 0x0f];
 	}
+	lua_pushlstring(L, buf, sizeof(buf));
+}
 
-	lua_pg_conn *my_conn = Mget_conn (L);
-	lua_rawgeti (L, LUA_REGISTRYINDEX, my_conn->field_class);
+/* jsonb is sent as a version byte followed by the json text */
+static void luaM_decode_bin_jsonb (lua_State *L, const char *value, int len) {
+	lua_pushlstring(L, value + 1, len - 1);
+}
 
-	if ( ! force) { /* return field_table form cache hash */
-		const char *name;
-		lua_pushnumber(L, oid);
-		lua_gettable(L, -2); 
-		name = lua_tolstring(L, -1, NULL);
-		lua_pop(L, 1);
-		
-		if (name != NULL) {
-			lua_pushstring(L, name);
-			return 1;
-		}
+/**
+* Format days since 2000-01-01 as YYYY-MM-DD, the text output of a date.
+*/
+static int luaM_format_date (char *buf, size_t size, long long days) {
+	long long z = days + PGSQL_EPOCH_DAYS;
+	long long era = (z >= 0 ? z : z - 146096) / 146097;
+	long long doe = z - era * 146097;
+	long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	long long mp = (5 * doy + 2) / 153;
+	long long d = doy - (153 * mp + 2) / 5 + 1;
+	long long m = mp < 10 ? mp + 3 : mp - 9;
+	long long y = yoe + era * 400 + (m <= 2);
+
+	if (y <= 0) {
+		return snprintf(buf, size, "%04lld-%02lld-%02lld BC", 1 - y, m, d);
 	}
+	return snprintf(buf, size, "%04lld-%02lld-%02lld", y, m, d);
+}
 
-	lua_pushfstring(L, "select oid,relname from pg_class where oid=%d", oid);
-	sql = lua_tolstring(L, -1, NULL);
-	lua_pop(L, 1);
+static void luaM_decode_bin_date (lua_State *L, const char *value, int len) {
+	char buf[32];
+	int days = (int)luaM_get_uint32(value);
 
-	if ((res = PQexec(my_conn->conn, sql)) == NULL || PQresultStatus(res) != PGRES_TUPLES_OK) {
-		if (res) {
-			PQclear(res);
-		}
+	if (days == 0x7fffffff) {
+		lua_pushliteral(L, "infinity");
+	} else if (days == (int)0x80000000) {
+		lua_pushliteral(L, "-infinity");
 	} else {
+		luaM_format_date(buf, sizeof(buf), days);
+		lua_pushstring(L, buf);
+	}
+}
 
-		int i,num_rows;
-		int oid_offset,class_offset;
-		char *tmp_oid, *tmp_name;
+/**
+* Push microseconds since 2000-01-01 like the ISO text output,
+* timestamptz values are given in UTC.
+*/
+static void luaM_push_timestamp (lua_State *L, long long usecs, const char *zone) {
+	char buf[64];
+	long long days, time;
+	char *bc;
+	int n, frac;
+
+	if (usecs == 0x7fffffffffffffffLL) {
+		lua_pushliteral(L, "infinity");
+		return;
+	}
+	if (usecs == (long long)0x8000000000000000ULL) {
+		lua_pushliteral(L, "-infinity");
+		return;
+	}
 
-		num_rows = PQntuples(res);
-		oid_offset = PQfnumber(res, "oid");
-		class_offset = PQfnumber(res, "relname");
+	days = usecs / PGSQL_USECS_PER_DAY;
+	time = usecs % PGSQL_USECS_PER_DAY;
+	if (time < 0) {
+		time += PGSQL_USECS_PER_DAY;
+		days--;
+	}
 
+	n = luaM_format_date(buf, sizeof(buf), days);
+	bc = strstr(buf, " BC");
+	if (bc != NULL) {
+		n -= 3;
+	}
+	n += snprintf(buf + n, sizeof(buf) - n, " %02d:%02d:%02d",
+			(int)(time / 3600000000LL), (int)(time / 60000000LL % 60), (int)(time / 1000000LL % 60));
+
+	/* fractional seconds without their trailing zeros */
+	if ((frac = (int)(time % 1000000LL)) != 0) {
+		int digits = 6;
+		while (frac % 10 == 0) {
+			frac /= 10;
+			digits--;
+		}
+		n += snprintf(buf + n, sizeof(buf) - n, ".%0*d", digits, frac);
+	}
+	snprintf(buf + n, sizeof(buf) - n, "%s%s", zone, bc != NULL ? " BC" : "");
+	lua_pushstring(L, buf);
+}
 
-		for ( i = 0; i < num_rows; i++) {
-			if ((tmp_oid = PQgetvalue(res, i, oid_offset)) == NULL) {
-				continue;
-			}
+static void luaM_decode_bin_timestamp (lua_State *L, const char *value, int len) {
+	luaM_push_timestamp(L, luaM_get_int64(value), "");
+}
 
-			if ((tmp_name = PQgetvalue(res, i, class_offset)) == NULL) {
-				continue;
-			}
+static void luaM_decode_bin_timestamptz (lua_State *L, const char *value, int len) {
+	luaM_push_timestamp(L, luaM_get_int64(value), "+00");
+}
 
-			luaM_pushvalue(L, tmp_name, strlen(tmp_name));
-			lua_rawseti(L, -2, atoi(tmp_oid));
-		}
-		PQclear(res);
+/**
+* Binary numerics are base 10000 digits, decoded to a number like the
+* text decoder does.
+*/
+static void luaM_decode_bin_numeric (lua_State *L, const char *value, int len) {
+	const unsigned char *p = (const unsigned char *)value;
+	int ndigits = (p[0] << 8) | p[1];
+	int weight = (short)((p[2] << 8) | p[3]);
+	int sign = (p[4] << 8) | p[5];
+	lua_Number n = 0, scale = 1;
+	int i;
+
+	if (sign == 0xC000) {		/* NaN */
+		lua_pushnumber(L, 0.0 / 0.0);
+		return;
 	}
-
-    if ( ! lua_istable(L, -1)) {
-		lua_pushboolean(L, 0);
-		lua_pushstring(L, "get `field_types' info error!");
-		return 2;
+	if (sign == 0xD000 || sign == 0xF000) {	/* +/- Infinity */
+		lua_pushnumber(L, sign == 0xD000 ? 1.0 / 0.0 : -1.0 / 0.0);
+		return;
 	}
 
-	lua_pushnumber(L, oid);
-	lua_gettable(L, -2); 
+	for (i = 0; i < ndigits && 8 + i * 2 + 1 < len; i++) {
+		n = n * 10000 + ((p[8 + i * 2] << 8) | p[8 + i * 2 + 1]);
+	}
+	/* the digits read so far stand for 10000^(weight - ndigits + 1) units */
+	for (i = weight - ndigits + 1; i > 0; i--) {
+		scale *= 10000;
+	}
+	for (; i < 0; i++) {
+		scale /= 10000;
+	}
+	n *= scale;
 
-	return 1;
+	lua_pushnumber(L, sign == 0x4000 ? -n : n);
 }
 
+/* binary values of the other types, whose raw bytes would mean nothing in lua */
+static void luaM_decode_bin_unsupported (lua_State *L, const char *value, int len) {
+	luaL_error(L, "Binary results of this column type are not supported, request a text result");
+}
 
-static int Lpg_get_field_table (lua_State *L) {
-    lua_Number oid = luaL_optnumber(L, 2, 0);
-    lua_Number is_force = luaL_optnumber(L, 3, 0);
-	return Lpg_do_get_field_table (L, oid, is_force);
+/**
+* Binary decoder of `type'. The text types, json and bytea are pushed
+* as raw bytes, which is the value itself.
+*/
+static lua_pg_decoder luaM_binary_decoder (Oid type) {
+	switch (type) {
+		case PGSQL_TEXTOID:
+		case PGSQL_VARCHAROID:
+		case PGSQL_BPCHAROID:
+		case PGSQL_NAMEOID:
+		case PGSQL_JSONOID:
+		case PGSQL_BYTEAOID:
+			return luaM_decode_text;
+		case PGSQL_INT2OID:
+			return luaM_decode_bin_int2;
+		case PGSQL_INT4OID:
+			return luaM_decode_bin_int4;
+		case PGSQL_OIDOID:
+			return luaM_decode_bin_oid;
+		case PGSQL_INT8OID:
+			return luaM_decode_bin_int8;
+		case PGSQL_FLOAT4OID:
+			return luaM_decode_bin_float4;
+		case PGSQL_FLOAT8OID:
+			return luaM_decode_bin_float8;
+		case PGSQL_NUMERICOID:
+			return luaM_decode_bin_numeric;
+		case PGSQL_BOOLOID:
+			return luaM_decode_bin_bool;
+		case PGSQL_UUIDOID:
+			return luaM_decode_bin_uuid;
+		case PGSQL_DATEOID:
+			return luaM_decode_bin_date;
+		case PGSQL_TIMESTAMPOID:
+			return luaM_decode_bin_timestamp;
+		case PGSQL_TIMESTAMPTZOID:
+			return luaM_decode_bin_timestamptz;
+		case PGSQL_JSONBOID:
+			return luaM_decode_bin_jsonb;
+		default:
+			return luaM_decode_bin_unsupported;
+	}
 }
 
-static int Lpg_field_table (lua_State *L) {
-	Oid oid;
+/**
+* Encoder Part
+*/
 
-	lua_pg_res *my_res = Mget_res (L);
-    lua_Number field_number = luaL_optnumber(L, 2, 0);
-    lua_Number is_oid = luaL_optnumber(L, 3, 0);
-    lua_Number is_force = luaL_optnumber(L, 4, 0);
+static void luaM_put_uint32 (char *buf, unsigned int n) {
+	buf[0] = (char)(n >> 24);
+	buf[1] = (char)(n >> 16);
+	buf[2] = (char)(n >> 8);
+	buf[3] = (char)n;
+}
 
-	if (field_number < 0 || field_number >= PQnfields(my_res->res)) {
-		luaM_msg(L, 0,  "Bad field offset specified");
-		return 2;
-	}
+static void luaM_put_int64 (char *buf, long long n) {
+	luaM_put_uint32(buf, (unsigned int)((unsigned long long)n >> 32));
+	luaM_put_uint32(buf + 4, (unsigned int)n);
+}
 
-    oid = PQftable(my_res->res, field_number);
+/**
+* Integer at `idx', a number or a decimal string, between `min' and
+* `max'. Anything else is an error: binary values are not checked by
+* the server, a wrong one would be stored as it is.
+*/
+static long long luaM_check_integer (lua_State *L, int idx, long long min, long long max) {
+	const char *s;
+	char *end;
+	lua_Number d;
+	long long n;
+
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		s = lua_tostring(L, idx);
+		errno = 0;
+		n = strtoll(s, &end, 10);
+		if (end == s || *end != '\0' || errno == ERANGE) {
+			luaL_error(L, "invalid integer '%s'", s);
+		}
+	} else {
+		d = luaL_checknumber(L, idx);
+		if ( ! (d >= -9223372036854775808.0 && d < 9223372036854775808.0) || d != (lua_Number)(long long)d) {
+			luaL_error(L, "invalid integer %f", d);
+		}
+		n = (long long)d;
+	}
+	if (n < min || n > max) {
+		luaL_error(L, "integer %s out of range", lua_tostring(L, idx));
+	}
+	return n;
+}
 
-    if (InvalidOid == oid) {
-		lua_pushboolean(L, 0);
-		return 1;
-    }
+/* days since 1970-01-01 of a civil date */
+static long long luaM_days_from_civil (long long y, long long m, long long d) {
+	long long era, yoe, doy, doe;
 
-	if (is_oid) {
-		lua_pushnumber(L, oid);
-		return 1;
-	}
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
 
-	luaM_msg(L, 0, "building");
-	return 2;
-	return Lpg_do_get_field_table (L, oid, is_force);
+static int luaM_days_in_month (int y, int m) {
+	static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	return days[m - 1] + (m == 2 && (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)));
 }
 
-static int Lpg_version (lua_State *L) {
-	char *client = PG_VERSION;
-	lua_Number protocol = PQprotocolVersion(Mget_conn(L)->conn);
-	lua_Number server_version = PQserverVersion(Mget_conn(L)->conn);
+/**
+* Parse an ISO date or timestamp, "YYYY-MM-DD[ HH:MM[:SS[.ffffff]]]"
+* with an optional Z or +/-HH[:MM] zone, to microseconds since
+* 2000-01-01 UTC. Returns 0 when it is not one, or a field is out of
+* range.
+*/
+static int luaM_parse_timestamp (const char *s, long long *usecs) {
+	int y, mo, d, h = 0, mi = 0, sec = 0, n = 0, zh = 0, zm = 0, sign;
+	long long frac = 0, scale = 1000000;
 
-	lua_newtable(L); /* result */
+	if (strcmp(s, "infinity") == 0) {
+		*usecs = 0x7fffffffffffffffLL;
+		return 1;
+	}
+	if (strcmp(s, "-infinity") == 0) {
+		*usecs = (long long)0x8000000000000000ULL;
+		return 1;
+	}
 
-    luaM_pushvalue (L, "client", strlen("client"));
-    luaM_pushvalue (L, client, strlen(client));
-    lua_rawset (L, -3);
+	if (sscanf(s, "%d-%d-%d%n", &y, &mo, &d, &n) != 3) {
+		return 0;
+	}
+	s += n;
+	if ((*s == ' ' || *s == 'T') && sscanf(s + 1, "%d:%d%n", &h, &mi, &n) == 2) {
+		s += 1 + n;
+		if (*s == ':' && sscanf(s + 1, "%d%n", &sec, &n) == 1) {
+			s += 1 + n;
+			if (*s == '.') {
+				for (s++; isdigit((unsigned char)*s); s++) {
+					if (scale > 1) {
+						scale /= 10;
+						frac += (*s - '0') * scale;
+					}
+				}
+			}
+		}
+	}
+	while (*s == ' ') {
+		s++;
+	}
+	if (*s == 'Z' || *s == 'z') {
+		s++;
+	} else if (*s == '+' || *s == '-') {
+		sign = *s == '-' ? -1 : 1;
+		if ( ! isdigit((unsigned char)s[1]) || sscanf(s + 1, "%2d%n", &zh, &n) != 1) {
+			return 0;
+		}
+		s += 1 + n;
+		if (*s == ':') {
+			s++;
+		}
+		if (isdigit((unsigned char)*s)) {
+			if (sscanf(s, "%2d%n", &zm, &n) != 1) {
+				return 0;
+			}
+			s += n;
+		}
+		if (zh > 15 || zm > 59) {
+			return 0;
+		}
+		zh *= sign;
+		zm *= sign;
+	}
+	if (*s != '\0' || mo < 1 || mo > 12 || d < 1 || d > luaM_days_in_month(y, mo)
+			|| h < 0 || mi < 0 || mi > 59 || sec < 0 || sec > 60
+			|| h > 24 || (h == 24 && (mi || sec || frac))) {
+		return 0;
+	}
 
+	*usecs = ((luaM_days_from_civil(y, mo, d) - PGSQL_UNIX_EPOCH_DAYS) * 86400LL
+			+ (h - zh) * 3600LL + (mi - zm) * 60LL + sec) * 1000000LL + frac;
+	return 1;
+}
 
-    luaM_pushvalue (L, "protocol", strlen("protocol"));
-    lua_pushnumber (L, protocol);
-    lua_rawset (L, -3);
+static int luaM_encode_int2 (lua_State *L, int idx, char *buf, const char **data) {
+	int n = (int)luaM_check_integer(L, idx, -32768, 32767);
+	buf[0] = (char)(n >> 8);
+	buf[1] = (char)n;
+	*data = buf;
+	return 2;
+}
 
-	if (protocol >= 3) {
-		server_version = atoi(PQparameterStatus(Mget_conn(L)->conn, "server_version"));
-    }
+static int luaM_encode_int4 (lua_State *L, int idx, char *buf, const char **data) {
+	luaM_put_uint32(buf, (unsigned int)luaM_check_integer(L, idx, -2147483647LL - 1, 2147483647LL));
+	*data = buf;
+	return 4;
+}
 
-    luaM_pushvalue (L, "server_version", strlen("server_version"));
-    lua_pushnumber (L, server_version);
-    lua_rawset (L, -3);
+static int luaM_encode_oid (lua_State *L, int idx, char *buf, const char **data) {
+	luaM_put_uint32(buf, (unsigned int)luaM_check_integer(L, idx, 0, 4294967295LL));
+	*data = buf;
+	return 4;
+}
 
-    return 1;
+static int luaM_encode_int8 (lua_State *L, int idx, char *buf, const char **data) {
+	luaM_put_int64(buf, luaM_check_integer(L, idx, -9223372036854775807LL - 1, 9223372036854775807LL));
+	*data = buf;
+	return 8;
 }
 
-static int Lpg_connection_status (lua_State *L) {
-    lua_pushnumber(L, PQstatus(Mget_conn(L)->conn));
-    return 1;
+static int luaM_encode_float4 (lua_State *L, int idx, char *buf, const char **data) {
+	union { unsigned int i; float f; } u;
+	lua_Number d = luaL_checknumber(L, idx);
+
+	/* the server refuses them in text, a cast would make them infinite */
+	if ((d > 3.402823466e38 || d < -3.402823466e38) && d - d == 0) {
+		luaL_error(L, "number %f out of range for float4", d);
+	}
+	u.f = (float)d;
+	luaM_put_uint32(buf, u.i);
+	*data = buf;
+	return 4;
 }
 
-static int Lpg_transaction_status (lua_State *L) {
-    lua_pushnumber(L, PQtransactionStatus(Mget_conn(L)->conn));
-    return 1;
+static int luaM_encode_float8 (lua_State *L, int idx, char *buf, const char **data) {
+	union { long long i; double f; } u;
+	u.f = (double)luaL_checknumber(L, idx);
+	luaM_put_int64(buf, u.i);
+	*data = buf;
+	return 8;
 }
 
-static int Lpg_options (lua_State *L) {
-    lua_pushstring(L, PQoptions(Mget_conn(L)->conn));
-    return 1;
+static int luaM_encode_bool (lua_State *L, int idx, char *buf, const char **data) {
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		const char *v = lua_tostring(L, idx);
+		buf[0] = (v[0] == 't' || v[0] == 'T' || v[0] == '1' || v[0] == 'y' || v[0] == 'Y');
+	} else if (lua_type(L, idx) == LUA_TNUMBER) {
+		buf[0] = lua_tonumber(L, idx) != 0;
+	} else {
+		buf[0] = (char)lua_toboolean(L, idx);
+	}
+	*data = buf;
+	return 1;
 }
 
-static int Lpg_parameter_status (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
-    const char *param_name = luaL_optstring(L, 2, NULL);
-    const char *status = PQparameterStatus(my_conn->conn, param_name);
-    lua_pushstring (L, status);
-    return 1;
+static int luaM_encode_bytes (lua_State *L, int idx, char *buf, const char **data) {
+	size_t len;
+	*data = luaL_checklstring(L, idx, &len);
+	return (int)len;
 }
 
-static int Lpg_ping (lua_State *L) {
-	PGresult *res;
+static int luaM_encode_uuid (lua_State *L, int idx, char *buf, const char **data) {
+	const char *v = luaL_checkstring(L, idx);
+	int n = 0, c;
 
-    lua_pg_conn *my_conn = Mget_conn (L);
+	for (; *v && n < 32; v++) {
+		if ( ! isxdigit((unsigned char)*v)) {
+			continue;
+		}
+		c = isdigit((unsigned char)*v) ? *v - '0' : tolower((unsigned char)*v) - 'a' + 10;
+		buf[n / 2] = (char)(n % 2 ? (buf[n / 2] << 4) | c : c);
+		n++;
+	}
+	if (n != 32) {
+		luaL_error(L, "invalid uuid '%s'", lua_tostring(L, idx));
+	}
+	*data = buf;
+	return 16;
+}
 
-    /* ping connection */
-     res = PQexec(my_conn->conn, "SELECT 1;");
-    PQclear(res);
+/* microseconds since 2000-01-01 of the unix epoch seconds at `idx' */
+static long long luaM_check_epoch (lua_State *L, int idx) {
+	lua_Number secs = lua_tonumber(L, idx) - PGSQL_UNIX_EPOCH_SECS;
 
-    /* check status. */
-    if (PQstatus(my_conn->conn) == CONNECTION_OK) {
-		lua_pushboolean(L, 1);
-		return 1;
+	if ( ! (secs > -9.2e12 && secs < 9.2e12)) {
+		luaL_error(L, "timestamp %f out of range", lua_tonumber(L, idx));
 	}
+	return (long long)(secs * 1000000.0);
+}
 
-    /* reset connection if it's broken */
-    PQreset(my_conn->conn);
-    if (PQstatus(my_conn->conn) == CONNECTION_OK) {
-		lua_pushboolean(L, 1);
-		return 1;
-    }
+/* a string is an ISO timestamp, a number unix epoch seconds */
+static int luaM_encode_timestamp (lua_State *L, int idx, char *buf, const char **data) {
+	long long usecs;
 
-	lua_pushboolean(L, 0);
-	return 1;
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		usecs = luaM_check_epoch(L, idx);
+	} else if ( ! luaM_parse_timestamp(luaL_checkstring(L, idx), &usecs)) {
+		luaL_error(L, "invalid timestamp '%s'", lua_tostring(L, idx));
+	}
+	luaM_put_int64(buf, usecs);
+	*data = buf;
+	return 8;
 }
 
-static int Lpg_get_notify (lua_State *L) {
-	long result_type = PGSQL_ASSOC;
-    PGnotify *pgsql_notify;
+static int luaM_encode_date (lua_State *L, int idx, char *buf, const char **data) {
+	long long usecs, days;
 
-    lua_pg_conn *my_conn = Mget_conn (L);
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		usecs = luaM_check_epoch(L, idx);
+	} else if ( ! luaM_parse_timestamp(luaL_checkstring(L, idx), &usecs)) {
+		luaL_error(L, "invalid date '%s'", lua_tostring(L, idx));
+	}
 
-    const char *result_type_str = luaL_optstring (L, 2, "PGSQL_ASSOC");
-	result_type = luaM_const(L, result_type_str);
-    if ( ! (result_type & PGSQL_BOTH)) {
-        lua_pushstring(L, "Invalid result type");
-		return 1;
-    }
+	if (usecs == 0x7fffffffffffffffLL) {
+		days = 0x7fffffff;
+	} else if (usecs == (long long)0x8000000000000000ULL) {
+		days = -0x7fffffffLL - 1;
+	} else {
+		days = usecs / PGSQL_USECS_PER_DAY - (usecs % PGSQL_USECS_PER_DAY < 0);
+	}
+	luaM_put_uint32(buf, (unsigned int)days);
+	*data = buf;
+	return 4;
+}
 
-    PQconsumeInput(my_conn->conn);
-    pgsql_notify = PQnotifies(my_conn->conn);
-    if ( ! pgsql_notify) {
-        /* no notify message */
-		lua_pushboolean(L, 0);
-		return 1;
-    }
+/**
+* Binary encoder of `type', NULL when there is none.
+*/
+static lua_pg_encoder luaM_binary_encoder (Oid type) {
+	switch (type) {
+		case PGSQL_INT2OID:
+			return luaM_encode_int2;
+		case PGSQL_INT4OID:
+			return luaM_encode_int4;
+		case PGSQL_OIDOID:
+			return luaM_encode_oid;
+		case PGSQL_INT8OID:
+			return luaM_encode_int8;
+		case PGSQL_FLOAT4OID:
+			return luaM_encode_float4;
+		case PGSQL_FLOAT8OID:
+			return luaM_encode_float8;
+		case PGSQL_BOOLOID:
+			return luaM_encode_bool;
+		case PGSQL_BYTEAOID:
+		case PGSQL_TEXTOID:
+		case PGSQL_VARCHAROID:
+		case PGSQL_BPCHAROID:
+		case PGSQL_NAMEOID:
+		case PGSQL_JSONOID:
+			return luaM_encode_bytes;
+		case PGSQL_UUIDOID:
+			return luaM_encode_uuid;
+		case PGSQL_TIMESTAMPOID:
+		case PGSQL_TIMESTAMPTZOID:
+			return luaM_encode_timestamp;
+		case PGSQL_DATEOID:
+			return luaM_encode_date;
+		default:
+			return NULL;
+	}
+}
 
-	lua_newtable(L);
+static const struct {
+	const char *name;
+	Oid oid;
+} luaM_type_names[] = {
+	{ "bool", PGSQL_BOOLOID }, { "boolean", PGSQL_BOOLOID },
+	{ "bytea", PGSQL_BYTEAOID }, { "name", PGSQL_NAMEOID },
+	{ "int8", PGSQL_INT8OID }, { "bigint", PGSQL_INT8OID },
+	{ "int2", PGSQL_INT2OID }, { "smallint", PGSQL_INT2OID },
+	{ "int4", PGSQL_INT4OID }, { "int", PGSQL_INT4OID }, { "integer", PGSQL_INT4OID },
+	{ "text", PGSQL_TEXTOID }, { "oid", PGSQL_OIDOID }, { "json", PGSQL_JSONOID },
+	{ "float4", PGSQL_FLOAT4OID }, { "real", PGSQL_FLOAT4OID },
+	{ "float8", PGSQL_FLOAT8OID }, { "double precision", PGSQL_FLOAT8OID },
+	{ "bpchar", PGSQL_BPCHAROID }, { "char", PGSQL_BPCHAROID },
+	{ "varchar", PGSQL_VARCHAROID }, { "date", PGSQL_DATEOID },
+	{ "timestamp", PGSQL_TIMESTAMPOID }, { "timestamptz", PGSQL_TIMESTAMPTZOID },
+	{ "uuid", PGSQL_UUIDOID },
+	{ NULL, InvalidOid }
+};
 
-    if (result_type & PGSQL_NUM) {
-		lua_pushstring(L, pgsql_notify->relname);
-		lua_rawseti(L, -2, 0);
-		lua_pushnumber(L, pgsql_notify->be_pid);
-		lua_rawseti(L, -2, 1);
-    }
-    if (result_type & PGSQL_ASSOC) {
-		lua_pushstring(L, "message");
-		lua_pushstring(L, pgsql_notify->relname);
-		lua_rawset(L, -3);
-		lua_pushstring(L, "pid");
-		lua_pushnumber(L, pgsql_notify->be_pid);
-		lua_rawset(L, -3);
-    }
-    PQfreemem(pgsql_notify);
+/**
+* Type oid of the type name or oid at `idx', InvalidOid if unknown.
+*/
+static Oid luaM_check_type (lua_State *L, int idx) {
+	const char *name;
+	int i;
 
-	return 1;
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		return (Oid)lua_tonumber(L, idx);
+	}
+	name = luaL_checkstring(L, idx);
+	for (i = 0; luaM_type_names[i].name != NULL; i++) {
+		if (strcmp(luaM_type_names[i].name, name) == 0) {
+			return luaM_type_names[i].oid;
+		}
+	}
+	return InvalidOid;
 }
 
-static int Lpg_meta_data (lua_State *L) {
-    PGresult *res;
-    const char *tmp_name, *tmp_name2 = NULL;
-	const char *sql;
-    int i, num_rows;
-    lua_pg_conn *my_conn = Mget_conn (L);
+static lua_pg_decoder luaM_text_decoder (Oid type) {
+	switch (type) {
+		case PGSQL_INT2OID:
+		case PGSQL_INT4OID:
+		case PGSQL_OIDOID:
+			return luaM_decode_int;
+		case PGSQL_INT8OID:
+			return luaM_decode_int8;
+		case PGSQL_FLOAT4OID:
+		case PGSQL_FLOAT8OID:
+		case PGSQL_NUMERICOID:
+			return luaM_decode_float;
+		case PGSQL_BOOLOID:
+			return luaM_decode_bool;
+		default:
+			return luaM_decode_text;
+	}
+}
 
-    const char *table_name = luaL_optstring (L, 2, NULL);
+/**
+* Choose the decoder of every column once, so fetching does no per cell
+* type dispatch. Leaves decoders NULL when the result is not decoded.
+*/
+static void Mget_decoders (lua_pg_res *my_res) {
+	int i;
 
-    if (table_name == NULL) {
-		lua_pushboolean(L, 0);
-        lua_pushstring(L, "The table name must be specified");
-		return 2;
-    }
+	if ( ! my_res->decode || my_res->decoders != NULL || my_res->numcols <= 0) {
+		return;
+	}
 
-	/* match out the public.tbl */
-	lua_getglobal(L, "string");
-	lua_getfield(L, -1, "match");
+	my_res->decoders = (lua_pg_decoder *)safe_emalloc(sizeof(lua_pg_decoder), my_res->numcols, 0);
+	if (my_res->decoders == NULL) {
+		return;
+	}
 
-	if (lua_isfunction(L, -1) != 1) {
-		lua_pushboolean(L, 0);
-		lua_pushstring(L, "string.match is not a function?");
-		return 2;
+	for (i = 0; i < my_res->numcols; i++) {
+		if (PQfformat(my_res->res, i) == 1) {
+			my_res->decoders[i] = luaM_binary_decoder(PQftype(my_res->res, i));
+		} else {
+			my_res->decoders[i] = luaM_text_decoder(PQftype(my_res->res, i));
+		}
 	}
+}
 
-	lua_pushstring(L, table_name);
-	lua_pushstring(L, "^([^.]+)%.([^.]+)");
+static void luaM_set_decode (lua_pg_res *my_res, int decode) {
+	if (decode != my_res->decode) {
+		free(my_res->decoders);
+		my_res->decoders = NULL;
+		my_res->decode = decode;
+	}
+}
 
-	if (lua_pcall(L, 2, 2, 0) != 0) {
-		lua_pushboolean(L, 0);
-		lua_tostring(L, -1);
-		return 2;
+/**
+* Push the value of one cell. NULL is pgsql.null when decoding,
+* "" otherwise (a nil would drop the key from the row table).
+*/
+static void luaM_pushcell (lua_State *L, lua_pg_res *my_res, int row, int col) {
+	if (PQgetisnull(my_res->res, row, col)) {
+		if (my_res->decode) {
+			lua_pushlightuserdata(L, NULL);
+		} else {
+			lua_pushliteral(L, "");
+		}
+	} else if (my_res->decoders != NULL) {
+		my_res->decoders[col](L, PQgetvalue(my_res->res, row, col), PQgetlength(my_res->res, row, col));
+	} else {
+		lua_pushlstring(L, PQgetvalue(my_res->res, row, col), PQgetlength(my_res->res, row, col));
 	}
+}
 
-	if (lua_isnoneornil(L, -1)) {
-        /* Default schema */
-        tmp_name2 = table_name;
-        tmp_name = "public";
+/**
+* Push the column names of a result as an array, built once per result
+* so fetching reuses the interned strings instead of hashing every name
+* again for every row.
+*/
+static void luaM_pushkeys (lua_State *L, lua_pg_res *my_res) {
+	int i;
+
+	if (my_res->keys == LUA_NOREF) {
+		lua_createtable(L, my_res->numcols, 0);
+		for (i = 0; i < my_res->numcols; i++) {
+			lua_pushstring(L, PQfname(my_res->res, i));
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_pushvalue(L, -1);
+		my_res->keys = luaL_ref(L, LUA_REGISTRYINDEX);
 	} else {
-		tmp_name = lua_tostring(L, -2);
-		tmp_name2 = lua_tostring(L, -1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, my_res->keys);
 	}
+}
 
-	lua_pop(L, 4);
+/**
+* Push row `row' as a new table, sized for its keys. Numeric keys are
+* field numbers (from 0), the associative key of the nth column is
+* item n of the keys table at `keys'. `cols' lists the field numbers
+* of the `num_fields' columns to push, NULL for all of them.
+*/
+static void luaM_pushrow (lua_State *L, lua_pg_res *my_res, int row, int result_type, int keys,
+		const int *cols, int num_fields) {
+	int i, col;
 
-    lua_pushfstring(L,
-        "SELECT a.attname, a.attnum, t.typname, a.attlen, a.attnotNULL, a.atthasdef, a.attndims "
-        "FROM pg_class as c, pg_attribute a, pg_type t, pg_namespace n "
-        "WHERE a.attnum > 0 AND a.attrelid = c.oid AND c.relname = '%s' AND c.relnamespace = n.oid AND n.nspname = '%s'"
-		"AND a.atttypid = t.oid ORDER BY a.attnum;",
-		tmp_name2, tmp_name);
-	sql = lua_tolstring(L, -1, NULL);
-	lua_pop(L, 1);
+	if (cols == NULL) {
+		num_fields = my_res->numcols;
+	}
 
+	lua_createtable(L, (result_type & PGSQL_NUM) && num_fields > 1 && cols == NULL ? num_fields - 1 : 0,
+			((result_type & PGSQL_ASSOC) ? num_fields : 0) + ((result_type & PGSQL_NUM) ? 1 : 0));
 
-    res = PQexec(my_conn->conn, sql);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK || (num_rows = PQntuples(res)) == 0) {
-		lua_pushboolean(L, 0);
-        lua_pushfstring(L, "Table '%s' doesn't exists", table_name);
-        PQclear(res);
-        return 2;
-    }
+	for (i = 0; i < num_fields; i++) {
+		col = cols ? cols[i] : i;
+		if (result_type & PGSQL_NUM) {
+			luaM_pushcell(L, my_res, row, col);
+			lua_rawseti (L, -2, col);
+		}
+		if (result_type & PGSQL_ASSOC) {
+			lua_rawgeti(L, keys, i + 1);
+			luaM_pushcell(L, my_res, row, col);
+			lua_rawset (L, -3);
+		}
+	}
+}
 
-	//return 1;
-	lua_newtable(L);
+/**
+* Type cache Part
+*/
 
-    for (i = 0; i < num_rows; i++) {
-		/* table key */
-		lua_pushstring(L, PQgetvalue(res,i,0));
-		/* sub table value */
-		lua_newtable(L);
+static size_t luaM_type_slot (lua_pg_type_cache *tc, Oid oid) {
+	size_t i = (oid * 2654435761u) & (tc->size - 1);
 
-		lua_pushstring(L, "num");
-		lua_pushnumber(L, atoi(PQgetvalue(res,i,1)));
-		lua_rawset(L, -3);
+	while (tc->oids[i] != InvalidOid && tc->oids[i] != oid) {
+		i = (i + 1) & (tc->size - 1);
+	}
+	return i;
+}
 
-		lua_pushstring(L, "type");
-		lua_pushstring(L, PQgetvalue(res,i,2));
-		lua_rawset(L, -3);
+/**
+* Add one type to the cache, the lock must be held.
+* Names are never freed nor replaced, so a pointer read under the
+* lock stays valid after it is released.
+*/
+static void luaM_type_put (lua_pg_type_cache *tc, Oid oid, const char *name) {
+	size_t i;
+	char *copy;
 
-		lua_pushstring(L, "len");
-		lua_pushnumber(L, atoi(PQgetvalue(res,i,3)));
-		lua_rawset(L, -3);
+	if (oid == InvalidOid) {
+		return;
+	}
 
-        if (!strcmp(PQgetvalue(res, i, 4), "t")) {
-			lua_pushstring(L, "not null");
-			lua_pushboolean(L, 1);
-			lua_rawset(L, -3);
-        }
-        else {
-			lua_pushstring(L, "not null");
-			lua_pushboolean(L, 0);
-			lua_rawset(L, -3);
-        }
-        if (!strcmp(PQgetvalue(res,i,5), "t")) {
-			lua_pushstring(L, "has default");
-			lua_pushboolean(L, 1);
-			lua_rawset(L, -3);
-        }
-        else {
-			lua_pushstring(L, "has default");
-			lua_pushboolean(L, 0);
-			lua_rawset(L, -3);
-        }
+	if ((tc->used + 1) * 2 > tc->size) {
+		size_t j, old_size = tc->size;
+		Oid *old_oids = tc->oids;
+		char **old_names = tc->names;
+		Oid *oids = (Oid *)calloc(old_size * 2, sizeof(Oid));
+		char **names = (char **)calloc(old_size * 2, sizeof(char *));
+
+		if (oids == NULL || names == NULL) {
+			free(oids);
+			free(names);
+			return;
+		}
 
-		lua_pushstring(L, "array dims");
-		lua_pushnumber(L, atoi(PQgetvalue(res,i,6)));
-		lua_rawset(L, -3);
-		/* into sub table*/
-		lua_rawset(L, -3);
-    }
+		tc->oids = oids;
+		tc->names = names;
+		tc->size = old_size * 2;
+		for (j = 0; j < old_size; j++) {
+			if (old_oids[j] != InvalidOid) {
+				i = luaM_type_slot(tc, old_oids[j]);
+				tc->oids[i] = old_oids[j];
+				tc->names[i] = old_names[j];
+			}
+		}
+		free(old_oids);
+		free(old_names);
+	}
 
-    PQclear(res);
-	
-	return 1;
-}
+	i = luaM_type_slot(tc, oid);
+	if (tc->oids[i] == oid) {
+		return;
+	}
 
-static int Lpg_last_error (lua_State *L) {
-    lua_pushstring(L, PQerrorMessage(Mget_conn(L)->conn));
-    return 1;
+	if ((copy = strdup(name)) == NULL) {
+		return;
+	}
+	tc->oids[i] = oid;
+	tc->names[i] = copy;
+	tc->used++;
 }
 
-static int Lpg_set_error_verbosity (lua_State *L) {
-    const char *result_type = luaL_optstring (L, 2, "PQERRORS_DEFAULT");
-	lua_pushnumber(L, PQsetErrorVerbosity(Mget_conn (L)->conn, luaM_const(L, result_type)));
-    return 1;
-}
+/**
+* Find (or create) the cache shared by every connection to the server
+* `conn' is connected to.
+*/
+static lua_pg_type_cache *luaM_type_cache (PGconn *conn) {
+	lua_pg_type_cache *tc;
+	char *key;
+	const char *host = PQhost(conn);
+	const char *port = PQport(conn);
+	const char *dbname = PQdb(conn);
+	size_t key_len;
+
+	host = host ? host : "";
+	port = port ? port : "";
+	dbname = dbname ? dbname : "";
+	key_len = strlen(host) + strlen(port) + strlen(dbname) + PGSQL_MAX_LENGTH_OF_LONG;
+
+	if ((key = (char *)safe_emalloc(sizeof(char), key_len, 0)) == NULL) {
+		return NULL;
+	}
+	snprintf(key, key_len, "%s:%s/%s@%d", host, port, dbname, PQserverVersion(conn));
 
-static int Lpg_escape_bytea (lua_State *L) {
-	size_t to_len;
-	unsigned char *to; 
+	luaM_lock();
+	for (tc = type_caches; tc != NULL; tc = tc->next) {
+		if (strcmp(tc->key, key) == 0) {
+			break;
+		}
+	}
 
-    lua_pg_conn *my_conn = Mget_conn (L);
-    const char *from = luaL_optstring(L, 2, NULL);
-	if (my_conn->conn) {
-		to = PQescapeByteaConn(my_conn->conn, (unsigned char*)from, strlen(from), &to_len);
-	} else {
-		to = PQescapeBytea((unsigned char*)from, strlen(from), &to_len);
+	if (tc == NULL && (tc = (lua_pg_type_cache *)calloc(1, sizeof(lua_pg_type_cache))) != NULL) {
+		tc->oids = (Oid *)calloc(PGSQL_TYPE_CACHE_MIN_SIZE, sizeof(Oid));
+		tc->names = (char **)calloc(PGSQL_TYPE_CACHE_MIN_SIZE, sizeof(char *));
+		if (tc->oids == NULL || tc->names == NULL) {
+			free(tc->oids);
+			free(tc->names);
+			free(tc);
+			tc = NULL;
+		} else {
+			tc->key = key;
+			key = NULL;
+			tc->size = PGSQL_TYPE_CACHE_MIN_SIZE;
+			tc->next = type_caches;
+			type_caches = tc;
+		}
 	}
-    luaM_pushvalue (L, to, to_len-1);
-	PQfreemem(to);
-    return 1;
-}
+	luaM_unlock();
 
-static int Lpg_unescape_bytea (lua_State *L) {
-	size_t to_len;
-    //lua_pg_conn *my_conn = Mget_conn (L);
-    const char *from = luaL_optstring(L, 2, NULL);
-    unsigned char *to = PQunescapeBytea((unsigned char*)from, &to_len);
-    luaM_pushvalue (L, to, to_len);
-	PQfreemem(to);
-    return 1;
+	free(key);
+	return tc;
 }
 
-static int Lpg_escape_string (lua_State *L) {
-	char *to = NULL;
-	int to_len, from_len;
-
-    lua_pg_conn *my_conn = Mget_conn (L);
-    const char *from = luaL_optstring(L, 2, NULL);
-	from_len = strlen(from);
-	to = (char *) safe_emalloc(from_len, 2, 1);
-
-	if (my_conn->conn) {
-		to_len = (int) PQescapeStringConn(my_conn->conn, to, from, (size_t)from_len, NULL);
-	} else {
-		to_len = (int) PQescapeString(to, from, (size_t)from_len);
+static lua_pg_type_cache *Mget_types (lua_pg_conn *my_conn) {
+	if (my_conn->types == NULL && ! my_conn->closed && PQstatus(my_conn->conn) == CONNECTION_OK) {
+		my_conn->types = luaM_type_cache(my_conn->conn);
 	}
+	return my_conn->types;
+}
 
-    luaM_pushvalue (L, to, to_len);
-    return 1;
+/**
+* Whether a catalog query can be run on `my_conn' now: not while a
+* query, a COPY, a pipeline or a stream is under way, whose results it would
+* steal, nor in a failed transaction.
+*/
+static int luaM_type_lookup_ok (lua_pg_conn *my_conn) {
+	if (my_conn->closed || PQstatus(my_conn->conn) != CONNECTION_OK || my_conn->copy_start
+			|| my_conn->stream != NULL || PQisBusy(my_conn->conn)) {
+		return 0;
+	}
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineStatus(my_conn->conn) != PQ_PIPELINE_OFF) {
+		return 0;
+	}
+#endif
+	switch (PQtransactionStatus(my_conn->conn)) {
+		case PQTRANS_IDLE:
+		case PQTRANS_INTRANS:
+			return 1;
+		default:
+			return 0;
+	}
 }
 
-static int Lpg_connection_busy (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
+/**
+* Push the name of type `oid', resolving a miss with a single row lookup,
+* or the oid itself when the connection cannot run it now.
+*/
+static void luaM_push_type_name (lua_State *L, lua_pg_conn *my_conn, Oid oid) {
+	char name[PGSQL_TYPE_NAME_LEN];
+	char oid_str[PGSQL_MAX_LENGTH_OF_LONG];
+	const char *values[1];
+	lua_pg_type_cache *tc;
+	PGresult *res;
+	size_t i;
 
-    PQconsumeInput(my_conn->conn);
-    lua_pushboolean(L, PQisBusy(my_conn->conn));
-    return 1;
-}
+	if ((tc = Mget_types(my_conn)) == NULL) {
+		lua_pushnil(L);
+		return;
+	}
 
-static int Lpg_connection_reset (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
+	name[0] = '\0';
+	luaM_lock();
+	i = luaM_type_slot(tc, oid);
+	if (tc->oids[i] == oid) {
+		strncpy(name, tc->names[i], sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+	}
+	luaM_unlock();
 
-    PQreset(my_conn->conn);
-    if (PQstatus(my_conn->conn) == CONNECTION_BAD) {
-		lua_pushboolean(L, 0);
-    }
-	lua_pushboolean(L, 1);
-    return 1;
+	if (name[0] == '\0' && ! luaM_type_lookup_ok(my_conn)) {
+		lua_pushnumber(L, oid);
+		return;
+	}
+	if (name[0] == '\0') {
+		snprintf(oid_str, sizeof(oid_str), "%u", oid);
+		values[0] = oid_str;
+		res = PQexecParams(my_conn->conn, "select typname from pg_type where oid = $1",
+				1, NULL, values, NULL, NULL, 0);
+		if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+			strncpy(name, PQgetvalue(res, 0, 0), sizeof(name) - 1);
+			name[sizeof(name) - 1] = '\0';
+			luaM_lock();
+			luaM_type_put(tc, oid, name);
+			luaM_unlock();
+		}
+		PQclear(res);
+	}
+
+	if (name[0] == '\0') {
+		lua_pushnil(L);
+	} else {
+		lua_pushstring(L, name);
+	}
 }
 
-static int Lpg_cancel_query (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
+/**
+* Load the types with an oid above the highest one loaded so far.
+* Types created after the oid counter wrapped around are left to the
+* single row lookup of luaM_push_type_name.
+*/
+static void luaM_type_refresh (lua_pg_conn *my_conn, lua_pg_type_cache *tc) {
+	char oid_str[PGSQL_MAX_LENGTH_OF_LONG];
+	const char *values[1];
 	PGresult *res;
-	lua_Number return_value;
-    return_value = PQrequestCancel(my_conn->conn);
-    while ((res = PQgetResult(my_conn->conn))) {
-		PQclear(res);
-    }
+	int i, num_rows;
 
-    lua_pushboolean(L, return_value);
-    return 1;
-}
+	luaM_lock();
+	snprintf(oid_str, sizeof(oid_str), "%u", tc->scanned);
+	luaM_unlock();
 
-static int Lpg_trace (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
-	FILE *fp = NULL;
+	values[0] = oid_str;
+	res = PQexecParams(my_conn->conn, "select oid, typname from pg_type where oid > $1 order by oid",
+			1, NULL, values, NULL, NULL, 0);
 
-    const char *filename = luaL_optstring(L, 2, NULL);
-    const char *mode = luaL_optstring(L, 3, "w");
-	fp = fopen(filename, mode);
-	if (fp == NULL) {
-		lua_pushboolean(L, 0);
-		return 1;
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && (num_rows = PQntuples(res)) > 0) {
+		Oid last = (Oid)strtoul(PQgetvalue(res, num_rows - 1, 0), NULL, 10);
+
+		luaM_lock();
+		for (i = 0; i < num_rows; i++) {
+			luaM_type_put(tc, (Oid)strtoul(PQgetvalue(res, i, 0), NULL, 10), PQgetvalue(res, i, 1));
+		}
+		if (last > tc->scanned) {
+			tc->scanned = last;
+		}
+		luaM_unlock();
 	}
-	PQtrace(my_conn->conn, fp);
-    lua_pushboolean(L, 1);
-    return 1;
+	PQclear(res);
 }
 
-static int Lpg_untrace (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
+/**
+* Push every known type as a { [oid] = typname } table.
+*/
+static void luaM_push_type_names (lua_State *L, lua_pg_conn *my_conn) {
+	lua_pg_type_cache *tc;
+	Oid *oids;
+	const char **names;
+	size_t i, n = 0, size;
 
-	PQuntrace(my_conn->conn);
-    lua_pushboolean(L, 1);
-    return 1;
-}
+	if ((tc = Mget_types(my_conn)) == NULL) {
+		lua_newtable(L);
+		return;
+	}
+	if (luaM_type_lookup_ok(my_conn)) {
+		luaM_type_refresh(my_conn, tc);
+	}
 
-static int Lpg_client_encoding (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
+	/* snapshot into userdata so a memory error can not leak it */
+	luaM_lock();
+	size = tc->used;
+	luaM_unlock();
+	oids = (Oid *)lua_newuserdata(L, size * (sizeof(Oid) + sizeof(char *)) + sizeof(char *));
+	names = (const char **)(oids + size + (size & 1));
+
+	luaM_lock();
+	for (i = 0; i < tc->size && n < size; i++) {
+		if (tc->oids[i] != InvalidOid) {
+			oids[n] = tc->oids[i];
+			names[n] = tc->names[i];
+			n++;
+		}
+	}
+	luaM_unlock();
 
-	char *result_value = (char *)pg_encoding_to_char(PQclientEncoding(my_conn->conn));
-	lua_pushstring(L, result_value);
-    return 1;
+	lua_createtable(L, 0, n);
+	for (i = 0; i < n; i++) {
+		lua_pushstring(L, names[i]);
+		lua_rawseti(L, -2, oids[i]);
+	}
+	lua_remove(L, -2);
 }
 
-static int Lpg_set_client_encoding (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
+/**
+* Statement cache Part
+*/
 
-    const char *encoding = luaL_optstring(L, 2, NULL);
-	int result_value = (PQsetClientEncoding (my_conn->conn, encoding) == 0) ? 1 : 0;
-    lua_pushboolean(L, result_value);
-    return 1;
+static unsigned int luaM_hash (const char *s) {
+	unsigned int h = 2166136261u;	/* FNV-1a */
+
+	while (*s) {
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+	return h;
 }
 
-static int Lpg_query (lua_State *L) {
-	int leftover = 0;
-	ExecStatusType status;
-	PGresult *res;
+static void luaM_stmt_list_remove (lua_pg_stmt_cache *sc, lua_pg_stmt *stmt) {
+	if (stmt->newer) {
+		stmt->newer->older = stmt->older;
+	} else {
+		sc->newest = stmt->older;
+	}
+	if (stmt->older) {
+		stmt->older->newer = stmt->newer;
+	} else {
+		sc->oldest = stmt->newer;
+	}
+}
 
-    lua_pg_conn *my_conn = Mget_conn (L);
-	const char *statement = luaL_checkstring (L, 2);
+static void luaM_stmt_unlink (lua_pg_stmt_cache *sc, lua_pg_stmt *stmt) {
+	lua_pg_stmt **p = &sc->buckets[stmt->hash & (sc->nbuckets - 1)];
 
-	if (PQsetnonblocking(my_conn->conn, 0)) {
-		lua_pushstring(L, "Cannot set connection to blocking mode");
-		return 1;
+	while (*p != stmt) {
+		p = &(*p)->chain;
 	}
+	*p = stmt->chain;
+	luaM_stmt_list_remove(sc, stmt);
+	sc->used--;
+}
 
-    while ((res = PQgetResult(my_conn->conn))) {
-        PQclear(res);
-        leftover = 1;
-    }
-
-    if (leftover) {
-        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
-		return 1;
-    }
-	
-	res = PQexec(my_conn->conn, statement);
-
-	// auto reset
-    if (PQstatus(my_conn->conn) != CONNECTION_OK) {
-        PQclear(res);
-        PQreset(my_conn->conn);
-        res = PQexec(my_conn->conn, statement);
-    }
-
-    if (res) {
-        status = PQresultStatus(res);
-    } else {
-        status = (ExecStatusType) PQstatus(my_conn->conn);
-    }
-
-    switch (status) {
-        case PGRES_EMPTY_QUERY:
-        case PGRES_BAD_RESPONSE:
-        case PGRES_NONFATAL_ERROR:
-        case PGRES_FATAL_ERROR:
-			lua_pushboolean(L, 0);
-			luaM_msg(L, 0, PQerrorMessage(my_conn->conn));
-            PQclear(res);
-            return 2;
-            break;
-        case PGRES_COMMAND_OK: /* successful command that did not return rows */
-        default:
-            if (res) {
-				lua_pg_res *my_res = (lua_pg_res *)lua_newuserdata(L, sizeof(lua_pg_res));
-				luaM_setmeta (L, LUA_PGSQL_RES);
-
-				/* fill in structure */
-				my_res->closed = 0;
-				my_res->row = 0;
-				my_res->conn = LUA_NOREF;
-				my_res->numcols = PQnfields(res);
-				my_res->res = res;
-
-				lua_pushvalue(L, 1);
+static void luaM_stmt_push_front (lua_pg_stmt_cache *sc, lua_pg_stmt *stmt) {
+	stmt->older = sc->newest;
+	stmt->newer = NULL;
+	if (sc->newest) {
+		sc->newest->newer = stmt;
+	} else {
+		sc->oldest = stmt;
+	}
+	sc->newest = stmt;
+}
 
-				my_res->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+/**
+* Forget every cached statement, deallocating them on the server
+* unless the session they lived in is gone.
+*/
+static void luaM_stmt_clear (PGconn *conn, lua_pg_stmt_cache *sc, int deallocate) {
+	lua_pg_stmt *stmt, *next;
+	char sql[PGSQL_STMT_NAME_LEN + 16];
+
+	for (stmt = sc->newest; stmt != NULL; stmt = next) {
+		next = stmt->older;
+		if (deallocate) {
+			snprintf(sql, sizeof(sql), "DEALLOCATE %s", stmt->name);
+			PQclear(PQexec(conn, sql));
+		}
+		free(stmt->sql);
+		free(stmt);
+	}
+	memset(sc->buckets, 0, sc->nbuckets * sizeof(lua_pg_stmt *));
+	sc->newest = sc->oldest = NULL;
+	sc->used = 0;
+}
 
-				return 1;
-            } else {
-                PQclear(res);
-				lua_pushboolean (L, 0);
-				return 1;
-            }
-            break;
-    }
+static void luaM_stmt_free (lua_pg_conn *my_conn, int deallocate) {
+	if (my_conn->stmts != NULL) {
+		luaM_stmt_clear(my_conn->conn, my_conn->stmts, deallocate);
+		free(my_conn->stmts->buckets);
+		free(my_conn->stmts);
+		my_conn->stmts = NULL;
+	}
 }
 
-static int Lpg_send_query (lua_State *L) {
-	int leftover = 0;
+/* DEALLOCATE the cached statement `name' on the server */
+static void luaM_stmt_deallocate (lua_pg_conn *my_conn, const char *name) {
 	PGresult *res;
+	char dealloc[PGSQL_STMT_NAME_LEN + 16];
 
-    lua_pg_conn *my_conn = Mget_conn (L);
-	const char *statement = luaL_checkstring (L, 2);
-
-	if (PQsetnonblocking(my_conn->conn, 1)) {
-		lua_pushstring(L, "Cannot set connection to nonblocking mode");
-		return 1;
+	snprintf(dealloc, sizeof(dealloc), "DEALLOCATE %s", name);
+	my_conn->stats.round_trips++;
+	luaM_ring_push(my_conn, '>', 'Q', strlen(dealloc), dealloc, NULL);
+	if ((res = PQexec(my_conn->conn, dealloc)) != NULL) {
+		luaM_ring_result(my_conn, res);
 	}
+	PQclear(res);
+}
 
-    while ((res = PQgetResult(my_conn->conn))) {
-        PQclear(res);
-        leftover = 1;
-    }
+/**
+* Name of the cached statement for `sql', prepared on a miss. NULL if
+* the cache is off or the statement cannot be prepared: the caller
+* then sends the query unprepared, getting the error if any. Misses
+* inside a transaction block are not prepared, as a failed prepare
+* would abort the transaction before the query reports its error.
+*/
+static const char *luaM_stmt_lookup (lua_pg_conn *my_conn, const char *sql) {
+	lua_pg_stmt_cache *sc = my_conn->stmts;
+	lua_pg_stmt *stmt;
+	PGresult *res;
+	unsigned int hash;
+	char name[PGSQL_STMT_NAME_LEN];
 
-    if (leftover) {
-        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results FALSE");
-		return 1;
-    }
+	if (sc == NULL) {
+		return NULL;
+	}
 
-    if ( ! PQsendQuery(my_conn->conn, statement)) {
-        if (PQstatus(my_conn->conn) != CONNECTION_OK) {
-            PQreset(my_conn->conn);
-        }
-        if ( ! PQsendQuery(my_conn->conn, statement)) {
-			lua_pushboolean(L, 0);
-			return 0;
-        }
-    }
+	hash = luaM_hash(sql);
+	for (stmt = sc->buckets[hash & (sc->nbuckets - 1)]; stmt != NULL; stmt = stmt->chain) {
+		if (stmt->hash == hash && strcmp(stmt->sql, sql) == 0) {
+			sc->hits++;
+			if (stmt != sc->newest) {
+				luaM_stmt_list_remove(sc, stmt);
+				luaM_stmt_push_front(sc, stmt);
+			}
+			return stmt->name;
+		}
+	}
+	sc->misses++;
+	if (PQtransactionStatus(my_conn->conn) != PQTRANS_IDLE) {
+		return NULL;
+	}
 
-	if (PQsetnonblocking(my_conn->conn, 0)) {
-		lua_pushstring(L, "Cannot set connection to blocking mode");
-		return 1;
+	snprintf(name, sizeof(name), "luapgsql_%lu", ++sc->serial);
+	my_conn->stats.round_trips++;
+	luaM_ring_push(my_conn, '>', 'P', strlen(sql), name, NULL);
+	res = PQprepare(my_conn->conn, name, sql, 0, NULL);
+	if (res != NULL) {
+		luaM_ring_result(my_conn, res);
+	}
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		PQclear(res);
+		return NULL;
+	}
+	PQclear(res);
+
+	if (sc->used >= sc->capacity) {
+		stmt = sc->oldest;
+		luaM_stmt_unlink(sc, stmt);
+		luaM_stmt_deallocate(my_conn, stmt->name);
+		free(stmt->sql);
+	} else if ((stmt = (lua_pg_stmt *)malloc(sizeof(lua_pg_stmt))) == NULL) {
+		return NULL;
 	}
 
-	lua_pushboolean(L, 1);
-	return 1;
+	if ((stmt->sql = strdup(sql)) == NULL) {
+		free(stmt);
+		return NULL;
+	}
+	strcpy(stmt->name, name);
+	stmt->hash = hash;
+	stmt->chain = sc->buckets[hash & (sc->nbuckets - 1)];
+	sc->buckets[hash & (sc->nbuckets - 1)] = stmt;
+	luaM_stmt_push_front(sc, stmt);
+	sc->used++;
+
+	return stmt->name;
 }
 
-static int Lpg_send_prepare (lua_State *L) {
-	int leftover = 0;
-	PGresult *res;
+/**
+* Whether `res' failed because the cached statement it ran is gone
+* (DEALLOCATE ALL, DISCARD ALL) or its plan no longer fits the tables,
+* and the query can be sent again unprepared.
+*/
+static int luaM_stmt_stale (lua_pg_conn *my_conn, PGresult *res) {
+	const char *state;
 
-    lua_pg_conn *my_conn = Mget_conn (L);
-	const char *stmtname = luaL_checkstring (L, 2);
-	const char *query = luaL_checkstring (L, 3);
+	if (PQresultStatus(res) != PGRES_FATAL_ERROR
+			|| PQtransactionStatus(my_conn->conn) == PQTRANS_INERROR) {
+		return 0;
+	}
+	state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+	return state != NULL && (strcmp(state, "26000") == 0 || strcmp(state, "0A000") == 0);
+}
 
-	if (PQsetnonblocking(my_conn->conn, 1)) {
-		lua_pushstring(L, "Cannot set connection to nonblocking mode");
-		return 1;
+/**
+* Drop the cached statement `name' after the server lost it or its plan
+* went stale, deallocating it in case it is still there.
+*/
+static void luaM_stmt_forget (lua_pg_conn *my_conn, const char *name) {
+	lua_pg_stmt *stmt;
+
+	for (stmt = my_conn->stmts->newest; stmt != NULL; stmt = stmt->older) {
+		if (strcmp(stmt->name, name) == 0) {
+			luaM_stmt_unlink(my_conn->stmts, stmt);
+			luaM_stmt_deallocate(my_conn, stmt->name);
+			free(stmt->sql);
+			free(stmt);
+			return;
+		}
 	}
+}
 
-    while ((res = PQgetResult(my_conn->conn))) {
-        PQclear(res);
-        leftover = 1;
-    }
+/**
+* Wait for `events' (POLLIN, POLLOUT) on the socket of `conn' up to the
+* monotonic time `deadline' (0 for ever), going on after a signal.
+* Returns the events that happened, 0 on timeout, -1 on error. poll()
+* rather than select(), whose fd_set cannot hold sockets past 1023.
+*/
+static int luaM_poll_socket (PGconn *conn, int events, double deadline) {
+	struct pollfd pfd;
+	int ret, ms = -1;
+	double left;
 
-    if (leftover) {
-        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results FALSE");
-		return 1;
-    }
+	if ((pfd.fd = PQsocket(conn)) < 0) {
+		return -1;
+	}
+	pfd.events = (short)events;
+	do {
+		if (deadline > 0) {
+			if ((left = deadline - luaM_now()) <= 0) {
+				return 0;
+			}
+			ms = left < 2e6 ? (int)(left * 1000) + 1 : 2000000000;
+		}
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, ms);
+	} while (ret < 0 && errno == EINTR);
+	return ret > 0 ? pfd.revents : ret;
+}
 
-    if ( ! PQsendPrepare(my_conn->conn, stmtname, query, 0, NULL)) {
-        if (PQstatus(my_conn->conn) != CONNECTION_OK) {
-            PQreset(my_conn->conn);
-        }
-		if ( ! PQsendPrepare(my_conn->conn, stmtname, query, 0, NULL)) {
-			lua_pushboolean(L, 0);
-			return 0;
-        }
-    }
+#ifdef __linux__
+/**
+* Register the socket of `my_conn' with its waitset again after libpq
+* opened a new one: the old one left the epoll set when it was closed,
+* and the new one may well have the same number.
+*/
+static void luaM_waitset_refresh (lua_pg_conn *my_conn) {
+	struct epoll_event ev;
+	int fd;
 
-	if (PQsetnonblocking(my_conn->conn, 0)) {
-		lua_pushstring(L, "Cannot set connection to blocking mode");
-		return 1;
+	if (my_conn->waitset == NULL || (fd = PQsocket(my_conn->conn)) < 0) {
+		return;
+	}
+	ev.events = my_conn->ws_events;
+	ev.data.ptr = my_conn;
+	if (epoll_ctl(my_conn->waitset->epfd, EPOLL_CTL_ADD, fd, &ev) != 0 && errno == EEXIST) {
+		epoll_ctl(my_conn->waitset->epfd, EPOLL_CTL_MOD, fd, &ev);
 	}
-
-	lua_pushboolean(L, 1);
-	return 1;
 }
 
-static int Lpg_send_execute (lua_State *L) {
-	int leftover = 0;
-	PGresult *res;
-	int num_params = 0;
-	char **params = NULL;
+/* take `my_conn' out of its waitset, before its socket is closed */
+static void luaM_waitset_forget (lua_State *L, lua_pg_conn *my_conn) {
+	lua_pg_waitset *my_ws = my_conn->waitset;
+	int fd;
 
-    lua_pg_conn *my_conn = Mget_conn (L);
-	const char *stmtname = luaL_checkstring (L, 2);
+	if (my_ws == NULL) {
+		return;
+	}
+	if ((fd = PQsocket(my_conn->conn)) >= 0) {
+		epoll_ctl(my_ws->epfd, EPOLL_CTL_DEL, fd, NULL);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, my_ws->conns);
+	lua_pushlightuserdata(L, my_conn);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	my_ws->count--;
+	my_conn->waitset = NULL;
+}
+#else
+#define luaM_waitset_refresh(my_conn)
+#define luaM_waitset_forget(L, my_conn)
+#endif
 
-	if (lua_istable(L, 3)) {
-		luaL_checktype(L, 3, LUA_TTABLE);
-		num_params = lua_objlen(L, 3);
-		if (num_params > 0) {
-			int i = 0;
-			params = (char **)safe_emalloc(sizeof(char *), 1, 0);
+static void luaM_retry_defaults (lua_pg_retry *rp) {
+	memset(rp, 0, sizeof(lua_pg_retry));
+	rp->attempts = PGSQL_RETRY_ATTEMPTS;
+	rp->delay = PGSQL_RETRY_DELAY;
+	rp->max_delay = PGSQL_RETRY_MAX_DELAY;
+	rp->idempotent_only = 1;
+}
 
-			for (i = 0; i < num_params; i++) {
-				lua_rawgeti(L, 3, i);
-				params[i] = (char *) lua_tostring(L, -1);
-				lua_pop(L, 1);
+/**
+* Seconds a reconnect of `conn' may take without a retry timeout: its
+* connect_timeout, which libpq raises to 2 seconds, or a default.
+*/
+static double luaM_reset_timeout (PGconn *conn) {
+	PQconninfoOption *opts = PQconninfo(conn), *o;
+	double timeout = PGSQL_RESET_TIMEOUT;
+	int n;
+
+	for (o = opts; o != NULL && o->keyword != NULL; o++) {
+		if (strcmp(o->keyword, "connect_timeout") == 0) {
+			if (o->val != NULL && (n = atoi(o->val)) > 0) {
+				timeout = n < 2 ? 2 : n;
 			}
-		}
-	} else {
-		num_params = 1;
-		params = (char **)safe_emalloc(sizeof(char *), 1, 0);
-		if (lua_isstring(L, 3)) { // auto set one param value
-			params[0] = (char *) luaL_checkstring(L, 3);
-		} else {
-			params[0] = NULL;
+			break;
 		}
 	}
+	PQconninfoFree(opts);
+	return timeout;
+}
 
-	if (PQsetnonblocking(my_conn->conn, 0)) {
-		lua_pushstring(L, "Cannot set connection to nonblocking mode");
-		return 1;
+/**
+* Reconnect a broken connection with PQresetStart and PQresetPoll,
+* within `timeout' seconds (the retry policy's), or connect_timeout
+* when it is 0. This
+* still waits for the new connection, but never for longer. The new
+* session has none of the statements of the old one. Returns whether
+* it is usable.
+*/
+static int luaM_reset (lua_pg_conn *my_conn, double timeout) {
+	PGconn *conn = my_conn->conn;
+	PostgresPollingStatusType status = PGRES_POLLING_WRITING;
+	double deadline = luaM_now() + (timeout > 0 ? timeout : luaM_reset_timeout(conn));
+
+	my_conn->session++;
+	my_conn->stats.reconnects++;
+	my_conn->copy_start = 0;
+	my_conn->stream = NULL;
+	if (my_conn->stmts != NULL) {
+		luaM_stmt_clear(conn, my_conn->stmts, 0);
 	}
-
-    while ((res = PQgetResult(my_conn->conn))) {
-        PQclear(res);
-        leftover = 1;
-    }
-
-    if (leftover) {
-        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
-		return 1;
-    }
-
-
-    if ( ! PQsendQueryPrepared(my_conn->conn, stmtname, num_params,
-					(const char * const *)params, NULL, NULL, 0)) {
-        if (PQstatus(my_conn->conn) != CONNECTION_OK) {
-			PQreset(my_conn->conn);
-        }
-		if ( ! PQsendQueryPrepared(my_conn->conn, stmtname, num_params,
-						(const char * const *)params, NULL, NULL, 0)) {
-			lua_pushboolean(L, 0);
-			return 1;
-        }
-    }
-
-	if (PQsetnonblocking(my_conn->conn, 0)) {
-		lua_pushstring(L, "Cannot set connection to blocking mode");
-		return 1;
+	if ( ! PQresetStart(conn)) {
+		return 0;
 	}
-
-	lua_pushboolean(L, 1);
+	while (status != PGRES_POLLING_OK) {
+		if (status == PGRES_POLLING_FAILED
+				|| luaM_poll_socket(conn, status == PGRES_POLLING_WRITING ? POLLOUT : POLLIN, deadline) <= 0) {
+			return 0;
+		}
+		status = PQresetPoll(conn);
+	}
+	luaM_waitset_refresh(my_conn);
 	return 1;
 }
 
-static int Lpg_send_query_params (lua_State *L) {
-	int leftover = 0;
-	PGresult *res;
-	int num_params = 0;
-	char **params = NULL;
+/**
+* Prepared statement Part
+*/
 
-    lua_pg_conn *my_conn = Mget_conn (L);
-	const char *query = luaL_checkstring (L, 2);
+static void luaM_desc_free (lua_State *L, lua_pg_desc *d) {
+	luaL_unref(L, LUA_REGISTRYINDEX, d->keys);
+	free(d->decoders[0]);
+	free(d->decoders[1]);
+	free(d->types);
+	free(d->params);
+	free(d->name);
+	free(d->sql);
+	free(d);
+}
 
-	if (lua_istable(L, 3)) {
-		luaL_checktype(L, 3, LUA_TTABLE);
-		num_params = lua_objlen(L, 3);
-		if (num_params > 0) {
-			int i = 0;
-			params = (char **)safe_emalloc(sizeof(char *), 1, 0);
+static void luaM_desc_free_all (lua_State *L, lua_pg_conn *my_conn) {
+	lua_pg_desc *d, *next;
 
-			for (i = 0; i < num_params; i++) {
-				lua_rawgeti(L, 3, i);
-				params[i] = (char *) lua_tostring(L, -1);
-				lua_pop(L, 1);
-			}
-		}
-	} else {
-		num_params = 1;
-		params = (char **)safe_emalloc(sizeof(char *), 1, 0);
-		if (lua_isstring(L, 3)) { // auto set one param value
-			params[0] = (char *) luaL_checkstring(L, 3);
-		} else {
-			params[0] = NULL;
+	for (d = my_conn->descs; d != NULL; d = next) {
+		next = d->next;
+		luaM_desc_free(L, d);
+	}
+	my_conn->descs = NULL;
+}
+
+/**
+* Description of the statement `name', moved to the front of the list.
+* NULL when unknown or prepared before the last reset.
+*/
+static lua_pg_desc *luaM_desc_find (lua_pg_conn *my_conn, const char *name) {
+	lua_pg_desc *d, **prev = &my_conn->descs;
+	unsigned int hash = luaM_hash(name);
+
+	for (d = my_conn->descs; d != NULL; prev = &d->next, d = d->next) {
+		if (d->hash == hash && strcmp(d->name, name) == 0) {
+			*prev = d->next;
+			d->next = my_conn->descs;
+			my_conn->descs = d;
+			return d->session == my_conn->session ? d : NULL;
 		}
 	}
+	return NULL;
+}
 
-	if (PQsetnonblocking(my_conn->conn, 1)) {
-		lua_pushstring(L, "Cannot set connection to nonblocking mode");
-		return 1;
+static void luaM_desc_forget (lua_State *L, lua_pg_conn *my_conn, const char *name) {
+	lua_pg_desc *d, **prev = &my_conn->descs;
+
+	for (d = my_conn->descs; d != NULL; prev = &d->next, d = d->next) {
+		if (strcmp(d->name, name) == 0) {
+			*prev = d->next;
+			luaM_desc_free(L, d);
+			return;
+		}
 	}
+}
 
-    while ((res = PQgetResult(my_conn->conn))) {
-        PQclear(res);
-        leftover = 1;
-    }
+/**
+* Record the statement `name' just prepared with `nparams' types (none
+* when 0), replacing a previous one. Described by luaM_desc_fill().
+* The unnamed statement is not kept, any query replaces it.
+*/
+static lua_pg_desc *luaM_desc_add (lua_State *L, lua_pg_conn *my_conn, const char *name,
+		const char *sql, int nparams, const Oid *params) {
+	lua_pg_desc *d;
 
-    if (leftover) {
-        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
-		return 1;
-    }
+	luaM_desc_forget(L, my_conn, name);
+	if (*name == '\0' || (d = (lua_pg_desc *)calloc(1, sizeof(lua_pg_desc))) == NULL) {
+		return NULL;
+	}
+	if ((d->name = strdup(name)) == NULL || (d->sql = strdup(sql)) == NULL
+			|| (nparams > 0 && (d->params = (Oid *)malloc(nparams * sizeof(Oid))) == NULL)) {
+		free(d->name);
+		free(d->sql);
+		free(d);
+		return NULL;
+	}
+	if (nparams > 0) {
+		memcpy(d->params, params, nparams * sizeof(Oid));
+	}
+	d->hash = luaM_hash(name);
+	d->session = my_conn->session;
+	d->nparams = nparams;
+	d->numcols = -1;
+	d->keys = LUA_NOREF;
+	d->next = my_conn->descs;
+	my_conn->descs = d;
+	return d;
+}
 
+/**
+* Fetch the parameter and column types of a statement, and choose once
+* the column names and decoders of its results. Costs one round trip.
+*/
+static int luaM_desc_fill (lua_State *L, lua_pg_conn *my_conn, lua_pg_desc *d) {
+	PGresult *res;
+	int i, n, numcols;
+	Oid *params = NULL;
+
+	my_conn->stats.round_trips++;
+	luaM_ring_push(my_conn, '>', 'D', strlen(d->name), d->name, NULL);
+	res = PQdescribePrepared(my_conn->conn, d->name);
+	if (res != NULL) {
+		luaM_ring_result(my_conn, res);
+	}
 
-    if ( ! PQsendQueryParams(my_conn->conn, query, num_params,
-					 NULL, (const char * const *)params, NULL, NULL, 0)) {
-		if (PQstatus(my_conn->conn) != CONNECTION_OK) {
-			PQreset(my_conn->conn);
-        }
-		if ( ! PQsendQueryParams(my_conn->conn, query, num_params,
-						 NULL, (const char * const *)params, NULL, NULL, 0)) {
-        }
-    }
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		PQclear(res);
+		return 0;
+	}
+	n = PQnparams(res);
+	numcols = PQnfields(res);
+	if ((n > 0 && (params = (Oid *)malloc(n * sizeof(Oid))) == NULL)
+			|| (d->types = (Oid *)malloc((numcols + 1) * sizeof(Oid))) == NULL
+			|| (d->decoders[0] = (lua_pg_decoder *)malloc((numcols + 1) * sizeof(lua_pg_decoder))) == NULL
+			|| (d->decoders[1] = (lua_pg_decoder *)malloc((numcols + 1) * sizeof(lua_pg_decoder))) == NULL) {
+		free(params);
+		free(d->types);
+		free(d->decoders[0]);
+		d->types = NULL;
+		d->decoders[0] = NULL;
+		PQclear(res);
+		return 0;
+	}
 
-	if (PQsetnonblocking(my_conn->conn, 0)) {
-		lua_pushstring(L, "Cannot set connection to blocking mode");
-		return 1;
+	for (i = 0; i < n; i++) {
+		params[i] = PQparamtype(res, i);
 	}
+	free(d->params);
+	d->params = params;
+	d->nparams = n;
+
+	lua_createtable(L, numcols, 0);
+	for (i = 0; i < numcols; i++) {
+		d->types[i] = PQftype(res, i);
+		d->decoders[0][i] = luaM_text_decoder(d->types[i]);
+		d->decoders[1][i] = luaM_binary_decoder(d->types[i]);
+		lua_pushstring(L, PQfname(res, i));
+		lua_rawseti(L, -2, i + 1);
+	}
+	d->keys = luaL_ref(L, LUA_REGISTRYINDEX);
+	d->numcols = numcols;
 
-	lua_pushboolean(L, 1);
+	PQclear(res);
 	return 1;
 }
 
-static int Lpg_put_line (lua_State *L) {
-    int result = 0;
-    lua_pg_conn *my_conn = Mget_conn (L);
+/**
+* Give a result of the statement its column names and decoders, unless
+* the statement was redefined behind our back and they do not fit.
+*/
+static void luaM_desc_apply (lua_State *L, const lua_pg_desc *d, lua_pg_res *my_res) {
+	int i;
 
-	const char *statement = luaL_checkstring (L, 2);
+	if (d->numcols != my_res->numcols) {
+		return;
+	}
+	for (i = 0; i < d->numcols; i++) {
+		if (PQftype(my_res->res, i) != d->types[i]) {
+			return;
+		}
+	}
 
+	lua_rawgeti(L, LUA_REGISTRYINDEX, d->keys);
+	my_res->keys = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (my_res->decode && my_res->numcols > 0) {
+		my_res->decoders = (lua_pg_decoder *)safe_emalloc(sizeof(lua_pg_decoder), my_res->numcols, 0);
+		if (my_res->decoders != NULL) {
+			memcpy(my_res->decoders, d->decoders[PQfformat(my_res->res, 0)],
+					my_res->numcols * sizeof(lua_pg_decoder));
+		}
+	}
+}
 
-    result = PQputline(my_conn->conn, statement);
-    if (result == EOF) {
+/**
+* Wrap an open connection in a new connection object left on top of
+* the stack.
+*/
+static lua_pg_conn *Mnew_conn (lua_State *L, PGconn *conn) {
+	int fc = Lpg_get_field_class_hash(L, conn);
+
+    lua_pg_conn *my_conn = (lua_pg_conn *)lua_newuserdata(L, sizeof(lua_pg_conn));
+    luaM_setmeta (L, LUA_PGSQL_CONN);
+
+    /* fill in structure */
+    my_conn->closed = 0;
+    my_conn->env = LUA_NOREF;
+    my_conn->conn = conn;
+	my_conn->field_class = fc;
+	my_conn->types = NULL;
+	my_conn->stmts = NULL;
+	my_conn->pool = NULL;
+	my_conn->dirty = 0;
+	my_conn->nonblocking = 0;
+	my_conn->notify = LUA_NOREF;
+	my_conn->decode = 0;
+	my_conn->result_format = 0;
+	memset(&my_conn->params, 0, sizeof(lua_pg_params));
+	my_conn->descs = NULL;
+	my_conn->session = 0;
+	memset(&my_conn->stats, 0, sizeof(lua_pg_stats));
+	my_conn->stats.since = luaM_now();
+	my_conn->latency = NULL;
+	my_conn->slow = 0;
+	my_conn->on_slow = LUA_NOREF;
+	my_conn->in_hook = 0;
+	my_conn->waitset = NULL;
+	my_conn->ws_events = 0;
+	my_conn->copy_start = 0;
+	my_conn->stream = NULL;
+	my_conn->ring = NULL;
+	my_conn->ring_size = PGSQL_TRACE_SIZE;
+	my_conn->trace = NULL;
+	luaM_retry_defaults(&my_conn->retry);
+	my_conn->seed = ((unsigned int)(luaM_now() * 1e6) ^ (unsigned int)(size_t)my_conn) | 1;
+	luaM_count(live_conns, 1);
+
+	return my_conn;
+}
+
+/**
+* Session Part
+*/
+
+static int luaM_word (const char *s, const char *word) {
+	size_t len = strlen(word);
+	return strncasecmp(s, word, len) == 0 && ! isalnum((unsigned char)s[len]) && s[len] != '_';
+}
+
+/**
+* Whether `sql' may leave state in the session that DISCARD ALL would
+* reset: settings, prepared statements, cursors, LISTEN, temporary
+* tables or advisory locks. It only looks at the first words of each
+* statement, so it errs on the side of the statements it knows.
+*/
+static int luaM_session_dirty (const char *sql) {
+	static const char *const words[] = {
+		"set", "reset", "prepare", "listen", "declare", "load", "discard", NULL
+	};
+	const char *p = sql;
+	int i;
+
+	for (; *p; p++) {
+		if (tolower((unsigned char)*p) == 'a' && strncasecmp(p, "advisory_", 9) == 0) {
+			return 1;
+		}
+		if (tolower((unsigned char)*p) == 's' && strncasecmp(p, "set_config", 10) == 0) {
+			return 1;
+		}
+	}
+
+	for (p = sql; *p; ) {
+		while (isspace((unsigned char)*p) || *p == '(') {
+			p++;
+		}
+		for (i = 0; words[i] != NULL; i++) {
+			if (luaM_word(p, words[i])) {
+				return 1;
+			}
+		}
+		if (luaM_word(p, "create")) {
+			for (p += 6; isspace((unsigned char)*p); p++);
+			if (luaM_word(p, "global") || luaM_word(p, "local")) {
+				while (isalpha((unsigned char)*p)) p++;
+				while (isspace((unsigned char)*p)) p++;
+			}
+			if (luaM_word(p, "temp") || luaM_word(p, "temporary")) {
+				return 1;
+			}
+		}
+		if ((p = strchr(p, ';')) == NULL) {
+			break;
+		}
+		p++;
+	}
+	return 0;
+}
+
+/**
+* Whether running `sql' twice does what running it once does: each of
+* its statements reads (SELECT, VALUES, TABLE, SHOW, EXPLAIN without
+* ANALYZE) or sets a setting. A SELECT calling a function that writes
+* is taken for idempotent too, the caller has to say otherwise.
+*/
+static int luaM_idempotent (const char *sql) {
+	static const char *const words[] = {
+		"select", "values", "table", "show", "set", "reset", NULL
+	};
+	const char *p = sql;
+	int i;
+
+	for (;;) {
+		while (isspace((unsigned char)*p) || *p == '(') {
+			p++;
+		}
+		if (luaM_word(p, "explain")) {
+			for (p += 7; isspace((unsigned char)*p); p++);
+			if (*p == '(' || luaM_word(p, "analyze") || luaM_word(p, "analyse")) {
+				return 0;
+			}
+		}
+		for (i = 0; words[i] != NULL; i++) {
+			if (luaM_word(p, words[i])) {
+				break;
+			}
+		}
+		if (words[i] == NULL) {
+			return 0;
+		}
+		if ((p = strchr(p, ';')) == NULL) {
+			return 1;
+		}
+		for (p++; isspace((unsigned char)*p); p++);
+		if (*p == '\0') {
+			return 1;
+		}
+	}
+}
+
+/* note a pooled session may need a DISCARD ALL before its next use */
+static void luaM_track_session (lua_pg_conn *my_conn, const char *sql) {
+	if (my_conn->pool != NULL && ! my_conn->dirty) {
+		my_conn->dirty = sql == NULL || luaM_session_dirty(sql);
+	}
+}
+
+/**
+* PGSQL operate functions
+*/
+
+/**
+* Open a connection to a PgSQL Server
+*/
+static int Lpg_connect (lua_State *L) {
+    const char *conninfo = luaL_optstring(L, 1, "dbname = postgres");
+
+	PGconn *conn = PQconnectdb(conninfo);
+
+	if (conn == NULL) {
+        luaM_msg (L, 0, "Unable to connect to PostgreSQL server");
+		return 2;
+	}
+    else if (PQstatus(conn) != CONNECTION_OK) {
+		luaM_msg(L, 0, PQerrorMessage(conn));
+        PQfinish(conn);
+        return 2;
+    }
+
+	Mnew_conn (L, conn);
+
+	return 1;
+}
+
+int Lpg_get_field_class_hash (lua_State *L, PGconn *conn) {
+
+	lua_newtable (L); /* field tables result */
+
+	return luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
+/**
+* Start opening a connection without blocking. Returns the connection
+* object and "writing": wait for its socket to be writable, then call
+* db:connect_poll() until it returns "ok".
+*/
+static int Lpg_connect_start (lua_State *L) {
+    const char *conninfo = luaL_optstring(L, 1, "dbname = postgres");
+
+	PGconn *conn = PQconnectStart(conninfo);
+
+	if (conn == NULL) {
+        luaM_msg (L, 0, "Unable to connect to PostgreSQL server");
+		return 2;
+	}
+    else if (PQstatus(conn) == CONNECTION_BAD) {
+		luaM_msg(L, 0, PQerrorMessage(conn));
+        PQfinish(conn);
+        return 2;
+    }
+
+	Mnew_conn (L, conn);
+	lua_pushliteral(L, "writing");
+
+	return 2;
+}
+
+/**
+* Advance a connection opened by pgsql.connect_start(): returns the
+* readiness of the socket to wait for, "reading" or "writing", or "ok"
+* once connected, or FALSE and the error message.
+*/
+static int Lpg_connect_poll (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	PostgresPollingStatusType status = PQconnectPoll(my_conn->conn);
+
+	/* libpq opens a new socket for each address it tries */
+	luaM_waitset_refresh(my_conn);
+	switch (status) {
+		case PGRES_POLLING_READING:
+			lua_pushliteral(L, "reading");
+			return 1;
+		case PGRES_POLLING_OK:
+			lua_pushliteral(L, "ok");
+			return 1;
+		case PGRES_POLLING_FAILED:
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, PQerrorMessage(my_conn->conn));
+			return 2;
+		default:
+			lua_pushliteral(L, "writing");
+			return 1;
+	}
+}
+
+/* file descriptor of the connection socket, -1 if there is none */
+static int Lpg_socket (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	lua_pushnumber(L, PQsocket(my_conn->conn));
+	return 1;
+}
+
+static int Lpg_host (lua_State *L) {
+    lua_pushstring(L, PQhost(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_port (lua_State *L) {
+    lua_pushstring(L, PQport(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_dbname (lua_State *L) {
+    lua_pushstring(L, PQdb(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_tty (lua_State *L) {
+    lua_pushstring(L, PQtty(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_get_pid (lua_State *L) {
+    lua_pushnumber(L, PQbackendPID(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_do_get_field_name (lua_State *L, lua_pg_conn *my_conn, Oid oid) {
+	if ( ! oid) {
+		luaM_push_type_names(L, my_conn); /* return all field name in a table */
+	} else {
+		luaM_push_type_name(L, my_conn, oid);
+	}
+	return 1;
+}
+
+static int Lpg_get_field_name (lua_State *L) {
+    lua_Number oid = luaL_optnumber(L, 2, 0);
+	return Lpg_do_get_field_name (L, Mget_conn(L), oid);
+}
+
+static int Lpg_do_get_field_table (lua_State *L, Oid oid, int force) {
+	const char *sql;
+	PGresult *res;
+
+	if (! oid) {
+		return 1;
+	}
+
+	lua_pg_conn *my_conn = Mget_conn (L);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, my_conn->field_class);
+
+	if ( ! force) { /* return field_table form cache hash */
+		const char *name;
+		lua_pushnumber(L, oid);
+		lua_gettable(L, -2); 
+		name = lua_tolstring(L, -1, NULL);
+		lua_pop(L, 1);
+		
+		if (name != NULL) {
+			lua_pushstring(L, name);
+			return 1;
+		}
+	}
+
+	lua_pushfstring(L, "select oid,relname from pg_class where oid=%d", oid);
+	sql = lua_tolstring(L, -1, NULL);
+	lua_pop(L, 1);
+
+	if ((res = PQexec(my_conn->conn, sql)) == NULL || PQresultStatus(res) != PGRES_TUPLES_OK) {
+		if (res) {
+			PQclear(res);
+		}
+	} else {
+
+		int i,num_rows;
+		int oid_offset,class_offset;
+		char *tmp_oid, *tmp_name;
+
+		num_rows = PQntuples(res);
+		oid_offset = PQfnumber(res, "oid");
+		class_offset = PQfnumber(res, "relname");
+
+
+		for ( i = 0; i < num_rows; i++) {
+			if ((tmp_oid = PQgetvalue(res, i, oid_offset)) == NULL) {
+				continue;
+			}
+
+			if ((tmp_name = PQgetvalue(res, i, class_offset)) == NULL) {
+				continue;
+			}
+
+			luaM_pushvalue(L, tmp_name, strlen(tmp_name));
+			lua_rawseti(L, -2, atoi(tmp_oid));
+		}
+		PQclear(res);
+	}
+
+    if ( ! lua_istable(L, -1)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "get `field_types' info error!");
+		return 2;
+	}
+
+	lua_pushnumber(L, oid);
+	lua_gettable(L, -2); 
+
+	return 1;
+}
+
+
+static int Lpg_get_field_table (lua_State *L) {
+    lua_Number oid = luaL_optnumber(L, 2, 0);
+    lua_Number is_force = luaL_optnumber(L, 3, 0);
+	return Lpg_do_get_field_table (L, oid, is_force);
+}
+
+static int Lpg_field_table (lua_State *L) {
+	Oid oid;
+
+	lua_pg_res *my_res = Mget_res (L);
+    lua_Number field_number = luaL_optnumber(L, 2, 0);
+    lua_Number is_oid = luaL_optnumber(L, 3, 0);
+    lua_Number is_force = luaL_optnumber(L, 4, 0);
+
+	if (field_number < 0 || field_number >= PQnfields(my_res->res)) {
+		luaM_msg(L, 0,  "Bad field offset specified");
+		return 2;
+	}
+
+    oid = PQftable(my_res->res, field_number);
+
+    if (InvalidOid == oid) {
+		lua_pushboolean(L, 0);
+		return 1;
+    }
+
+	if (is_oid) {
+		lua_pushnumber(L, oid);
+		return 1;
+	}
+
+	luaM_msg(L, 0, "building");
+	return 2;
+	return Lpg_do_get_field_table (L, oid, is_force);
+}
+
+static int Lpg_version (lua_State *L) {
+	char *client = PG_VERSION;
+	lua_Number protocol = PQprotocolVersion(Mget_conn(L)->conn);
+	lua_Number server_version = PQserverVersion(Mget_conn(L)->conn);
+
+	lua_newtable(L); /* result */
+
+    luaM_pushvalue (L, "client", strlen("client"));
+    luaM_pushvalue (L, client, strlen(client));
+    lua_rawset (L, -3);
+
+
+    luaM_pushvalue (L, "protocol", strlen("protocol"));
+    lua_pushnumber (L, protocol);
+    lua_rawset (L, -3);
+
+	if (protocol >= 3) {
+		server_version = atoi(PQparameterStatus(Mget_conn(L)->conn, "server_version"));
+    }
+
+    luaM_pushvalue (L, "server_version", strlen("server_version"));
+    lua_pushnumber (L, server_version);
+    lua_rawset (L, -3);
+
+    return 1;
+}
+
+static int Lpg_connection_status (lua_State *L) {
+    lua_pushnumber(L, PQstatus(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_transaction_status (lua_State *L) {
+    lua_pushnumber(L, PQtransactionStatus(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_options (lua_State *L) {
+    lua_pushstring(L, PQoptions(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_parameter_status (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+    const char *param_name = luaL_optstring(L, 2, NULL);
+    const char *status = PQparameterStatus(my_conn->conn, param_name);
+    lua_pushstring (L, status);
+    return 1;
+}
+
+static int Lpg_ping (lua_State *L) {
+	PGresult *res;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+
+    /* ping connection */
+     res = PQexec(my_conn->conn, "SELECT 1;");
+    PQclear(res);
+
+    /* check status. */
+    if (PQstatus(my_conn->conn) == CONNECTION_OK) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+    /* reset connection if it's broken */
+    luaM_reset(my_conn, my_conn->retry.timeout);
+    if (PQstatus(my_conn->conn) == CONNECTION_OK) {
+		lua_pushboolean(L, 1);
+		return 1;
+    }
+
+	lua_pushboolean(L, 0);
+	return 1;
+}
+
+static int Lpg_get_notify (lua_State *L) {
+	long result_type = PGSQL_ASSOC;
+    PGnotify *pgsql_notify;
+
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+    const char *result_type_str = luaL_optstring (L, 2, "PGSQL_ASSOC");
+	result_type = luaM_const(L, result_type_str);
+    if ( ! (result_type & PGSQL_BOTH)) {
+        lua_pushstring(L, "Invalid result type");
+		return 1;
+    }
+
+    PQconsumeInput(my_conn->conn);
+    pgsql_notify = PQnotifies(my_conn->conn);
+    if ( ! pgsql_notify) {
+        /* no notify message */
+		lua_pushboolean(L, 0);
+		return 1;
+    }
+
+	lua_newtable(L);
+
+    if (result_type & PGSQL_NUM) {
+		lua_pushstring(L, pgsql_notify->relname);
+		lua_rawseti(L, -2, 1);
+		lua_pushnumber(L, pgsql_notify->be_pid);
+		lua_rawseti(L, -2, 2);
+		lua_pushstring(L, pgsql_notify->extra);
+		lua_rawseti(L, -2, 3);
+    }
+    if (result_type & PGSQL_ASSOC) {
+		lua_pushstring(L, "message");
+		lua_pushstring(L, pgsql_notify->relname);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "pid");
+		lua_pushnumber(L, pgsql_notify->be_pid);
+		lua_rawset(L, -3);
+		lua_pushstring(L, "payload");
+		lua_pushstring(L, pgsql_notify->extra);
+		lua_rawset(L, -3);
+    }
+    PQfreemem(pgsql_notify);
+
+	return 1;
+}
+
+/**
+* Push the notifications queued on the connection, starting with
+* `first' if not NULL, up to `max' (0 for all): the ones with a handler
+* set by db:on_notify() are passed to it, the others are appended to an
+* array left on the stack. Returns the number handled either way.
+*/
+static int luaM_push_notifies (lua_State *L, lua_pg_conn *my_conn, PGnotify *first, int max) {
+	PGnotify *notify = first;
+	int n = 0, queued = 0;
+
+	lua_newtable(L);
+	if (my_conn->notify != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, my_conn->notify);
+	} else {
+		lua_pushnil(L);
+	}
+
+	while ((max <= 0 || n < max) && (notify != NULL || (notify = PQnotifies(my_conn->conn)) != NULL)) {
+		n++;
+		lua_createtable(L, 0, 3);
+		lua_pushstring(L, notify->relname);
+		lua_setfield(L, -2, "channel");
+		lua_pushnumber(L, notify->be_pid);
+		lua_setfield(L, -2, "pid");
+		lua_pushstring(L, notify->extra);
+		lua_setfield(L, -2, "payload");
+
+		/* handler(channel, payload, pid); freed first as it may raise an error */
+		if (lua_istable(L, -2)) {
+			lua_getfield(L, -2, notify->relname);
+		} else {
+			lua_pushnil(L);
+		}
+		if (lua_isfunction(L, -1)) {
+			lua_getfield(L, -2, "channel");
+			lua_getfield(L, -3, "payload");
+			lua_getfield(L, -4, "pid");
+			PQfreemem(notify);
+			notify = NULL;
+			lua_call(L, 3, 0);
+			lua_pop(L, 1);
+		} else {
+			PQfreemem(notify);
+			notify = NULL;
+			lua_pop(L, 1);
+			lua_rawseti(L, -3, ++queued);
+		}
+	}
+	lua_pop(L, 1);
+
+	return n;
+}
+
+/**
+* Drain the notifications received so far, up to max, without waiting.
+*/
+static int Lpg_notifications (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	int max = (int)luaL_optnumber(L, 2, 0);
+
+	PQconsumeInput(my_conn->conn);
+	luaM_push_notifies(L, my_conn, NULL, max);
+	return 1;
+}
+
+/**
+* Sleep on the socket until a notification arrives or `timeout' seconds
+* (forever when nil) elapsed. Returns the notifications as
+* db:notifications(), FALSE on timeout.
+*/
+static int Lpg_wait_notify (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	double timeout = luaL_optnumber(L, 2, -1);
+	int max = (int)luaL_optnumber(L, 3, 0);
+	double deadline = luaM_now() + timeout;
+	PGnotify *notify;
+	int ret;
+
+	for (;;) {
+		if ( ! PQconsumeInput(my_conn->conn)) {
+			lua_pushnil(L);
+			lua_pushstring(L, PQerrorMessage(my_conn->conn));
+			return 2;
+		}
+		if ((notify = PQnotifies(my_conn->conn)) != NULL) {
+			luaM_push_notifies(L, my_conn, notify, max);
+			return 1;
+		}
+
+		if (PQsocket(my_conn->conn) < 0) {
+			lua_pushnil(L);
+			lua_pushstring(L, "Connection has no socket");
+			return 2;
+		}
+		if ((ret = luaM_poll_socket(my_conn->conn, POLLIN, timeout >= 0 ? deadline : 0)) == 0) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+		if (ret < 0) {
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(errno));
+			return 2;
+		}
+	}
+}
+
+/**
+* Set the function called by db:notifications() and db:wait_notify()
+* for the notifications of `channel', or remove it with nil.
+*/
+static int Lpg_on_notify (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	luaL_checkstring(L, 2);
+	if ( ! lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	}
+	if (my_conn->notify == LUA_NOREF) {
+		lua_newtable(L);
+		my_conn->notify = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, my_conn->notify);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_rawset(L, -3);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int Lpg_meta_data (lua_State *L) {
+    PGresult *res;
+    const char *tmp_name, *tmp_name2 = NULL;
+	const char *sql;
+    int i, num_rows;
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+
+    const char *table_name = luaL_optstring (L, 2, NULL);
+
+    if (table_name == NULL) {
+		lua_pushboolean(L, 0);
+        lua_pushstring(L, "The table name must be specified");
+		return 2;
+    }
+
+	/* match out the public.tbl */
+	lua_getglobal(L, "string");
+	lua_getfield(L, -1, "match");
+
+	if (lua_isfunction(L, -1) != 1) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "string.match is not a function?");
+		return 2;
+	}
+
+	lua_pushstring(L, table_name);
+	lua_pushstring(L, "^([^.]+)%.([^.]+)");
+
+	if (lua_pcall(L, 2, 2, 0) != 0) {
+		lua_pushboolean(L, 0);
+		lua_tostring(L, -1);
+		return 2;
+	}
+
+	if (lua_isnoneornil(L, -1)) {
+        /* Default schema */
+        tmp_name2 = table_name;
+        tmp_name = "public";
+	} else {
+		tmp_name = lua_tostring(L, -2);
+		tmp_name2 = lua_tostring(L, -1);
+	}
+
+	lua_pop(L, 4);
+
+    lua_pushfstring(L,
+        "SELECT a.attname, a.attnum, t.typname, a.attlen, a.attnotNULL, a.atthasdef, a.attndims "
+        "FROM pg_class as c, pg_attribute a, pg_type t, pg_namespace n "
+        "WHERE a.attnum > 0 AND a.attrelid = c.oid AND c.relname = '%s' AND c.relnamespace = n.oid AND n.nspname = '%s'"
+		"AND a.atttypid = t.oid ORDER BY a.attnum;",
+		tmp_name2, tmp_name);
+	sql = lua_tolstring(L, -1, NULL);
+	lua_pop(L, 1);
+
+
+    res = PQexec(my_conn->conn, sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || (num_rows = PQntuples(res)) == 0) {
+		lua_pushboolean(L, 0);
+        lua_pushfstring(L, "Table '%s' doesn't exists", table_name);
+        PQclear(res);
+        return 2;
+    }
+
+	//return 1;
+	lua_newtable(L);
+
+    for (i = 0; i < num_rows; i++) {
+		/* table key */
+		lua_pushstring(L, PQgetvalue(res,i,0));
+		/* sub table value */
+		lua_newtable(L);
+
+		lua_pushstring(L, "num");
+		lua_pushnumber(L, atoi(PQgetvalue(res,i,1)));
+		lua_rawset(L, -3);
+
+		lua_pushstring(L, "type");
+		lua_pushstring(L, PQgetvalue(res,i,2));
+		lua_rawset(L, -3);
+
+		lua_pushstring(L, "len");
+		lua_pushnumber(L, atoi(PQgetvalue(res,i,3)));
+		lua_rawset(L, -3);
+
+        if (!strcmp(PQgetvalue(res, i, 4), "t")) {
+			lua_pushstring(L, "not null");
+			lua_pushboolean(L, 1);
+			lua_rawset(L, -3);
+        }
+        else {
+			lua_pushstring(L, "not null");
+			lua_pushboolean(L, 0);
+			lua_rawset(L, -3);
+        }
+        if (!strcmp(PQgetvalue(res,i,5), "t")) {
+			lua_pushstring(L, "has default");
+			lua_pushboolean(L, 1);
+			lua_rawset(L, -3);
+        }
+        else {
+			lua_pushstring(L, "has default");
+			lua_pushboolean(L, 0);
+			lua_rawset(L, -3);
+        }
+
+		lua_pushstring(L, "array dims");
+		lua_pushnumber(L, atoi(PQgetvalue(res,i,6)));
+		lua_rawset(L, -3);
+		/* into sub table*/
+		lua_rawset(L, -3);
+    }
+
+    PQclear(res);
+	
+	return 1;
+}
+
+static int Lpg_last_error (lua_State *L) {
+    lua_pushstring(L, PQerrorMessage(Mget_conn(L)->conn));
+    return 1;
+}
+
+static int Lpg_set_error_verbosity (lua_State *L) {
+    const char *result_type = luaL_optstring (L, 2, "PQERRORS_DEFAULT");
+	lua_pushnumber(L, PQsetErrorVerbosity(Mget_conn (L)->conn, luaM_const(L, result_type)));
+    return 1;
+}
+
+static int Lpg_escape_bytea (lua_State *L) {
+	size_t to_len;
+	unsigned char *to; 
+
+    lua_pg_conn *my_conn = Mget_conn (L);
+    const char *from = luaL_optstring(L, 2, NULL);
+	if (my_conn->conn) {
+		to = PQescapeByteaConn(my_conn->conn, (unsigned char*)from, strlen(from), &to_len);
+	} else {
+		to = PQescapeBytea((unsigned char*)from, strlen(from), &to_len);
+	}
+    luaM_pushvalue (L, to, to_len-1);
+	PQfreemem(to);
+    return 1;
+}
+
+static int Lpg_unescape_bytea (lua_State *L) {
+	size_t to_len;
+    //lua_pg_conn *my_conn = Mget_conn (L);
+    const char *from = luaL_optstring(L, 2, NULL);
+    unsigned char *to = PQunescapeBytea((unsigned char*)from, &to_len);
+    luaM_pushvalue (L, to, to_len);
+	PQfreemem(to);
+    return 1;
+}
+
+static int Lpg_escape_string (lua_State *L) {
+	char *to = NULL;
+	int to_len, from_len;
+
+    lua_pg_conn *my_conn = Mget_conn (L);
+    const char *from = luaL_optstring(L, 2, NULL);
+	from_len = strlen(from);
+	to = (char *) safe_emalloc(from_len, 2, 1);
+
+	if (my_conn->conn) {
+		to_len = (int) PQescapeStringConn(my_conn->conn, to, from, (size_t)from_len, NULL);
+	} else {
+		to_len = (int) PQescapeString(to, from, (size_t)from_len);
+	}
+
+    luaM_pushvalue (L, to, to_len);
+    return 1;
+}
+
+static int Lpg_connection_busy (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+    PQconsumeInput(my_conn->conn);
+    lua_pushboolean(L, PQisBusy(my_conn->conn));
+    return 1;
+}
+
+/**
+* Keep the connection in nonblocking mode after the send_* calls, which
+* then return at once with whether db:flush() is needed.
+*/
+static int Lpg_set_nonblocking (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	my_conn->nonblocking = lua_toboolean(L, 2);
+	if (PQsetnonblocking(my_conn->conn, my_conn->nonblocking)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+* Send buffered query data: TRUE if some is left, wait for the socket
+* to be writable and call again, FALSE once all was sent.
+*/
+static int Lpg_flush (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	int ret = PQflush(my_conn->conn);
+
+	if (ret < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		return 2;
+	}
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+/* read what the server sent, without blocking */
+static int Lpg_consume_input (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	if ( ! PQconsumeInput(my_conn->conn)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* whether db:get_result() would block, as of the last consume_input() */
+static int Lpg_is_busy (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	lua_pushboolean(L, PQisBusy(my_conn->conn));
+	return 1;
+}
+
+static int Lpg_connection_reset (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+    if ( ! luaM_reset(my_conn, my_conn->retry.timeout)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		return 2;
+    }
+	lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int Lpg_cancel_query (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	lua_Number return_value;
+    return_value = PQrequestCancel(my_conn->conn);
+	luaM_drain(my_conn->conn, NULL);
+
+    lua_pushboolean(L, return_value);
+    return 1;
+}
+
+/* stop PQtrace and close its file */
+static void luaM_untrace (lua_pg_conn *my_conn) {
+	if (my_conn->trace != NULL) {
+		PQuntrace(my_conn->conn);
+		fclose(my_conn->trace);
+		my_conn->trace = NULL;
+	}
+}
+
+/**
+* Write the protocol messages of the connection to `filename', ending
+* a previous trace. The file is closed by db:untrace() or db:finish().
+*/
+static int Lpg_trace (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	FILE *fp = NULL;
+
+    const char *filename = luaL_checkstring(L, 2);
+    const char *mode = luaL_optstring(L, 3, "w");
+	fp = fopen(filename, mode);
+	if (fp == NULL) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, "Cannot open %s", filename);
+		return 2;
+	}
+	luaM_untrace(my_conn);
+	PQtrace(my_conn->conn, fp);
+	my_conn->trace = fp;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int Lpg_untrace (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	luaM_untrace(my_conn);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int Lpg_client_encoding (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	char *result_value = (char *)pg_encoding_to_char(PQclientEncoding(my_conn->conn));
+	lua_pushstring(L, result_value);
+    return 1;
+}
+
+static int Lpg_set_client_encoding (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+    const char *encoding = luaL_optstring(L, 2, NULL);
+	int result_value = (PQsetClientEncoding (my_conn->conn, encoding) == 0) ? 1 : 0;
+	luaM_track_session(my_conn, NULL);
+    lua_pushboolean(L, result_value);
+    return 1;
+}
+
+/**
+* resultFormat of a call: the `binary' field of the options table at
+* `idx' (or a boolean), defaulting to the connection setting.
+*/
+static int Mget_result_format (lua_State *L, lua_pg_conn *my_conn, int idx) {
+	int format = my_conn->result_format;
+
+	if (lua_istable(L, idx)) {
+		lua_getfield(L, idx, "binary");
+		if ( ! lua_isnil(L, -1)) {
+			format = lua_toboolean(L, -1) ? 1 : 0;
+		}
+		lua_pop(L, 1);
+	} else if (lua_isboolean(L, idx)) {
+		format = lua_toboolean(L, idx) ? 1 : 0;
+	}
+	return format;
+}
+
+/**
+* Grow the parameter arrays to `n' entries at least.
+*/
+static void luaM_params_reserve (lua_State *L, lua_pg_params *p, int n) {
+	int size = p->size ? p->size : 8;
+	void *ptr;
+
+	if (n <= p->size) {
+		return;
+	}
+	while (size < n) {
+		size *= 2;
+	}
+	/* the arrays only count as grown once they all are */
+	if ((ptr = realloc((void *)p->values, size * sizeof(char *))) == NULL) {
+		goto nomem;
+	}
+	p->values = (const char **)ptr;
+	if ((ptr = realloc(p->lengths, size * sizeof(int))) == NULL) {
+		goto nomem;
+	}
+	p->lengths = (int *)ptr;
+	if ((ptr = realloc(p->formats, size * sizeof(int))) == NULL) {
+		goto nomem;
+	}
+	p->formats = (int *)ptr;
+	if ((ptr = realloc(p->types, size * sizeof(Oid))) == NULL) {
+		goto nomem;
+	}
+	p->types = (Oid *)ptr;
+	if ((ptr = realloc(p->slots, size * PGSQL_PARAM_SLOT)) == NULL) {
+		goto nomem;
+	}
+	p->slots = (char *)ptr;
+	p->size = size;
+	return;
+
+nomem:
+	luaL_error(L, "not enough memory for %d parameters", n);
+}
+
+static void luaM_params_free (lua_pg_params *p) {
+	free((void *)p->values);
+	free(p->lengths);
+	free(p->formats);
+	free(p->types);
+	free(p->slots);
+	memset(p, 0, sizeof(lua_pg_params));
+}
+
+/**
+* Text of a number parameter or COPY field: integers without an exponent,
+* other numbers with the 17 digits that keep them exact.
+*/
+static int luaM_format_number (lua_Number n, char *buf) {
+	if (n > -9.2e18 && n < 9.2e18 && n == (lua_Number)(long long)n) {
+		return snprintf(buf, PGSQL_PARAM_SLOT, "%lld", (long long)n);
+	}
+	return snprintf(buf, PGSQL_PARAM_SLOT, "%.17g", n);
+}
+
+/**
+* Whether the number `n' can be sent in the binary format of `type':
+* integer types take it only when exact, the server rejecting the text
+* of the others.
+*/
+static int luaM_fits_binary (Oid type, lua_Number n) {
+	switch (type) {
+		case PGSQL_INT2OID:
+			return n >= -32768 && n <= 32767 && n == (lua_Number)(int)n;
+		case PGSQL_INT4OID:
+			return n >= -2147483648.0 && n <= 2147483647.0 && n == (lua_Number)(int)n;
+		case PGSQL_OIDOID:
+			return n >= 0 && n <= 4294967295.0 && n == (lua_Number)(long long)n;
+		case PGSQL_INT8OID:
+			return n > -9.2e18 && n < 9.2e18 && n == (lua_Number)(long long)n;
+		default:
+			return 1;
+	}
+}
+
+/**
+* Convert the parameter at the top of the stack to entry `i'. Strings
+* are sent as they are, with their length: in binary for bytea and the
+* text types, or when they hold a NUL byte and the type is unknown (it
+* then becomes bytea). Numbers and booleans use the binary encoder of
+* a known type they fit, their text otherwise.
+*/
+static void luaM_param_set (lua_State *L, lua_pg_params *p, int i) {
+	char *slot = p->slots + i * PGSQL_PARAM_SLOT;
+	lua_pg_encoder encoder = p->types[i] ? luaM_binary_encoder(p->types[i]) : NULL;
+	size_t len;
+
+	p->formats[i] = 0;
+	switch (lua_type(L, -1)) {
+		case LUA_TNONE:
+		case LUA_TNIL:
+			p->values[i] = NULL;
+			p->lengths[i] = 0;
+			return;
+		case LUA_TSTRING:
+			/* the value stays referenced by the table or the stack */
+			p->values[i] = lua_tolstring(L, -1, &len);
+			p->lengths[i] = (int)len;
+			if (encoder == luaM_encode_bytes) {
+				p->formats[i] = 1;
+			} else if (p->types[i] == InvalidOid && memchr(p->values[i], 0, len) != NULL) {
+				p->types[i] = PGSQL_BYTEAOID;
+				p->formats[i] = 1;
+				p->typed = 1;
+			}
+			return;
+		case LUA_TNUMBER:
+		case LUA_TBOOLEAN:
+			if (encoder != NULL && encoder != luaM_encode_bytes && encoder != luaM_encode_uuid
+					&& (lua_isboolean(L, -1) ? encoder == luaM_encode_bool
+						: luaM_fits_binary(p->types[i], lua_tonumber(L, -1)))) {
+				p->lengths[i] = encoder(L, -1, slot, &p->values[i]);
+				p->formats[i] = 1;
+			} else if (lua_isboolean(L, -1)) {
+				p->values[i] = lua_toboolean(L, -1) ? "t" : "f";
+				p->lengths[i] = 1;
+			} else {
+				p->lengths[i] = luaM_format_number(lua_tonumber(L, -1), slot);
+				p->values[i] = slot;
+			}
+			return;
+		case LUA_TLIGHTUSERDATA:
+			if (lua_touserdata(L, -1) == NULL) {
+				p->values[i] = NULL;
+				p->lengths[i] = 0;
+				return;
+			}
+			/* fall through */
+		default:
+			luaL_error(L, "parameter %d: cannot send a %s value", i + 1, luaL_typename(L, -1));
+	}
+}
+
+/**
+* Fill the parameter arrays of a connection from the array at `idx',
+* or the single value there (none for nil), and return their number.
+* The count is the `n' field of the array when set, so trailing nils
+* are kept. Types are those of the prepared statement `desc' when
+* known, else the `types' field of the options table at `opts' (names
+* or oids, 0 to leave one to the server).
+*/
+static int Mget_params (lua_State *L, lua_pg_conn *my_conn, int idx, int opts, const lua_pg_desc *desc) {
+	lua_pg_params *p = &my_conn->params;
+	int i, num_params;
+	lua_Number n;
+
+	if (lua_istable(L, idx)) {
+		lua_getfield(L, idx, "n");
+		n = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : (lua_Number)lua_objlen(L, idx);
+		lua_pop(L, 1);
+		if ( ! (n >= 0 && n <= PGSQL_MAX_PARAMS)) {
+			luaL_argerror(L, idx, "parameter count out of range (0 to 65535)");
+		}
+		num_params = (int)n;
+	} else {
+		num_params = lua_isnoneornil(L, idx) ? 0 : 1;
+	}
+	luaM_params_reserve(L, p, num_params);
+
+	p->typed = 0;
+	for (i = 0; i < num_params; i++) {
+		p->types[i] = InvalidOid;
+	}
+	if (desc != NULL && desc->params != NULL) {
+		for (i = 0; i < num_params && i < desc->nparams; i++) {
+			p->types[i] = desc->params[i];
+		}
+	} else if (opts && lua_istable(L, opts)) {
+		lua_getfield(L, opts, "types");
+		if (lua_istable(L, -1)) {
+			for (i = 0; i < num_params; i++) {
+				lua_rawgeti(L, -1, i + 1);
+				if ( ! lua_isnil(L, -1)) {
+					p->types[i] = luaM_check_type(L, lua_gettop(L));
+					p->typed |= p->types[i] != InvalidOid;
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	for (i = 0; i < num_params; i++) {
+		if (lua_istable(L, idx)) {
+			lua_rawgeti(L, idx, i + 1);
+		} else {
+			lua_pushvalue(L, idx);
+		}
+		luaM_param_set(L, p, i);
+		lua_pop(L, 1);
+	}
+	return num_params;
+}
+
+/**
+* Parameter types of db:prepare() from the array at `idx', put in the
+* parameter arrays of the connection. Returns their number.
+*/
+static int Mget_param_types (lua_State *L, lua_pg_conn *my_conn, int idx) {
+	int i, n;
+
+	if ( ! lua_istable(L, idx)) {
+		return 0;
+	}
+	n = lua_objlen(L, idx);
+	luaM_params_reserve(L, &my_conn->params, n);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		my_conn->params.types[i] = lua_isnil(L, -1) ? InvalidOid : luaM_check_type(L, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	return n;
+}
+
+/**
+* Latency Part
+*/
+
+/**
+* Bucket of a duration in microseconds: exact below PGSQL_HIST_SUB,
+* then PGSQL_HIST_SUB linear buckets per power of two.
+*/
+static int luaM_hist_bucket (unsigned long long us) {
+	int group = 0;
+
+	if (us < PGSQL_HIST_SUB) {
+		return (int)us;
+	}
+	while (us >= 2 * PGSQL_HIST_SUB) {
+		us >>= 1;
+		group++;
+	}
+	group = (group + 1) * PGSQL_HIST_SUB + (int)(us - PGSQL_HIST_SUB);
+	return group < PGSQL_HIST_BUCKETS ? group : PGSQL_HIST_BUCKETS - 1;
+}
+
+/* middle of a bucket, in seconds */
+static double luaM_hist_value (int bucket) {
+	int group = bucket / PGSQL_HIST_SUB - 1;
+	double low, width;
+
+	if (bucket < PGSQL_HIST_SUB) {
+		return (bucket + 0.5) / 1e6;
+	}
+	width = (double)(1ULL << group);
+	low = (PGSQL_HIST_SUB + bucket % PGSQL_HIST_SUB) * width;
+	return (low + width / 2) / 1e6;
+}
+
+/* duration under which a fraction `q' of the statements ran */
+static double luaM_hist_quantile (const lua_pg_hist *h, double q) {
+	unsigned long long seen = 0, rank = (unsigned long long)(q * h->count + 0.999999);
+	double value;
+	int i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	for (i = 0; i < PGSQL_HIST_BUCKETS; i++) {
+		if ((seen += h->buckets[i]) >= rank) {
+			break;
+		}
+	}
+	value = luaM_hist_value(i < PGSQL_HIST_BUCKETS ? i : PGSQL_HIST_BUCKETS - 1);
+	return value < h->max ? value : h->max;
+}
+
+/**
+* Normalize `sql' into `buf': literals become ?, a list of them a
+* single ?, comments and runs of spaces one space, and words lower
+* case. Returns its hash. Queries alike in their first
+* PGSQL_FINGERPRINT_LEN - 1 normalized characters share a fingerprint.
+*/
+static unsigned int luaM_fingerprint (const char *sql, char *buf) {
+	const char *s = sql;
+	size_t len = 0;
+	int c, prev = ' ';
+
+#define luaM_fp_put(ch) do { \
+		c = (ch); \
+		if (len < PGSQL_FINGERPRINT_LEN - 1) buf[len++] = (char)c; \
+		prev = c; \
+	} while (0)
+
+	while (*s) {
+		if (isspace((unsigned char)*s) || (s[0] == '-' && s[1] == '-') || (s[0] == '/' && s[1] == '*')) {
+			if (s[0] == '-') {
+				while (*s && *s != '\n') s++;
+			} else if (s[0] == '/') {
+				for (s += 2; *s && ! (s[0] == '*' && s[1] == '/'); s++);
+				s += *s ? 2 : 0;
+			} else {
+				s++;
+			}
+			if (prev != ' ') {
+				luaM_fp_put(' ');
+			}
+		} else if (*s == '\'' || (isdigit((unsigned char)*s) && ! isalnum((unsigned char)prev)
+				&& prev != '_' && prev != '$')) {
+			if (*s == '\'') {
+				for (s++; *s && ! (s[0] == '\'' && s[1] != '\''); s += s[0] == '\'' ? 2 : 1);
+				s += *s ? 1 : 0;
+			} else {
+				while (isalnum((unsigned char)*s) || *s == '.') s++;
+			}
+			/* E'...' and friends */
+			if (len > 0 && strchr("eEbBxXuU", buf[len - 1]) && (len == 1 || ! isalnum((unsigned char)buf[len - 2]))) {
+				len--;
+			}
+			/* ?, ? */
+			if (len >= 2 && buf[len - 1] == ' ' && buf[len - 2] == ',' && len >= 3 && buf[len - 3] == '?') {
+				len -= 2;
+				prev = '?';
+			} else if (len >= 2 && buf[len - 1] == ',' && buf[len - 2] == '?') {
+				len -= 1;
+				prev = '?';
+			} else {
+				luaM_fp_put('?');
+			}
+		} else if (*s == '"') {
+			do {
+				luaM_fp_put(*s++);
+			} while (*s && *s != '"');
+			if (*s) {
+				luaM_fp_put(*s++);
+			}
+		} else {
+			luaM_fp_put(tolower((unsigned char)*s));
+			s++;
+		}
+	}
+#undef luaM_fp_put
+
+	while (len > 0 && buf[len - 1] == ' ') {
+		len--;
+	}
+	buf[len] = '\0';
+	return luaM_hash(buf);
+}
+
+static void luaM_latency_free (lua_pg_latency *lt) {
+	int i;
+
+	if (lt == NULL) {
+		return;
+	}
+	for (i = 0; i < lt->used; i++) {
+		free(lt->hists[i].key);
+	}
+	free(lt->slots);
+	free(lt->hists);
+	free(lt);
+}
+
+/**
+* Histogram of `key', created if there is room left, the catch-all
+* one otherwise.
+*/
+static lua_pg_hist *luaM_latency_find (lua_pg_latency *lt, const char *key, unsigned int hash) {
+	size_t mask = lt->nslots - 1, i;
+	lua_pg_hist *h;
+
+	for (i = hash & mask; lt->slots[i] != 0; i = (i + 1) & mask) {
+		h = &lt->hists[lt->slots[i] - 1];
+		if (h->hash == hash && strcmp(h->key, key) == 0) {
+			return h;
+		}
+	}
+	if (lt->used == lt->capacity) {
+		return &lt->other;
+	}
+	h = &lt->hists[lt->used];
+	if ((h->key = strdup(key)) == NULL) {
+		return &lt->other;
+	}
+	h->hash = hash;
+	lt->slots[i] = ++lt->used;
+	return h;
+}
+
+/**
+* Account a statement run in `secs' seconds to its histogram, keyed by
+* the name of a prepared statement or the fingerprint of the query.
+*/
+static void luaM_latency_record (lua_pg_latency *lt, const lua_pg_call *call, double secs) {
+	char buf[PGSQL_FINGERPRINT_LEN];
+	lua_pg_hist *h;
+
+	if (call->kind == PGSQL_KIND_PREPARED) {
+		h = luaM_latency_find(lt, call->stmtname, luaM_hash(call->stmtname));
+	} else {
+		unsigned int hash = luaM_fingerprint(call->query, buf);
+		h = luaM_latency_find(lt, buf, hash);
+	}
+
+	h->count++;
+	h->sum += secs;
+	if (secs > h->max) {
+		h->max = secs;
+	}
+	h->buckets[luaM_hist_bucket((unsigned long long)(secs * 1e6))]++;
+}
+
+/* rows returned or affected by a statement */
+static double luaM_result_rows (PGresult *res) {
+	if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+		return PQntuples(res);
+	}
+	return strtod(PQcmdTuples(res), NULL);
+}
+
+/**
+* Call the slow query function of the connection with the query (or
+* the statement name), its number of parameters, its duration and its
+* rows. Errors of the function are ignored, the result being pending.
+* It runs in the middle of a call whose parameters, cached statement
+* and retries live in the connection, so it may not use it: methods
+* other than stats(), latency() and the trace ones raise an error.
+*/
+static void luaM_slow_query (lua_State *L, lua_pg_conn *my_conn, const lua_pg_call *call,
+		double secs, PGresult *res) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, my_conn->on_slow);
+	lua_pushstring(L, call->query ? call->query : call->stmtname);
+	lua_pushnumber(L, call->nparams);
+	lua_pushnumber(L, secs);
+	if (res != NULL) {
+		lua_pushnumber(L, luaM_result_rows(res));
+	} else {
+		lua_pushnil(L);
+	}
+	my_conn->in_hook = 1;
+	if (lua_pcall(L, 4, 0, 0) != 0) {
+		lua_pop(L, 1);
+	}
+	my_conn->in_hook = 0;
+}
+
+/**
+* Exec Part
+*/
+
+/* wait until the socket of `conn' is readable */
+static void luaM_wait_socket (PGconn *conn) {
+	luaM_poll_socket(conn, POLLIN, 0);
+}
+
+/**
+* PQgetResult, timing the waits on the socket apart from the time
+* libpq spends reading and parsing what arrived.
+*/
+static PGresult *luaM_get_result (lua_pg_conn *my_conn) {
+	PGconn *conn = my_conn->conn;
+	lua_pg_stats *st = &my_conn->stats;
+	double t0 = luaM_now(), t1;
+	PGresult *res;
+
+	while (PQisBusy(conn)) {
+		t1 = luaM_now();
+		st->parse_time += t1 - t0;
+		luaM_wait_socket(conn);
+		t0 = luaM_now();
+		st->wait_time += t0 - t1;
+		if ( ! PQconsumeInput(conn)) {
+			break;
+		}
+	}
+	res = PQgetResult(conn);
+	st->parse_time += luaM_now() - t0;
+
+	if (res != NULL) {
+		st->rows += PQntuples(res);
+		st->bytes_received += luaM_result_size(res);
+		luaM_ring_result(my_conn, res);
+	}
+	return res;
+}
+
+/**
+* Count a statement of `kind' about to be sent: its text (or name) and
+* the parameters in the arrays of the connection. `type' is the first
+* protocol message sent for it: Q for a simple query, P to parse one
+* with parameters, B to bind a prepared statement.
+*/
+static void luaM_count_sent (lua_pg_conn *my_conn, int kind, char type, const char *command, int nparams) {
+	lua_pg_stats *st = &my_conn->stats;
+	double bytes = strlen(command);
+	int i;
+
+	for (i = 0; i < nparams; i++) {
+		bytes += my_conn->params.lengths[i];
+	}
+	st->queries[kind]++;
+	st->bytes_sent += bytes;
+	luaM_ring_push(my_conn, '>', type, bytes, command, NULL);
+}
+
+/**
+* Run a statement and wait for its result as PQexec does: the last
+* result is returned, or the first COPY one. This is the path of
+* db:query(), db:query_params() and db:execute(), where statements are
+* timed into their latency histogram and reported when slow.
+*/
+static PGresult *luaM_exec (lua_State *L, lua_pg_conn *my_conn, const lua_pg_call *call) {
+	PGconn *conn = my_conn->conn;
+	lua_pg_params *p = &my_conn->params;
+	PGresult *res, *last = NULL;
+	double start = luaM_now(), elapsed;
+	int ok, copy = 0;
+
+	luaM_count_sent(my_conn, call->kind, call->stmtname ? 'B' : (call->kind == PGSQL_KIND_SIMPLE ? 'Q' : 'P'),
+			call->stmtname ? call->stmtname : call->query, call->nparams);
+	my_conn->stats.round_trips++;
+	if (call->stmtname != NULL) {
+		ok = PQsendQueryPrepared(conn, call->stmtname, call->nparams,
+				p->values, p->lengths, p->formats, call->result_format);
+	} else if (call->kind == PGSQL_KIND_SIMPLE) {
+		ok = PQsendQuery(conn, call->query);
+	} else {
+		ok = PQsendQueryParams(conn, call->query, call->nparams,
+				p->types, p->values, p->lengths, p->formats, call->result_format);
+	}
+	if ( ! ok) {
+		return NULL;
+	}
+
+	while ( ! copy && (res = luaM_get_result(my_conn)) != NULL) {
+		PQclear(last);
+		last = res;
+		switch (PQresultStatus(res)) {
+			case PGRES_COPY_IN:
+			case PGRES_COPY_OUT:
+			case PGRES_COPY_BOTH:
+				copy = 1;
+				break;
+			default:
+				break;
+		}
+		if (PQstatus(conn) == CONNECTION_BAD) {
+			break;
+		}
+	}
+
+	elapsed = luaM_now() - start;
+	if (my_conn->latency != NULL) {
+		luaM_latency_record(my_conn->latency, call, elapsed);
+	}
+	if (my_conn->on_slow != LUA_NOREF && elapsed >= my_conn->slow) {
+		luaM_slow_query(L, my_conn, call, elapsed, last);
+	}
+	return last;
+}
+
+/**
+* Retry Part
+*/
+
+/**
+* Sleep before attempt `attempt' + 1: the delay of the policy doubled
+* at each attempt up to max_delay, half of it random so that clients
+* losing their server together do not come back together.
+*/
+static void luaM_backoff (lua_pg_conn *my_conn, const lua_pg_retry *rp, int attempt) {
+	double delay = rp->delay;
+	unsigned int x = my_conn->seed;
+
+	while (--attempt > 0 && delay < rp->max_delay) {
+		delay *= 2;
+	}
+	if (delay > rp->max_delay) {
+		delay = rp->max_delay;
+	}
+	/* xorshift, leaving the rand() of the application alone */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	my_conn->seed = x;
+
+	my_conn->stats.retries++;
+	luaM_sleep(delay / 2 + delay / 2 * (x / 4294967296.0));
+}
+
+/**
+* Whether the statement that gave `res', sent with the transaction
+* status `tx', may be sent again. Never inside a transaction block,
+* whose work is gone with the error or the session. After losing the
+* connection the statement may have run, so only when idempotent or
+* the policy allows it; after an error only for the SQLSTATEs of the
+* policy (a prefix standing for its class), the statement having had
+* no effect.
+*/
+static int luaM_retryable (lua_pg_conn *my_conn, const lua_pg_retry *rp, PGresult *res,
+		PGTransactionStatusType tx, int idempotent) {
+	const char *state;
+	int i;
+
+	if (tx != PQTRANS_IDLE) {
+		return 0;
+	}
+	if (PQstatus(my_conn->conn) != CONNECTION_OK) {
+		return idempotent || ! rp->idempotent_only;
+	}
+	if (PQresultStatus(res) != PGRES_FATAL_ERROR
+			|| (state = PQresultErrorField(res, PG_DIAG_SQLSTATE)) == NULL) {
+		return 0;
+	}
+	for (i = 0; i < rp->nstates; i++) {
+		if (strncmp(state, rp->states[i], strlen(rp->states[i])) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+* After a reconnect, prepare again the statement `call' runs: from its
+* description for db:execute(), while the statement cache of
+* db:query_params() is empty anyway.
+*/
+static void luaM_reprepare (lua_pg_conn *my_conn, lua_pg_call *call, lua_pg_desc *desc) {
+	PGresult *res;
+
+	if (call->kind == PGSQL_KIND_PARAMS) {
+		call->stmtname = NULL;
+		return;
+	}
+	if (desc == NULL || desc->session == my_conn->session) {
+		return;
+	}
+	my_conn->stats.round_trips++;
+	luaM_ring_push(my_conn, '>', 'P', strlen(desc->sql), desc->name, NULL);
+	res = PQprepare(my_conn->conn, desc->name, desc->sql, desc->nparams, desc->params);
+	if (res != NULL) {
+		luaM_ring_result(my_conn, res);
+	}
+	if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+		desc->session = my_conn->session;
+	}
+	PQclear(res);
+}
+
+/* runs `call' once for luaM_run() */
+typedef PGresult *(*lua_pg_runner) (lua_State *L, lua_pg_conn *my_conn, lua_pg_call *call);
+
+/**
+* luaM_exec(), sending the query unprepared when its statement of the
+* cache is gone from the server.
+*/
+static PGresult *luaM_run_exec (lua_State *L, lua_pg_conn *my_conn, lua_pg_call *call) {
+	PGresult *res = luaM_exec(L, my_conn, call);
+
+	if (call->kind == PGSQL_KIND_PARAMS && call->stmtname != NULL && luaM_stmt_stale(my_conn, res)) {
+		PQclear(res);
+		luaM_stmt_forget(my_conn, call->stmtname);
+		call->stmtname = NULL;
+		res = luaM_exec(L, my_conn, call);
+	}
+	return res;
+}
+
+/* PQprepare of db:prepare(), the types being in the parameter arrays */
+static PGresult *luaM_run_prepare (lua_State *L, lua_pg_conn *my_conn, lua_pg_call *call) {
+	PGresult *res;
+
+	my_conn->stats.round_trips++;
+	luaM_ring_push(my_conn, '>', 'P', strlen(call->query), call->stmtname, NULL);
+	res = PQprepare(my_conn->conn, call->stmtname, call->query, call->nparams, my_conn->params.types);
+	if (res != NULL) {
+		luaM_ring_result(my_conn, res);
+	}
+	return res;
+}
+
+/**
+* Run `call' under the retry policy `rp'. A connection found broken is
+* reconnected first, which is always safe as nothing reached the
+* server, and the statement of `desc' is prepared again. Returns the
+* last result, NULL when no connection could be made.
+*/
+static PGresult *luaM_run (lua_State *L, lua_pg_conn *my_conn, lua_pg_runner run, lua_pg_call *call,
+		lua_pg_desc *desc, const lua_pg_retry *rp, int idempotent) {
+	PGTransactionStatusType tx;
+	PGresult *res = NULL;
+	int attempt;
+
+	for (attempt = 1; ; attempt++) {
+		if (PQstatus(my_conn->conn) != CONNECTION_OK) {
+			if ( ! luaM_reset(my_conn, rp->timeout)) {
+				if (attempt >= rp->attempts) {
+					return res;
+				}
+				luaM_backoff(my_conn, rp, attempt);
+				continue;
+			}
+			luaM_reprepare(my_conn, call, desc);
+		}
+		PQclear(res);
+		tx = PQtransactionStatus(my_conn->conn);
+		res = run(L, my_conn, call);
+		if (attempt >= rp->attempts || ! luaM_retryable(my_conn, rp, res, tx, idempotent)) {
+			return res;
+		}
+		luaM_backoff(my_conn, rp, attempt);
+	}
+}
+
+static double luaM_optfield (lua_State *L, int idx, const char *name, double def) {
+	double value;
+
+	lua_getfield(L, idx, name);
+	value = lua_isnil(L, -1) ? def : luaL_checknumber(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+/**
+* Override `rp' with the policy at `idx': false for no retry, or a
+* table of attempts, delay, max_delay, timeout, idempotent_only and
+* sqlstates.
+*/
+static void Mget_retry (lua_State *L, int idx, lua_pg_retry *rp) {
+	const char *state;
+	size_t len;
+	int i, n;
+
+	if (lua_isnoneornil(L, idx)) {
+		return;
+	}
+	if (lua_isboolean(L, idx) && ! lua_toboolean(L, idx)) {
+		rp->attempts = 1;
+		return;
+	}
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	rp->attempts = (int)luaM_optfield(L, idx, "attempts", rp->attempts);
+	rp->delay = luaM_optfield(L, idx, "delay", rp->delay);
+	rp->max_delay = luaM_optfield(L, idx, "max_delay", rp->max_delay);
+	rp->timeout = luaM_optfield(L, idx, "timeout", rp->timeout);
+	if (rp->attempts < 1) {
+		rp->attempts = 1;
+	}
+	lua_getfield(L, idx, "idempotent_only");
+	if ( ! lua_isnil(L, -1)) {
+		rp->idempotent_only = lua_toboolean(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "sqlstates");
+	if (lua_istable(L, -1)) {
+		n = (int)lua_objlen(L, -1);
+		if (n > PGSQL_RETRY_STATES) {
+			luaL_error(L, "at most %d sqlstates to retry on", PGSQL_RETRY_STATES);
+		}
+		for (i = 0; i < n; i++) {
+			lua_rawgeti(L, -1, i + 1);
+			state = lua_tolstring(L, -1, &len);
+			if (state == NULL || len == 0 || len > 5) {
+				luaL_error(L, "sqlstate %d: a SQLSTATE or its class expected", i + 1);
+			}
+			strcpy(rp->states[i], state);
+			lua_pop(L, 1);
+		}
+		rp->nstates = n;
+	}
+	lua_pop(L, 1);
+}
+
+/**
+* Policy of a call: the one of the connection, overridden by the
+* `retry' field of the options table at `opts'. Whether the statement
+* is idempotent is guessed from `sql' (NULL when unknown) unless the
+* `idempotent' field says.
+*/
+static int Mget_call_retry (lua_State *L, lua_pg_conn *my_conn, int opts, const char *sql, lua_pg_retry *rp) {
+	int idempotent = sql != NULL && luaM_idempotent(sql);
+
+	*rp = my_conn->retry;
+	if (opts && lua_istable(L, opts)) {
+		lua_getfield(L, opts, "retry");
+		Mget_retry(L, lua_gettop(L), rp);
+		lua_pop(L, 1);
+		lua_getfield(L, opts, "idempotent");
+		if ( ! lua_isnil(L, -1)) {
+			idempotent = lua_toboolean(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	return idempotent;
+}
+
+static int Lpg_set_result_format (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	const char *format = luaL_checkstring(L, 2);
+
+	if (strcmp(format, "binary") == 0) {
+		my_conn->result_format = 1;
+	} else if (strcmp(format, "text") == 0) {
+		my_conn->result_format = 0;
+	} else {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, "Invalid result format '%s'", format);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+* Enable the prepared statement cache of db:query_params() for up to
+* `size' statements, or disable it with 0.
+*/
+static int Lpg_set_statement_cache (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	int size = (int)luaL_checknumber(L, 2);
+	lua_pg_stmt_cache *sc;
+	size_t nbuckets = 16;
+
+	luaM_stmt_free(my_conn, 1);
+	if (size <= 0) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	while (nbuckets < (size_t)size * 2) {
+		nbuckets <<= 1;
+	}
+	if ((sc = (lua_pg_stmt_cache *)calloc(1, sizeof(lua_pg_stmt_cache))) == NULL
+			|| (sc->buckets = (lua_pg_stmt **)calloc(nbuckets, sizeof(lua_pg_stmt *))) == NULL) {
+		free(sc);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Cannot allocate the statement cache");
+		return 2;
+	}
+	sc->nbuckets = nbuckets;
+	sc->capacity = size;
+	my_conn->stmts = sc;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int Lpg_statement_cache_stats (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	lua_pg_stmt_cache *sc = my_conn->stmts;
+
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, sc ? sc->hits : 0);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, sc ? sc->misses : 0);
+	lua_setfield(L, -2, "misses");
+	lua_pushnumber(L, sc ? sc->used : 0);
+	lua_setfield(L, -2, "size");
+	lua_pushnumber(L, sc ? sc->capacity : 0);
+	lua_setfield(L, -2, "capacity");
+	return 1;
+}
+
+/**
+* Counters of the connection since it was opened or db:reset_stats():
+* statements by kind, round trips, bytes, rows, reconnects, and the
+* time spent waiting on the network, in libpq and building lua rows.
+*/
+static int Lpg_stats (lua_State *L) {
+    lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 1, LUA_PGSQL_CONN);
+	lua_pg_stats *st = &my_conn->stats;
+	static const char *const kinds[PGSQL_KINDS] = { "simple", "params", "prepared", "pipeline" };
+	long total = 0;
+	int i;
+
+	lua_createtable(L, 0, 12);
+
+	lua_createtable(L, 0, PGSQL_KINDS);
+	for (i = 0; i < PGSQL_KINDS; i++) {
+		lua_pushnumber(L, st->queries[i]);
+		lua_setfield(L, -2, kinds[i]);
+		total += st->queries[i];
+	}
+	lua_setfield(L, -2, "queries");
+	lua_pushnumber(L, total);
+	lua_setfield(L, -2, "total");
+
+	lua_pushnumber(L, st->round_trips);
+	lua_setfield(L, -2, "round_trips");
+	lua_pushnumber(L, st->bytes_sent);
+	lua_setfield(L, -2, "bytes_sent");
+	lua_pushnumber(L, st->bytes_received);
+	lua_setfield(L, -2, "bytes_received");
+	lua_pushnumber(L, st->rows);
+	lua_setfield(L, -2, "rows");
+	lua_pushnumber(L, st->reconnects);
+	lua_setfield(L, -2, "reconnects");
+	lua_pushnumber(L, st->retries);
+	lua_setfield(L, -2, "retries");
+	lua_pushnumber(L, st->wait_time);
+	lua_setfield(L, -2, "wait_time");
+	lua_pushnumber(L, st->parse_time);
+	lua_setfield(L, -2, "parse_time");
+	lua_pushnumber(L, st->convert_time);
+	lua_setfield(L, -2, "convert_time");
+	lua_pushnumber(L, luaM_now() - st->since);
+	lua_setfield(L, -2, "elapsed");
+	return 1;
+}
+
+static int Lpg_reset_stats (lua_State *L) {
+    lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 1, LUA_PGSQL_CONN);
+
+	lua_pg_latency *lt = my_conn->latency;
+	int i;
+
+	memset(&my_conn->stats, 0, sizeof(lua_pg_stats));
+	my_conn->stats.since = luaM_now();
+	if (lt != NULL) {
+		/* the statements keep their histogram */
+		for (i = 0; i < lt->used; i++) {
+			memset(&lt->hists[i].count, 0, sizeof(lua_pg_hist) - offsetof(lua_pg_hist, count));
+		}
+		memset(&lt->other, 0, sizeof(lua_pg_hist));
+	}
+	return 0;
+}
+
+/**
+* Keep latency histograms of up to `size' statements, 0 to stop. Later
+* statements share one histogram, reported as "(other)".
+*/
+static int Lpg_set_latency_tracking (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	int size = (int)luaL_checknumber(L, 2);
+	lua_pg_latency *lt;
+	size_t nslots = 16;
+
+	luaM_latency_free(my_conn->latency);
+	my_conn->latency = NULL;
+	if (size <= 0) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	while (nslots < (size_t)size * 2) {
+		nslots <<= 1;
+	}
+	if ((lt = (lua_pg_latency *)calloc(1, sizeof(lua_pg_latency))) == NULL
+			|| (lt->slots = (int *)calloc(nslots, sizeof(int))) == NULL
+			|| (lt->hists = (lua_pg_hist *)calloc(size, sizeof(lua_pg_hist))) == NULL) {
+		luaM_latency_free(lt);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Cannot allocate the latency histograms");
+		return 2;
+	}
+	lt->nslots = nslots;
+	lt->capacity = size;
+	my_conn->latency = lt;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static void luaM_push_hist (lua_State *L, const lua_pg_hist *h) {
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, h->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, h->count ? h->sum / h->count : 0);
+	lua_setfield(L, -2, "mean");
+	lua_pushnumber(L, h->max);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, luaM_hist_quantile(h, 0.5));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, luaM_hist_quantile(h, 0.99));
+	lua_setfield(L, -2, "p99");
+	lua_pushnumber(L, luaM_hist_quantile(h, 0.999));
+	lua_setfield(L, -2, "p999");
+}
+
+/**
+* Latencies in seconds of the statements seen since tracking started,
+* by statement name or query fingerprint. Nil when not tracking.
+*/
+static int Lpg_latency (lua_State *L) {
+    lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 1, LUA_PGSQL_CONN);
+	lua_pg_latency *lt = my_conn->latency;
+	int i;
+
+	if (lt == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_createtable(L, 0, lt->used + 1);
+	for (i = 0; i < lt->used; i++) {
+		luaM_push_hist(L, &lt->hists[i]);
+		lua_setfield(L, -2, lt->hists[i].key);
+	}
+	if (lt->other.count > 0) {
+		luaM_push_hist(L, &lt->other);
+		lua_setfield(L, -2, "(other)");
+	}
+	return 1;
+}
+
+/**
+* Call `func' with the query, its number of parameters, its duration
+* and its rows after every statement lasting `threshold' seconds or
+* more. No function removes it.
+*/
+static int Lpg_set_slow_query (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	double threshold = luaL_checknumber(L, 2);
+
+	luaL_unref(L, LUA_REGISTRYINDEX, my_conn->on_slow);
+	my_conn->on_slow = LUA_NOREF;
+	if ( ! lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+		lua_pushvalue(L, 3);
+		my_conn->on_slow = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	my_conn->slow = threshold;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+* Keep the last `size' protocol exchanges of the connection, 0 to stop.
+* Recorded events are dropped.
+*/
+static int Lpg_set_trace_buffer (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	int size = (int)luaL_checknumber(L, 2);
+
+	free(my_conn->ring);
+	my_conn->ring = NULL;
+	my_conn->ring_size = size > 0 ? size : 0;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* event `i' of a ring, 0 being the oldest still kept */
+static const lua_pg_event *luaM_ring_event (const lua_pg_ring *r, unsigned long i) {
+	unsigned long first = r->count > (unsigned long)r->size ? r->count - r->size : 0;
+
+	return &r->events[(first + i) % r->size];
+}
+
+static unsigned long luaM_ring_used (const lua_pg_ring *r) {
+	return r->count < (unsigned long)r->size ? r->count : (unsigned long)r->size;
+}
+
+/**
+* The exchanges kept by the trace ring, oldest first: tables with the
+* time and age in seconds, the direction (">" sent, "<" received), the
+* message type, the length, the statement and the SQLSTATE of errors.
+*/
+static int Lpg_trace_events (lua_State *L) {
+    lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 1, LUA_PGSQL_CONN);
+	lua_pg_ring *r = my_conn->ring;
+	unsigned long i, used = r ? luaM_ring_used(r) : 0;
+	double now = luaM_now();
+	const lua_pg_event *e;
+
+	lua_createtable(L, (int)used, 0);
+	for (i = 0; i < used; i++) {
+		e = luaM_ring_event(r, i);
+		lua_createtable(L, 0, 7);
+		lua_pushnumber(L, e->time);
+		lua_setfield(L, -2, "time");
+		lua_pushnumber(L, now - e->time);
+		lua_setfield(L, -2, "age");
+		lua_pushlstring(L, &e->dir, 1);
+		lua_setfield(L, -2, "dir");
+		lua_pushlstring(L, &e->type, 1);
+		lua_setfield(L, -2, "type");
+		lua_pushnumber(L, e->length);
+		lua_setfield(L, -2, "length");
+		lua_pushstring(L, e->name);
+		lua_setfield(L, -2, "name");
+		if (e->state[0] != '\0') {
+			lua_pushstring(L, e->state);
+			lua_setfield(L, -2, "sqlstate");
+		}
+		lua_rawseti(L, -2, (int)i + 1);
+	}
+	return 1;
+}
+
+/**
+* The trace ring as text, one exchange per line, for error reports.
+*/
+static int Lpg_trace_dump (lua_State *L) {
+    lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 1, LUA_PGSQL_CONN);
+	lua_pg_ring *r = my_conn->ring;
+	unsigned long i, used = r ? luaM_ring_used(r) : 0;
+	double now = luaM_now();
+	const lua_pg_event *e;
+	char line[PGSQL_TRACE_NAME_LEN + 64];
+	luaL_Buffer b;
+
+	luaL_buffinit(L, &b);
+	for (i = 0; i < used; i++) {
+		e = luaM_ring_event(r, i);
+		snprintf(line, sizeof(line), "-%.6f %c %c %8.0f %s%s%s\n", now - e->time, e->dir, e->type,
+				e->length, e->state, e->state[0] ? " " : "", e->name);
+		luaL_addstring(&b, line);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/**
+* Set the retry policy of the connection: a table as for the `retry'
+* option of a call, whose missing fields take their default, or false
+* for no retry. Without it, back to the defaults.
+*/
+static int Lpg_set_retry (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	lua_pg_retry rp;
+
+	luaM_retry_defaults(&rp);
+	Mget_retry(L, 2, &rp);
+	my_conn->retry = rp;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int Lpg_set_decode (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	my_conn->decode = lua_toboolean(L, 2);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int Lpg_query (lua_State *L) {
+	int leftover = 0;
+	ExecStatusType status;
+	PGresult *res;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *statement = luaL_checkstring (L, 2);
+	lua_pg_call call = { PGSQL_KIND_SIMPLE, NULL, NULL, 0, 0 };
+	lua_pg_retry rp;
+	int idempotent = Mget_call_retry(L, my_conn, 3, statement, &rp);
+
+	call.query = statement;
+
+	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushstring(L, "Cannot set connection to blocking mode");
+		return 1;
+	}
+
+    leftover = luaM_drain(my_conn->conn, NULL) > 0;
+
+    if (leftover) {
+        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+		return 1;
+    }
+	
+	luaM_track_session(my_conn, statement);
+	res = luaM_run(L, my_conn, luaM_run_exec, &call, NULL, &rp, idempotent);
+
+    if (res) {
+        status = PQresultStatus(res);
+    } else {
+        status = (ExecStatusType) PQstatus(my_conn->conn);
+    }
+
+    switch (status) {
+        case PGRES_EMPTY_QUERY:
+        case PGRES_BAD_RESPONSE:
+        case PGRES_NONFATAL_ERROR:
+        case PGRES_FATAL_ERROR:
+			lua_pushboolean(L, 0);
+			luaM_msg(L, 0, PQerrorMessage(my_conn->conn));
+            PQclear(res);
+            return 2;
+            break;
+        case PGRES_COMMAND_OK: /* successful command that did not return rows */
+        default:
+            if (res) {
+				Mnew_res (L, my_conn, res);
+
+				return 1;
+            } else {
+                PQclear(res);
+				lua_pushboolean (L, 0);
+				return 1;
+            }
+            break;
+    }
+}
+
+/**
+* Switch to nonblocking mode to send an asynchronous query, making sure
+* no earlier result is pending. On failure FALSE and the message are
+* pushed, the blocking mode is left as it was, and 0 returned.
+*/
+static int luaM_send_begin (lua_State *L, lua_pg_conn *my_conn) {
+	int leftover = 0;
+
+	if (PQsetnonblocking(my_conn->conn, 1)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Cannot set connection to nonblocking mode");
+		return 0;
+	}
+
+	/* a busy connection would block PQgetResult */
+	if (my_conn->nonblocking) {
+		PQconsumeInput(my_conn->conn);
+		leftover = PQisBusy(my_conn->conn);
+	}
+	if ( ! leftover) {
+		leftover = luaM_drain(my_conn->conn, NULL) > 0;
+	}
+
+    if (leftover) {
+		if ( ! my_conn->nonblocking) {
+			PQsetnonblocking(my_conn->conn, 0);
+		}
+		lua_pushboolean(L, 0);
+        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+		return 0;
+    }
+	return 1;
+}
+
+/**
+* Finish an asynchronous send. With db:set_nonblocking(true) the query
+* may still be partly buffered: push TRUE and whether db:flush() has to
+* be called. Otherwise block until it is sent and push TRUE.
+*/
+static int luaM_send_end (lua_State *L, lua_pg_conn *my_conn) {
+	int pending;
+
+	my_conn->stats.round_trips++;
+	if (my_conn->nonblocking) {
+		if ((pending = PQflush(my_conn->conn)) < 0) {
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, PQerrorMessage(my_conn->conn));
+			return 2;
+		}
+		lua_pushboolean(L, 1);
+		lua_pushboolean(L, pending);
+		return 2;
+	}
+
+	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Cannot set connection to blocking mode");
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int luaM_send_failed (lua_State *L, lua_pg_conn *my_conn) {
+	lua_pushboolean(L, 0);
+	lua_pushstring(L, PQerrorMessage(my_conn->conn));
+	if ( ! my_conn->nonblocking) {
+		PQsetnonblocking(my_conn->conn, 0);
+	}
+	return 2;
+}
+
+static int Lpg_send_query (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *statement = luaL_checkstring (L, 2);
+
+	if ( ! luaM_send_begin(L, my_conn)) {
+		return 2;
+	}
+
+    luaM_track_session(my_conn, statement);
+	luaM_count_sent(my_conn, PGSQL_KIND_SIMPLE, 'Q', statement, 0);
+    if ( ! PQsendQuery(my_conn->conn, statement)) {
+        if (PQstatus(my_conn->conn) != CONNECTION_OK) {
+            luaM_reset(my_conn, my_conn->retry.timeout);
+        }
+        if ( ! PQsendQuery(my_conn->conn, statement)) {
+			return luaM_send_failed(L, my_conn);
+        }
+    }
+
+	return luaM_send_end(L, my_conn);
+}
+
+static int Lpg_send_prepare (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *stmtname = luaL_checkstring (L, 2);
+	const char *query = luaL_checkstring (L, 3);
+	int num_types = Mget_param_types(L, my_conn, 4);
+	Oid *types = my_conn->params.types;
+
+	if ( ! luaM_send_begin(L, my_conn)) {
+		return 2;
+	}
+
+    luaM_track_session(my_conn, NULL);
+	luaM_ring_push(my_conn, '>', 'P', strlen(query), stmtname, NULL);
+    if ( ! PQsendPrepare(my_conn->conn, stmtname, query, num_types, types)) {
+        if (PQstatus(my_conn->conn) != CONNECTION_OK) {
+            luaM_reset(my_conn, my_conn->retry.timeout);
+        }
+		if ( ! PQsendPrepare(my_conn->conn, stmtname, query, num_types, types)) {
+			return luaM_send_failed(L, my_conn);
+        }
+    }
+	/* described by the first db:execute() */
+	luaM_desc_add(L, my_conn, stmtname, query, num_types, types);
+
+	return luaM_send_end(L, my_conn);
+}
+
+static int Lpg_send_execute (lua_State *L) {
+	int num_params;
+	lua_pg_params *p;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *stmtname = luaL_checkstring (L, 2);
+	int result_format = Mget_result_format(L, my_conn, 4);
+
+	/* parameter types are known once described or given to prepare */
+	num_params = Mget_params(L, my_conn, 3, 4, luaM_desc_find(my_conn, stmtname));
+	p = &my_conn->params;
+
+	if ( ! luaM_send_begin(L, my_conn)) {
+		return 2;
+	}
+
+	luaM_count_sent(my_conn, PGSQL_KIND_PREPARED, 'B', stmtname, num_params);
+    if ( ! PQsendQueryPrepared(my_conn->conn, stmtname, num_params,
+					p->values, p->lengths, p->formats, result_format)) {
+        if (PQstatus(my_conn->conn) != CONNECTION_OK) {
+			luaM_reset(my_conn, my_conn->retry.timeout);
+        }
+		if ( ! PQsendQueryPrepared(my_conn->conn, stmtname, num_params,
+						p->values, p->lengths, p->formats, result_format)) {
+			return luaM_send_failed(L, my_conn);
+        }
+    }
+
+	return luaM_send_end(L, my_conn);
+}
+
+static int Lpg_send_query_params (lua_State *L) {
+	int num_params;
+	lua_pg_params *p;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *query = luaL_checkstring (L, 2);
+	int result_format = Mget_result_format(L, my_conn, 4);
+
+	num_params = Mget_params(L, my_conn, 3, 4, NULL);
+	p = &my_conn->params;
+
+	if ( ! luaM_send_begin(L, my_conn)) {
+		return 2;
+	}
+
+    luaM_track_session(my_conn, query);
+	luaM_count_sent(my_conn, PGSQL_KIND_PARAMS, 'P', query, num_params);
+    if ( ! PQsendQueryParams(my_conn->conn, query, num_params,
+					 p->types, p->values, p->lengths, p->formats, result_format)) {
+		if (PQstatus(my_conn->conn) != CONNECTION_OK) {
+			luaM_reset(my_conn, my_conn->retry.timeout);
+        }
+		if ( ! PQsendQueryParams(my_conn->conn, query, num_params,
+						 p->types, p->values, p->lengths, p->formats, result_format)) {
+			return luaM_send_failed(L, my_conn);
+        }
+    }
+
+	return luaM_send_end(L, my_conn);
+}
+
+static int Lpg_put_line (lua_State *L) {
+    int result = 0;
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+	const char *statement = luaL_checkstring (L, 2);
+
+
+    result = PQputline(my_conn->conn, statement);
+    if (result == EOF) {
+        lua_pushfstring(L, "Query failed: %s", PQerrorMessage(my_conn->conn));
+		return 1;
+    }
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int Lpg_end_copy (lua_State *L) {
+	int result = 0;
+
+    lua_pg_conn *my_conn = Mget_conn (L);
+
+    result = PQendcopy(my_conn->conn);
+
+    if (result != 0) {
         lua_pushfstring(L, "Query failed: %s", PQerrorMessage(my_conn->conn));
 		return 1;
     }
+	
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+* COPY Part
+*/
+
+static void luaM_copy_flush (lua_pg_copy *cp) {
+	if (cp->len > 0 && ! cp->failed) {
+		if (PQputCopyData(cp->conn, cp->buf, cp->len) != 1) {
+			cp->failed = 1;
+		}
+	}
+	cp->len = 0;
+}
+
+static void luaM_copy_put (lua_pg_copy *cp, const char *data, size_t len) {
+	size_t n;
+
+	while (len > 0) {
+		if (cp->len == cp->size) {
+			luaM_copy_flush(cp);
+		}
+		n = cp->size - cp->len;
+		n = len < n ? len : n;
+		memcpy(cp->buf + cp->len, data, n);
+		cp->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+#define luaM_copy_putc(cp, c) do { \
+	if ((cp)->len == (cp)->size) luaM_copy_flush(cp); \
+	(cp)->buf[(cp)->len++] = (c); \
+} while (0)
+
+/**
+* Append a string in COPY text format: backslash, tab, newline and
+* carriage return are escaped, runs of other bytes are copied at once.
+*/
+static void luaM_copy_put_escaped (lua_pg_copy *cp, const char *s, size_t len) {
+	size_t i, start = 0;
+	char esc;
+
+	for (i = 0; i < len; i++) {
+		switch (s[i]) {
+			case '\\': esc = '\\'; break;
+			case '\t': esc = 't'; break;
+			case '\n': esc = 'n'; break;
+			case '\r': esc = 'r'; break;
+			default: continue;
+		}
+		luaM_copy_put(cp, s + start, i - start);
+		luaM_copy_putc(cp, '\\');
+		luaM_copy_putc(cp, esc);
+		start = i + 1;
+	}
+	luaM_copy_put(cp, s + start, len - start);
+}
+
+/**
+* Append the row table at `idx' as one line of COPY text.
+*/
+static void luaM_copy_text_row (lua_State *L, lua_pg_copy *cp, int idx) {
+	int i, num_fields = cp->columns;
+	const char *value;
+	char number[PGSQL_PARAM_SLOT];
+	size_t len;
+
+	if (num_fields <= 0) {
+		lua_getfield(L, idx, "n");
+		num_fields = lua_isnumber(L, -1) ? (int)lua_tonumber(L, -1) : (int)lua_objlen(L, idx);
+		lua_pop(L, 1);
+	}
+
+	for (i = 1; i <= num_fields; i++) {
+		if (i > 1) {
+			luaM_copy_putc(cp, '\t');
+		}
+		lua_rawgeti(L, idx, i);
+		switch (lua_type(L, -1)) {
+			case LUA_TNIL:
+				luaM_copy_put(cp, "\\N", 2);
+				break;
+			case LUA_TBOOLEAN:
+				luaM_copy_putc(cp, lua_toboolean(L, -1) ? 't' : 'f');
+				break;
+			case LUA_TNUMBER:
+				/* lua_tostring() would give 1.1258999068426e+15 */
+				luaM_copy_put(cp, number, luaM_format_number(lua_tonumber(L, -1), number));
+				break;
+			case LUA_TSTRING:
+				value = lua_tolstring(L, -1, &len);
+				luaM_copy_put_escaped(cp, value, len);
+				break;
+			default:
+				if (luaM_isnull(L, -1)) {
+					luaM_copy_put(cp, "\\N", 2);
+					break;
+				}
+				luaL_error(L, "row %d column %d: can not copy a %s", (int)cp->rows + 1, i, luaL_typename(L, -1));
+		}
+		lua_pop(L, 1);
+	}
+	luaM_copy_putc(cp, '\n');
+}
+
+/**
+* Append the row table at `idx' as one PGCOPY binary tuple: the field
+* count, then each value prefixed by its big-endian length.
+*/
+static void luaM_copy_binary_row (lua_State *L, lua_pg_copy *cp, int idx) {
+	int i, len;
+	char buf[16];
+	const char *data;
+
+	buf[0] = (char)(cp->columns >> 8);
+	buf[1] = (char)cp->columns;
+	luaM_copy_put(cp, buf, 2);
+
+	for (i = 0; i < cp->columns; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		if (luaM_isnull(L, -1)) {
+			luaM_copy_put(cp, "\377\377\377\377", 4);
+		} else {
+			len = cp->encoders[i](L, lua_gettop(L), buf + 4, &data);
+			luaM_put_uint32(buf, (unsigned int)len);
+			luaM_copy_put(cp, buf, 4);
+			luaM_copy_put(cp, data, len);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+static void luaM_copy_row (lua_State *L, lua_pg_copy *cp, int idx) {
+	luaL_checktype(L, idx, LUA_TTABLE);
+	if (cp->encoders != NULL) {
+		luaM_copy_binary_row(L, cp, idx);
+	} else {
+		luaM_copy_text_row(L, cp, idx);
+	}
+	cp->rows++;
+}
+
+/**
+* Encode every row of the table or iterator at index 1, run in
+* protected mode so an error can abort the COPY.
+*/
+static int Lpg_do_copy_rows (lua_State *L) {
+	lua_pg_copy *cp = (lua_pg_copy *)lua_touserdata(L, 2);
+	int i, num_rows;
+
+	/* PGCOPY signature, flags and header extension length */
+	if (cp->encoders != NULL) {
+		luaM_copy_put(cp, "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 19);
+	}
+
+	if (lua_istable(L, 1)) {
+		num_rows = lua_objlen(L, 1);
+		for (i = 1; i <= num_rows && ! cp->failed; i++) {
+			lua_rawgeti(L, 1, i);
+			luaM_copy_row(L, cp, 3);
+			lua_pop(L, 1);
+		}
+	} else {
+		while ( ! cp->failed) {
+			lua_pushvalue(L, 1);
+			lua_call(L, 0, 1);
+			if ( ! lua_toboolean(L, 3)) {
+				break;
+			}
+			luaM_copy_row(L, cp, 3);
+			lua_pop(L, 1);
+		}
+	}
+
+	if (cp->encoders != NULL) {
+		luaM_copy_put(cp, "\377\377", 2);
+	}
+	luaM_copy_flush(cp);
+
+	return 0;
+}
+
+/**
+* Run a COPY ... FROM STDIN and feed it the rows of a table or of an
+* iterator, encoded in C and sent in chunks of options.chunk_size bytes.
+*/
+static int Lpg_copy_in (lua_State *L) {
+	int leftover = 0;
+	lua_pg_copy cp;
+	PGresult *res;
+	const char *errmsg = NULL;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *query = luaL_checkstring (L, 2);
+
+	if ( ! lua_istable(L, 3) && ! lua_isfunction(L, 3)) {
+		luaL_typerror(L, 3, "table or function");
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	cp.conn = my_conn->conn;
+	cp.size = PGSQL_COPY_BUF_SIZE;
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, "chunk_size");
+		if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 1) {
+			cp.size = (size_t)lua_tonumber(L, -1);
+		}
+		lua_getfield(L, 4, "columns");
+		cp.columns = (int)lua_tonumber(L, -1);
+		lua_pop(L, 2);
+
+		/* a type list selects the binary format */
+		lua_getfield(L, 4, "types");
+		if (lua_istable(L, -1)) {
+			int i, types = lua_gettop(L);
+
+			cp.columns = lua_objlen(L, types);
+			cp.encoders = (lua_pg_encoder *)lua_newuserdata(L, (cp.columns + 1) * sizeof(lua_pg_encoder));
+			for (i = 0; i < cp.columns; i++) {
+				lua_rawgeti(L, types, i + 1);
+				if ((cp.encoders[i] = luaM_binary_encoder(luaM_check_type(L, -1))) == NULL) {
+					lua_pushboolean(L, 0);
+					lua_pushfstring(L, "Column %d: type '%s' has no binary encoder", i + 1, lua_tostring(L, -2));
+					return 2;
+				}
+				lua_pop(L, 1);
+			}
+		}
+	}
+	cp.buf = (char *)lua_newuserdata(L, cp.size);
+
+	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Cannot set connection to blocking mode");
+		return 2;
+	}
+
+    leftover = luaM_drain(my_conn->conn, NULL) > 0;
+
+    if (leftover) {
+		lua_pushboolean(L, 0);
+        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+		return 2;
+    }
+
+	res = PQexec(my_conn->conn, query);
+	if (PQresultStatus(res) != PGRES_COPY_IN) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, res ? PQresultErrorMessage(res) : PQerrorMessage(my_conn->conn));
+		PQclear(res);
+		luaM_drain(my_conn->conn, NULL);
+		return 2;
+	}
+	if (PQbinaryTuples(res) != (cp.encoders != NULL)) {
+		PQclear(res);
+		PQputCopyEnd(my_conn->conn, "format mismatch");
+		luaM_drain(my_conn->conn, NULL);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, cp.encoders != NULL
+				? "options.types needs a COPY ... FROM STDIN (FORMAT binary)"
+				: "a binary COPY needs options.types");
+		return 2;
+	}
+	PQclear(res);
+
+	lua_pushcfunction(L, Lpg_do_copy_rows);
+	lua_pushvalue(L, 3);
+	lua_pushlightuserdata(L, &cp);
+	if (lua_pcall(L, 2, 0, 0) != 0) {
+		errmsg = lua_tostring(L, -1);
+	}
+
+	/* an aborted copy leaves the lua error message on the stack */
+	if (PQputCopyEnd(my_conn->conn, errmsg) != 1 && errmsg == NULL) {
+		errmsg = PQerrorMessage(my_conn->conn);
+	}
+
+	res = NULL;
+	luaM_drain(my_conn->conn, &res);
+	if (res != NULL && errmsg == NULL) {
+		lua_pushstring(L, PQresultErrorMessage(res));
+		errmsg = lua_tostring(L, -1);
+	}
+	PQclear(res);
+
+	if (errmsg == NULL && cp.failed) {
+		errmsg = PQerrorMessage(my_conn->conn);
+	}
+
+	if (errmsg != NULL) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, errmsg);
+		return 2;
+	}
+
+	lua_pushnumber(L, cp.rows);
+	return 1;
+}
+
+/**
+* Describe a query without running it: the names and type oids of its
+* result columns and the type oids of its parameters, e.g. to get the
+* types of a binary db:copy_in() from "select ... from t limit 0".
+*/
+static int Lpg_describe (lua_State *L) {
+	PGresult *res;
+	int i, n;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *query = luaL_checkstring (L, 2);
+
+	res = PQprepare(my_conn->conn, "", query, 0, NULL);
+	if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+		PQclear(res);
+		res = PQdescribePrepared(my_conn->conn, "");
+	}
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, res ? PQresultErrorMessage(res) : PQerrorMessage(my_conn->conn));
+		PQclear(res);
+		return 2;
+	}
+
+	lua_createtable(L, 0, 3);
+
+	n = PQnfields(res);
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_pushstring(L, PQfname(res, i));
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "names");
+
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_pushnumber(L, PQftype(res, i));
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "types");
+
+	n = PQnparams(res);
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_pushnumber(L, PQparamtype(res, i));
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "params");
+
+	PQclear(res);
+	return 1;
+}
+
+/**
+* Push a line of COPY text as an array of strings, NULL being
+* pgsql.null. The line is unescaped in place.
+*/
+static void luaM_push_copy_row (lua_State *L, char *line, int len) {
+	char *src, *dst, *field, *end = line + len;
+	int n = 0;
+
+	if (len > 0 && end[-1] == '\n') {
+		end--;
+	}
+
+	lua_newtable(L);
+	for (src = line; src <= end; src++) {
+		field = dst = src;
+		while (src < end && *src != '\t') {
+			if (*src != '\\' || src + 1 >= end) {
+				*dst++ = *src++;
+				continue;
+			}
+			src++;
+			switch (*src) {
+				case 'b': *dst++ = '\b'; src++; break;
+				case 'f': *dst++ = '\f'; src++; break;
+				case 'n': *dst++ = '\n'; src++; break;
+				case 'r': *dst++ = '\r'; src++; break;
+				case 't': *dst++ = '\t'; src++; break;
+				case 'v': *dst++ = '\v'; src++; break;
+				case 'N':
+					/* only a whole field can be \N */
+					*dst++ = 'N';
+					src++;
+					if (src - field == 2 && (src == end || *src == '\t')) {
+						dst = NULL;
+					}
+					break;
+				case 'x':
+					if (src + 1 < end && isxdigit((unsigned char)src[1])) {
+						int c = 0, i;
+						for (i = 0, src++; i < 2 && src < end && isxdigit((unsigned char)*src); i++, src++) {
+							c = c * 16 + (isdigit((unsigned char)*src) ? *src - '0' : (tolower((unsigned char)*src) - 'a' + 10));
+						}
+						*dst++ = (char)c;
+					} else {
+						*dst++ = *src++;
+					}
+					break;
+				default:
+					if (*src >= '0' && *src <= '7') {
+						int c = 0, i;
+						for (i = 0; i < 3 && src < end && *src >= '0' && *src <= '7'; i++, src++) {
+							c = c * 8 + (*src - '0');
+						}
+						*dst++ = (char)c;
+					} else {
+						*dst++ = *src++;
+					}
+			}
+			if (dst == NULL) {
+				break;
+			}
+		}
+		if (dst == NULL) {
+			lua_pushlightuserdata(L, NULL);
+		} else {
+			lua_pushlstring(L, field, dst - field);
+		}
+		lua_rawseti(L, -2, ++n);
+	}
+}
+
+/**
+* Read one COPY OUT line: pushes it (raw or parsed) and returns 1,
+* returns 0 when no data is ready yet (async) and -1 at the end, after
+* collecting the final result. Errors leave their message pushed and
+* return -2.
+*/
+static int luaM_get_copy_data (lua_State *L, PGconn *conn, int async, int parse) {
+	char *buf = NULL;
+	int n;
+	PGresult *res;
+
+	if (async && ! PQconsumeInput(conn)) {
+		lua_pushstring(L, PQerrorMessage(conn));
+		return -2;
+	}
+
+	n = PQgetCopyData(conn, &buf, async);
+	if (n > 0) {
+		if (parse) {
+			luaM_push_copy_row(L, buf, n);
+		} else {
+			lua_pushlstring(L, buf, n);
+		}
+		PQfreemem(buf);
+		return 1;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	/* -2: the COPY broke, luaM_drain gets out of it */
+	if (n == -2) {
+		lua_pushstring(L, PQerrorMessage(conn));
+		luaM_drain(conn, NULL);
+		return -2;
+	}
+	n = -1;
+	res = NULL;
+	luaM_drain(conn, &res);
+	if (res != NULL) {
+		lua_pushstring(L, PQresultErrorMessage(res));
+		PQclear(res);
+		n = -2;
+	}
+	if (n == -1 && PQstatus(conn) == CONNECTION_BAD) {
+		lua_pushstring(L, PQerrorMessage(conn));
+		n = -2;
+	}
+	return n;
+}
+
+/**
+* Iterator of db:copy_out(): the next line or row, nil at the end.
+*/
+static int Lpg_copy_out_next (lua_State *L) {
+	lua_pg_stream *my_stream = Mget_stream (L);
+
+	if (my_stream->closed) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if (my_stream->owner->closed) {
+		luaM_stream_close(L, my_stream, 0);
+		return luaL_error(L, "connection is closed");
+	}
+
+	switch (luaM_get_copy_data(L, my_stream->owner->conn, 0, my_stream->copy == 2)) {
+		case 1:
+			return 1;
+		case -2:
+			luaM_stream_close(L, my_stream, 0);
+			return lua_error(L);
+		default:
+			luaM_stream_close(L, my_stream, 0);
+			lua_pushnil(L);
+			return 1;
+	}
+}
+
+/**
+* Start a COPY ... TO STDOUT, leaves nothing on the stack on success
+* or false and the error message.
+*/
+static int luaM_start_copy_out (lua_State *L, lua_pg_conn *my_conn, const char *query) {
+	int leftover = 0;
+	PGresult *res;
+
+	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Cannot set connection to blocking mode");
+		return 2;
+	}
+
+    leftover = luaM_drain(my_conn->conn, NULL) > 0;
+
+    if (leftover) {
+		lua_pushboolean(L, 0);
+        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+		return 2;
+    }
+
+	res = PQexec(my_conn->conn, query);
+	if (PQresultStatus(res) != PGRES_COPY_OUT) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, res ? PQresultErrorMessage(res) : PQerrorMessage(my_conn->conn));
+		PQclear(res);
+		luaM_drain(my_conn->conn, NULL);
+		return 2;
+	}
+	PQclear(res);
+	return 0;
+}
+
+/**
+* Run a COPY ... TO STDOUT and return an iterator over its lines, or
+* over its rows parsed into arrays when `parse' is true.
+*/
+static int Lpg_copy_out (lua_State *L) {
+	int n;
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *query = luaL_checkstring (L, 2);
+	int parse = lua_toboolean(L, 3);
+
+	if ((n = luaM_start_copy_out(L, my_conn, query)) != 0) {
+		return n;
+	}
+
+	lua_pushcfunction(L, Lpg_copy_out_next);
+
+	lua_pg_stream *my_stream = (lua_pg_stream *)lua_newuserdata(L, sizeof(lua_pg_stream));
+	luaM_setmeta (L, LUA_PGSQL_STREAM);
+
+	my_stream->closed = 0;
+	my_stream->keys = LUA_NOREF;
+	my_stream->numcols = 0;
+	my_stream->decode = 0;
+	my_stream->copy = parse ? 2 : 1;
+	my_stream->owner = my_conn;
+	my_stream->decoders = NULL;
+	my_conn->stream = my_stream;
+
+	lua_pushvalue(L, 1);
+	my_stream->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	return 2;
+}
+
+/**
+* Send a COPY ... TO STDOUT whose data is then read with
+* db:get_copy_data(), which also reads the start of the COPY.
+*/
+static int Lpg_send_copy_out (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *query = luaL_checkstring (L, 2);
+
+	if ( ! luaM_send_begin(L, my_conn)) {
+		return 2;
+	}
+	if ( ! PQsendQuery(my_conn->conn, query)) {
+		return luaM_send_failed(L, my_conn);
+	}
+	my_conn->copy_start = 1;
+	return luaM_send_end(L, my_conn);
+}
+
+/**
+* Read the result starting the COPY of db:send_copy_out(). Returns 1
+* once it did, 0 when it is not complete yet (async) and -2 with the
+* message pushed when the query did not start a COPY OUT.
+*/
+static int luaM_copy_out_started (lua_State *L, lua_pg_conn *my_conn, int async) {
+	PGresult *res;
+
+	if (async) {
+		if ( ! PQconsumeInput(my_conn->conn)) {
+			lua_pushstring(L, PQerrorMessage(my_conn->conn));
+			return -2;
+		}
+		if (PQisBusy(my_conn->conn)) {
+			return 0;
+		}
+	}
+	my_conn->copy_start = 0;
+	res = PQgetResult(my_conn->conn);
+	if (PQresultStatus(res) != PGRES_COPY_OUT) {
+		/* a later command drained the COPY of db:send_copy_out() */
+		lua_pushstring(L, res ? PQresultErrorMessage(res) : "No COPY in progress");
+		PQclear(res);
+		luaM_drain(my_conn->conn, NULL);
+		return -2;
+	}
+	PQclear(res);
+	return 1;
+}
+
+/**
+* Next line (or parsed row) of a COPY OUT. With `async', returns false
+* instead of blocking when no data is ready. nil marks the end, with an
+* error message if the COPY failed.
+*/
+static int Lpg_get_copy_data (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+	int async = lua_toboolean(L, 2);
+	int parse = lua_toboolean(L, 3);
+	int n = 1;
+
+	if (my_conn->copy_start) {
+		n = luaM_copy_out_started(L, my_conn, async);
+	}
+	if (n == 1) {
+		n = luaM_get_copy_data(L, my_conn->conn, async, parse);
+	}
+	switch (n) {
+		case 1:
+			return 1;
+		case 0:
+			lua_pushboolean(L, 0);
+			return 1;
+		case -2:
+			lua_pushnil(L);
+			lua_insert(L, -2);
+			return 2;
+		default:
+			lua_pushnil(L);
+			return 1;
+	}
+}
+
+static int Lpg_prepare (lua_State *L) {
+	int leftover = 0;
+	ExecStatusType status;
+	PGresult *res;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *stmtname = luaL_checkstring (L, 2);
+	const char *query = luaL_checkstring (L, 3);
+	int num_types = Mget_param_types(L, my_conn, 4);
+	Oid *types = my_conn->params.types;
+	lua_pg_desc *desc;
+	lua_pg_call call = { PGSQL_KIND_PREPARED, NULL, NULL, 0, 0 };
+	lua_pg_retry rp;
+
+	/* a statement prepared twice is prepared once */
+	Mget_call_retry(L, my_conn, 5, NULL, &rp);
+	call.stmtname = stmtname;
+	call.query = query;
+	call.nparams = num_types;
+
+	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushstring(L, "Cannot set connection to blocking mode");
+		return 1;
+	}
+
+    leftover = luaM_drain(my_conn->conn, NULL) > 0;
+
+    if (leftover) {
+        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+		return 1;
+    }
+
+    luaM_track_session(my_conn, NULL);
+	res = luaM_run(L, my_conn, luaM_run_prepare, &call, NULL, &rp, 1);
+    if (res) {
+        status = PQresultStatus(res);
+    } else {
+        status = (ExecStatusType) PQstatus(my_conn->conn);
+    }
+
+	if (status == PGRES_COMMAND_OK
+			&& (desc = luaM_desc_add(L, my_conn, stmtname, query, num_types, types)) != NULL
+			&& ! luaM_desc_fill(L, my_conn, desc)) {
+		luaM_desc_forget(L, my_conn, stmtname);
+	}
+
+    switch (status) {
+        case PGRES_EMPTY_QUERY:
+        case PGRES_BAD_RESPONSE:
+        case PGRES_NONFATAL_ERROR:
+        case PGRES_FATAL_ERROR:
+			lua_pushboolean(L, 0);
+			luaM_msg(L, 0, PQerrorMessage(my_conn->conn));
+            PQclear(res);
+            return 2;
+            break;
+        case PGRES_COMMAND_OK: /* successful command that did not return rows */
+        default:
+            if (res) {
+				Mnew_res (L, my_conn, res);
+
+				return 1;
+            } else {
+                PQclear(res);
+				lua_pushboolean (L, 0);
+				return 1;
+            }
+            break;
+    }
+}
+
+static int Lpg_execute (lua_State *L) {
+	int leftover = 0;
+	ExecStatusType status;
+	PGresult *res;
+	lua_pg_desc *desc;
+	lua_pg_res *my_res;
+	lua_pg_call call = { PGSQL_KIND_PREPARED, NULL, NULL, 0, 0 };
+	lua_pg_retry rp;
+	int idempotent;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *stmtname = luaL_checkstring (L, 2);
+	int result_format = Mget_result_format(L, my_conn, 4);
+
+	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushstring(L, "Cannot set connection to blocking mode");
+		return 1;
+	}
+
+    leftover = luaM_drain(my_conn->conn, NULL) > 0;
+
+    if (leftover) {
+        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+		return 1;
+    }
+
+	/* statements of db:send_prepare() are described on first use, and dropped if their prepare failed */
+	desc = luaM_desc_find(my_conn, stmtname);
+	if (desc != NULL && desc->numcols < 0 && ! luaM_desc_fill(L, my_conn, desc)) {
+		luaM_desc_forget(L, my_conn, stmtname);
+		desc = NULL;
+	}
+	call.stmtname = stmtname;
+	call.query = desc != NULL ? desc->sql : NULL;
+	call.nparams = Mget_params(L, my_conn, 3, 4, desc);
+	call.result_format = result_format;
+	idempotent = Mget_call_retry(L, my_conn, 4, call.query, &rp);
+
+	/* a reconnect prepares the statement again from its description */
+	res = luaM_run(L, my_conn, luaM_run_exec, &call, desc, &rp, idempotent);
+	if (desc != NULL && desc->session != my_conn->session) {
+		desc = NULL;
+	}
+
+    if (res) {
+        status = PQresultStatus(res);
+    } else {
+        status = (ExecStatusType) PQstatus(my_conn->conn);
+    }
+
+    switch (status) {
+        case PGRES_EMPTY_QUERY:
+        case PGRES_BAD_RESPONSE:
+        case PGRES_NONFATAL_ERROR:
+        case PGRES_FATAL_ERROR:
+			if (desc != NULL && luaM_stmt_stale(my_conn, res)) {
+				luaM_desc_forget(L, my_conn, stmtname);
+			}
+			lua_pushboolean(L, 0);
+			luaM_msg(L, 0, PQerrorMessage(my_conn->conn));
+            PQclear(res);
+            return 2;
+            break;
+        case PGRES_COMMAND_OK: /* successful command that did not return rows */
+        default:
+            if (res) {
+				my_res = Mnew_res (L, my_conn, res);
+				if (desc != NULL) {
+					luaM_desc_apply(L, desc, my_res);
+				}
+
+				return 1;
+            } else {
+                PQclear(res);
+				lua_pushboolean (L, 0);
+				return 1;
+            }
+            break;
+    }
+}
+
+static int Lpg_query_params (lua_State *L) {
+	int leftover = 0;
+	ExecStatusType status;
+	PGresult *res;
+	int num_params;
+	lua_pg_params *p;
+	lua_pg_call call = { PGSQL_KIND_PARAMS, NULL, NULL, 0, 0 };
+	lua_pg_retry rp;
+	int idempotent;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	const char *query = luaL_checkstring (L, 2);
+	int result_format = Mget_result_format(L, my_conn, 4);
+
+	num_params = Mget_params(L, my_conn, 3, 4, NULL);
+	p = &my_conn->params;
+	call.query = query;
+	call.nparams = num_params;
+	call.result_format = result_format;
+	idempotent = Mget_call_retry(L, my_conn, 4, query, &rp);
+
+	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushstring(L, "Cannot set connection to blocking mode");
+		return 1;
+	}
+
+    leftover = luaM_drain(my_conn->conn, NULL) > 0;
+
+    if (leftover) {
+        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+		return 1;
+    }
+
+
+	luaM_track_session(my_conn, query);
+	/* cached statements are prepared without types, typed calls bypass them */
+	call.stmtname = p->typed ? NULL : luaM_stmt_lookup(my_conn, query);
+	res = luaM_run(L, my_conn, luaM_run_exec, &call, NULL, &rp, idempotent);
+
+    if (res) {
+        status = PQresultStatus(res);
+    } else {
+        status = (ExecStatusType) PQstatus(my_conn->conn);
+    }
+
+    switch (status) {
+        case PGRES_EMPTY_QUERY:
+        case PGRES_BAD_RESPONSE:
+        case PGRES_NONFATAL_ERROR:
+        case PGRES_FATAL_ERROR:
+			lua_pushboolean(L, 0);
+			luaM_msg(L, 0, PQerrorMessage(my_conn->conn));
+            PQclear(res);
+            return 2;
+            break;
+        case PGRES_COMMAND_OK: /* successful command that did not return rows */
+        default:
+            if (res) {
+				Mnew_res (L, my_conn, res);
+
+				return 1;
+            } else {
+                PQclear(res);
+				lua_pushboolean (L, 0);
+				return 1;
+            }
+            break;
+    }
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/**
+* Flush a nonblocking connection, reading what the server sends back
+* meanwhile so neither side blocks on a full socket buffer.
+*/
+static int luaM_pipeline_flush (PGconn *conn) {
+	int ret, events;
+
+	while ((ret = PQflush(conn)) == 1) {
+		if ((events = luaM_poll_socket(conn, POLLIN | POLLOUT, 0)) < 0) {
+			return -1;
+		}
+		if ((events & (POLLIN | POLLHUP | POLLERR)) && ! PQconsumeInput(conn)) {
+			return -1;
+		}
+	}
+	return ret;
+}
+
+/**
+* Read and drop the results up to the last of `syncs' sync points.
+*/
+static void luaM_pipeline_discard (PGconn *conn, int syncs) {
+	PGresult *res;
+
+	while (syncs > 0 && PQstatus(conn) == CONNECTION_OK) {
+		if ((res = PQgetResult(conn))) {
+			syncs -= PQresultStatus(res) == PGRES_PIPELINE_SYNC;
+			PQclear(res);
+		}
+	}
+}
+
+/**
+* Queue one statement of a pipeline: a query string, or a table holding
+* the query (or the statement name when `prepared' is set) and its
+* parameters.
+*/
+static int luaM_pipeline_send (lua_State *L, lua_pg_conn *my_conn, int idx, int result_format) {
+	PGconn *conn = my_conn->conn;
+	lua_pg_params *p = &my_conn->params;
+	int num_params, prepared, ret;
+	const char *query;
+
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		luaM_track_session(my_conn, lua_tostring(L, idx));
+		luaM_count_sent(my_conn, PGSQL_KIND_PIPELINE, 'P', lua_tostring(L, idx), 0);
+		return PQsendQueryParams(conn, lua_tostring(L, idx), 0, NULL, NULL, NULL, NULL, result_format);
+	}
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	lua_rawgeti(L, idx, 1);
+	query = luaL_checkstring(L, -1);
+	lua_getfield(L, idx, "prepared");
+	prepared = lua_toboolean(L, -1);
+	lua_rawgeti(L, idx, 2);
+	num_params = Mget_params(L, my_conn, lua_gettop(L), idx, NULL);
+
+	if ( ! prepared) {
+		luaM_track_session(my_conn, query);
+	}
+	luaM_count_sent(my_conn, PGSQL_KIND_PIPELINE, prepared ? 'B' : 'P', query, num_params);
+	if (prepared) {
+		ret = PQsendQueryPrepared(conn, query, num_params, p->values, p->lengths, p->formats, result_format);
+	} else {
+		ret = PQsendQueryParams(conn, query, num_params, p->types, p->values, p->lengths, p->formats, result_format);
+	}
+	lua_pop(L, 3);
+	return ret;
+}
+
+/**
+* luaM_pipeline_send() under lua_pcall(): the connection at 1, the
+* statement at 2, the result format at 3. A malformed statement raises
+* its error once the pipeline is left.
+*/
+static int luaM_pipeline_queue (lua_State *L) {
+	lua_pg_conn *my_conn = (lua_pg_conn *)lua_touserdata(L, 1);
+
+	lua_pushboolean(L, luaM_pipeline_send(L, my_conn, 2, (int)lua_tonumber(L, 3)));
+	return 1;
+}
+
+/**
+* Send every statement of the array at index 2 in pipeline mode, with
+* a single sync at the end, then collect the results in order. The
+* statements form one implicit transaction: the first error skips the
+* rest, and FALSE, the message and its position are returned.
+*/
+static int Lpg_pipeline (lua_State *L) {
+	int leftover = 0;
+	int i, num, sent, failed = 0, raised = 0, syncs = 0;
+	PGresult *res;
+	const char *errmsg = NULL;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	int result_format = Mget_result_format(L, my_conn, 3);
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	num = lua_objlen(L, 2);
+
+	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Cannot set connection to blocking mode");
+		return 2;
+	}
+
+    leftover = luaM_drain(my_conn->conn, NULL) > 0;
+
+    if (leftover) {
+		lua_pushboolean(L, 0);
+        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+		return 2;
+    }
+
+	if (PQstatus(my_conn->conn) != CONNECTION_OK) {
+		luaM_reset(my_conn, my_conn->retry.timeout);
+	}
+
+	if ( ! PQenterPipelineMode(my_conn->conn) || PQsetnonblocking(my_conn->conn, 1)) {
+		PQexitPipelineMode(my_conn->conn);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		return 2;
+	}
+
+	for (sent = 0; sent < num; sent++) {
+		lua_pushcfunction(L, luaM_pipeline_queue);
+		lua_pushlightuserdata(L, my_conn);
+		lua_rawgeti(L, 2, sent + 1);
+		lua_pushnumber(L, result_format);
+		if (lua_pcall(L, 3, 1, 0) != 0) {
+			raised = 1;
+			break;
+		}
+		if ( ! lua_toboolean(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		lua_pop(L, 1);
+		/* keep the output buffer small */
+		if (luaM_pipeline_flush(my_conn->conn) < 0) {
+			break;
+		}
+	}
+
+	if (sent == num && PQpipelineSync(my_conn->conn)) {
+		syncs++;
+	}
+	if (sent < num || ! syncs || luaM_pipeline_flush(my_conn->conn) < 0) {
+		if ( ! raised) {
+			lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		}
+		/* the queued statements still need a sync to be discarded */
+		if ( ! syncs && PQstatus(my_conn->conn) == CONNECTION_OK && PQpipelineSync(my_conn->conn)) {
+			syncs++;
+		}
+		if (syncs && PQstatus(my_conn->conn) == CONNECTION_OK
+				&& luaM_pipeline_flush(my_conn->conn) >= 0) {
+			PQsetnonblocking(my_conn->conn, 0);
+			luaM_pipeline_discard(my_conn->conn, syncs);
+		}
+		PQsetnonblocking(my_conn->conn, 0);
+		PQexitPipelineMode(my_conn->conn);
+		if (raised) {
+			/* the connection is usable again */
+			return lua_error(L);
+		}
+		lua_pushboolean(L, 0);
+		lua_insert(L, -2);
+		lua_pushnumber(L, sent + 1);
+		return 3;
+	}
+	PQsetnonblocking(my_conn->conn, 0);
+	my_conn->stats.round_trips++;
+
+	lua_createtable(L, num, 0);
+	for (i = 1; i <= num; i++) {
+		/* every statement ends with a NULL result */
+		while ((res = luaM_get_result(my_conn))) {
+			switch (PQresultStatus(res)) {
+				case PGRES_FATAL_ERROR:
+				case PGRES_BAD_RESPONSE:
+				case PGRES_NONFATAL_ERROR:
+					if ( ! failed) {
+						failed = i;
+						lua_pushstring(L, PQresultErrorMessage(res));
+						errmsg = lua_tostring(L, -1);
+						lua_insert(L, -2);
+					}
+					PQclear(res);
+					break;
+				case PGRES_PIPELINE_ABORTED:
+					PQclear(res);
+					break;
+				default:
+					if (failed) {
+						PQclear(res);
+					} else {
+						Mnew_res (L, my_conn, res);
+						lua_rawseti(L, -2, i);
+					}
+					break;
+			}
+		}
+	}
+
+	luaM_pipeline_discard(my_conn->conn, syncs);
+	PQexitPipelineMode(my_conn->conn);
+
+	if (failed) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, errmsg);
+		lua_pushnumber(L, failed);
+		return 3;
+	}
+	return 1;
+}
+#else
+static int Lpg_pipeline (lua_State *L) {
+	lua_pushboolean(L, 0);
+	lua_pushstring(L, "Pipeline mode needs libpq 14 or later");
+	return 2;
+}
+#endif
+
+static int Lpg_field_num (lua_State *L) {
+	lua_pg_res *my_res = Mget_res (L);
+    const char *field_name = luaL_optstring(L, 2, NULL);
+    lua_pushnumber (L, (lua_Number) PQfnumber (my_res->res, field_name));
+    return 1;
+}
+
+static int Lpg_get_field_info(lua_State *L, int entry_type) {
+	Oid oid;
+	char *fname;
+	int fsize;
+	lua_pg_res *my_res = Mget_res (L);
+    lua_Number field_number = luaL_optnumber(L, 2, 0);
+
+    if (field_number < 0 || field_number >= PQnfields(my_res->res)) {
+		lua_pushboolean(L, 0);
+        lua_pushstring(L, "Bad field offset specified");
+		return 2;
+    }
+
+    switch (entry_type) {
+        case LUA_PG_FIELD_NAME:
+			fname = PQfname(my_res->res, field_number);
+            luaM_pushvalue(L, fname, strlen(fname));
+			return 1;
+            break;
+        case LUA_PG_FIELD_SIZE:
+			fsize = PQfsize(my_res->res, field_number);
+            lua_pushnumber(L, fsize);
+            break;
+        case LUA_PG_FIELD_TYPE:
+            oid = PQftype(my_res->res, field_number);
+			return Lpg_do_get_field_name(L, my_res->owner, oid);
+            break;
+        case LUA_PG_FIELD_TYPE_OID:
+            oid = PQftype(my_res->res, field_number);
+			lua_pushnumber(L, oid);
+            break;
+        default:
+			lua_pushboolean(L, 0);
+    }
+	return 1;
+}
+
+static int Lpg_field_name (lua_State *L) {
+	return Lpg_get_field_info(L, LUA_PG_FIELD_NAME);
+}
+
+static int Lpg_field_size (lua_State *L) {
+	return Lpg_get_field_info(L, LUA_PG_FIELD_SIZE);
+}
+
+static int Lpg_field_type (lua_State *L) {
+	return Lpg_get_field_info(L, LUA_PG_FIELD_TYPE);
+}
+
+static int Lpg_field_type_oid (lua_State *L) {
+	return Lpg_get_field_info(L, LUA_PG_FIELD_TYPE_OID);
+}
+
+static int Lpg_num_rows (lua_State *L) {
+    lua_pushnumber(L, PQntuples(Mget_res(L)->res));
+    return 1;
+}
+
+static int Lpg_num_fields (lua_State *L) {
+    lua_pushnumber(L, PQnfields(Mget_res(L)->res));
+    return 1;
+}
+
+static int Lpg_affected_rows (lua_State *L) {
+    lua_pushnumber(L, atoi(PQcmdTuples(Mget_res(L)->res)));
+    return 1;
+}
+
+static int Lpg_data_info (lua_State *L, int entry_type) {
+	int field_offset, pgsql_row;
+
+	lua_pg_res *my_res = Mget_res (L);
+    const char *row = luaL_optstring(L, 2, 0);
+    const char *field = luaL_optstring(L, 3, NULL);
+	
+	if (field == NULL) {
+		pgsql_row = my_res->row;
+		field = row;
+	} else {
+		pgsql_row = atoi(row);
+	}
+
+	if (pgsql_row >= PQntuples(my_res->res)) {
+		lua_pushfstring(L, "Unable to jump to row %d on PostgreSQL!", pgsql_row);
+		return 1;
+	}
+
+	lua_pushstring(L, field);
+	if (lua_isnumber(L, -1)) {
+		field_offset = atoi(field);		
+	} else {
+		field_offset = PQfnumber(my_res->res, field);
+	}
+	
+	if (field_offset < 0 || field_offset >= PQnfields(my_res->res)) {
+		lua_pushstring(L, "Bad column offset specified");
+		return 1;
+	}
+
+    switch (entry_type) {
+        case LUA_PG_DATA_LENGTH:
+            lua_pushnumber(L, PQgetlength(my_res->res, pgsql_row, field_offset));
+            break;
+        case LUA_PG_DATA_ISNULL:
+            lua_pushnumber(L, PQgetisnull(my_res->res, pgsql_row, field_offset));
+            break;
+        case LUA_PG_DATA_RESULT:
+			if (PQgetisnull(my_res->res, pgsql_row, field_offset)) {
+				lua_pushnil(L);
+			} else {
+				Mget_decoders(my_res);
+				luaM_pushcell(L, my_res, pgsql_row, field_offset);
+			}
+			break;
+    }
+
+    return 1;
+}
+
+static int Lpg_field_is_null (lua_State *L) {
+	return Lpg_data_info(L, LUA_PG_DATA_ISNULL);
+}
+
+static int Lpg_field_prtlen(lua_State *L) {
+	return Lpg_data_info(L, LUA_PG_DATA_LENGTH);
+}
+
+static int Lpg_do_fetch(lua_State *L, int result_type) {
+	lua_pg_res *my_res = Mget_res (L);
+	double start;
+
+    if ( ! result_type) {
+		result_type = PGSQL_BOTH;
+    }
+
+	/* use internal row counter to access next row */
+	if (my_res->row >= PQntuples(my_res->res)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	Mget_decoders(my_res);
+
+	start = luaM_now();
+	if (result_type & PGSQL_ASSOC) {
+		luaM_pushkeys(L, my_res);
+		luaM_pushrow(L, my_res, my_res->row, result_type, lua_gettop(L), NULL, 0);
+		lua_remove(L, -2);
+	} else {
+		luaM_pushrow(L, my_res, my_res->row, result_type, 0, NULL, 0);
+	}
+	my_res->owner->stats.convert_time += luaM_now() - start;
+
+	my_res->row++;
 
-	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int Lpg_end_copy (lua_State *L) {
-	int result = 0;
+static int Lpg_fetch_row (lua_State *L) {
+    return Lpg_do_fetch(L, PGSQL_NUM);
+}
+
+static int Lpg_fetch_assoc (lua_State *L) {
+    return Lpg_do_fetch(L, PGSQL_ASSOC);
+}
+
+static int Lpg_fetch_array (lua_State *L) {
+    const char *result_type = luaL_optstring (L, 2, "PGSQL_BOTH");
+    return Lpg_do_fetch(L, luaM_const(L, result_type));
+}
+
+/**
+* The next `n' rows as an array, advancing the row counter, optionally
+* restricted to a list of column names or numbers mapped once per call.
+*/
+static int Lpg_fetch_many (lua_State *L) {
+	int i, n, count, keys = 0, num_cols = 0;
+	int *cols = NULL;
+	long result_type;
+	double start;
+	lua_pg_res *my_res = Mget_res (L);
+
+	lua_Number max = luaL_checknumber(L, 2);
+	const char *result_type_str = luaL_optstring(L, 3, "PGSQL_ASSOC");
+
+	result_type = luaM_const(L, result_type_str);
+	if ( ! (result_type & PGSQL_BOTH)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Invalid result type");
+		return 2;
+	}
+
+	count = PQntuples(my_res->res) - my_res->row;
+	if (max < count) {
+		count = max > 0 ? (int)max : 0;
+	}
+	if (count <= 0) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	if (lua_istable(L, 4)) {
+		num_cols = lua_objlen(L, 4);
+		cols = (int *)lua_newuserdata(L, (num_cols + 1) * sizeof(int));
+		lua_createtable(L, num_cols, 0); /* keys of the projection */
+		for (i = 0; i < num_cols; i++) {
+			lua_rawgeti(L, 4, i + 1);
+			if (lua_type(L, -1) == LUA_TNUMBER) {
+				cols[i] = (int)lua_tonumber(L, -1);
+			} else {
+				cols[i] = PQfnumber(my_res->res, luaL_checkstring(L, -1));
+			}
+			if (cols[i] < 0 || cols[i] >= my_res->numcols) {
+				lua_pushfstring(L, "Bad column '%s' specified", lua_tostring(L, -1));
+				lua_pushboolean(L, 0);
+				lua_insert(L, -2);
+				return 2;
+			}
+			lua_pop(L, 1);
+			lua_pushstring(L, PQfname(my_res->res, cols[i]));
+			lua_rawseti(L, -2, i + 1);
+		}
+		keys = lua_gettop(L);
+	} else if (result_type & PGSQL_ASSOC) {
+		luaM_pushkeys(L, my_res);
+		keys = lua_gettop(L);
+	}
+
+	Mget_decoders(my_res);
+
+	lua_createtable(L, count, 0); /* result */
+
+	start = luaM_now();
+	for (n = 1; n <= count; n++) {
+		luaM_pushrow(L, my_res, my_res->row, result_type, keys, cols, num_cols);
+		lua_rawseti(L, -2, n);
+		my_res->row++;
+	}
+	my_res->owner->stats.convert_time += luaM_now() - start;
+
+	return 1;
+}
+
+static int Lpg_fetch_result (lua_State *L) {
+	return Lpg_data_info(L, LUA_PG_DATA_RESULT);
+}
+
+
+static int Lpg_get_result (lua_State *L) {
+    PGresult *res;
 
     lua_pg_conn *my_conn = Mget_conn (L);
 
-    result = PQendcopy(my_conn->conn);
+	/* async: nil rather than blocking until the result is complete */
+	if (lua_toboolean(L, 2)) {
+		PQconsumeInput(my_conn->conn);
+		if (PQisBusy(my_conn->conn)) {
+			lua_pushnil(L);
+			return 1;
+		}
+	}
 
-    if (result != 0) {
-        lua_pushfstring(L, "Query failed: %s", PQerrorMessage(my_conn->conn));
+    res = luaM_get_result(my_conn);
+    if ( ! res) {
+        /* no result */
+		lua_pushboolean(L, 0);
+		return 1;
+    }
+
+	Mnew_res (L, my_conn, res);
+
+	return 1;
+}
+
+static int Lpg_do_fetch_all (lua_State *L, lua_pg_res *my_res) {
+    int pg_numrows, pg_row, keys;
+	double start;
+
+    if ((pg_numrows = PQntuples(my_res->res)) <= 0) {
+		lua_pushboolean(L, 0);
 		return 1;
     }
-	
-	lua_pushboolean(L, 1);
+
+	Mget_decoders(my_res);
+
+	luaM_pushkeys(L, my_res);
+	keys = lua_gettop(L);
+
+	lua_createtable(L, pg_numrows, 0); /* result */
+
+	start = luaM_now();
+    for (pg_row = 0; pg_row < pg_numrows; pg_row++) {
+		luaM_pushrow(L, my_res, pg_row, PGSQL_ASSOC, keys, NULL, 0);
+		lua_rawseti (L, -2, pg_row + 1);
+    }
+	my_res->owner->stats.convert_time += luaM_now() - start;
+
+	lua_remove(L, keys);
+
 	return 1;
 }
 
-static int Lpg_prepare (lua_State *L) {
-	int leftover = 0;
-	ExecStatusType status;
-	PGresult *res;
+static int Lpg_fetch_all (lua_State *L) {
+	lua_pg_res *my_res = Mget_res (L);
+	return Lpg_do_fetch_all(L, my_res);
+}
 
-    lua_pg_conn *my_conn = Mget_conn (L);
-	const char *stmtname = luaL_checkstring (L, 2);
-	const char *query = luaL_checkstring (L, 3);
+static int Lpg_fetch_all_columns (lua_State *L) {
 
+    size_t num_fields;
+    int pg_numrows, pg_row;
 
-	if (PQsetnonblocking(my_conn->conn, 0)) {
-		lua_pushstring(L, "Cannot set connection to blocking mode");
-		return 1;
-	}
+	lua_pg_res *my_res = Mget_res (L);
 
-    while ((res = PQgetResult(my_conn->conn))) {
-        PQclear(res);
-        leftover = 1;
-    }
+    long colno = luaL_optnumber(L, 2, 0);
 
-    if (leftover) {
-        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
+    if ((pg_numrows = PQntuples(my_res->res)) <= 0) {
+		lua_pushboolean(L, 0);
 		return 1;
     }
 
-    res = PQprepare(my_conn->conn, stmtname, query, 0, NULL);
-    if (PQstatus(my_conn->conn) != CONNECTION_OK) {
-        PQclear(res);
-        PQreset(my_conn->conn);
-        res = PQprepare(my_conn->conn, stmtname, query, 0, NULL);
-    }
-    if (res) {
-        status = PQresultStatus(res);
-    } else {
-        status = (ExecStatusType) PQstatus(my_conn->conn);
-    }
-
-    switch (status) {
-        case PGRES_EMPTY_QUERY:
-        case PGRES_BAD_RESPONSE:
-        case PGRES_NONFATAL_ERROR:
-        case PGRES_FATAL_ERROR:
-			lua_pushboolean(L, 0);
-			luaM_msg(L, 0, PQerrorMessage(my_conn->conn));
-            PQclear(res);
-            return 2;
-            break;
-        case PGRES_COMMAND_OK: /* successful command that did not return rows */
-        default:
-            if (res) {
-				lua_pg_res *my_res = (lua_pg_res *)lua_newuserdata(L, sizeof(lua_pg_res));
-				luaM_setmeta (L, LUA_PGSQL_RES);
+	num_fields = PQnfields(my_res->res);
 
-				/* fill in structure */
-				my_res->closed = 0;
-				my_res->row = 0;
-				my_res->conn = LUA_NOREF;
-				my_res->numcols = PQnfields(res);
-				my_res->res = res;
+    if (colno >= num_fields || colno < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushfstring(L, "Invalid column number '%ld'", colno);
+		return 2;
+    }
 
-				lua_pushvalue(L, 1);
+	Mget_decoders(my_res);
 
-				my_res->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_createtable(L, pg_numrows, 0); /* result */
 
-				return 1;
-            } else {
-                PQclear(res);
-				lua_pushboolean (L, 0);
-				return 1;
-            }
-            break;
+    for (pg_row = 0; pg_row < pg_numrows; pg_row++) {
+		luaM_pushcell(L, my_res, pg_row, colno);
+		lua_rawseti (L, -2, pg_row + 1);
     }
+
+	return 1;
 }
 
-static int Lpg_execute (lua_State *L) {
-	int leftover = 0;
-	ExecStatusType status;
-	PGresult *res;
-	int num_params = 0;
-	char **params = NULL;
+/**
+* All columns as arrays, { name = { v1, v2, ... }, ... }, in one pass
+* over the result.
+*/
+static int Lpg_fetch_columns (lua_State *L) {
+	int pg_numrows, pg_row, i, base, decode;
+	lua_pg_res *my_res = Mget_res (L);
 
-    lua_pg_conn *my_conn = Mget_conn (L);
-	const char *stmtname = luaL_checkstring (L, 2);
+	decode = my_res->decode;
+	if (lua_isboolean(L, 2) && lua_toboolean(L, 2) != decode && ! PQbinaryTuples(my_res->res)) {
+		luaM_set_decode(my_res, lua_toboolean(L, 2));
+	}
 
-	if (lua_istable(L, 3)) {
-		luaL_checktype(L, 3, LUA_TTABLE);
-		num_params = lua_objlen(L, 3);
-		if (num_params > 0) {
-			int i = 0;
-			params = (char **)safe_emalloc(sizeof(char *), 1, 0);
+	pg_numrows = PQntuples(my_res->res);
+	luaL_checkstack(L, my_res->numcols + 3, "too many columns");
 
-			for (i = 0; i < num_params; i++) {
-				lua_rawgeti(L, 3, i);
-				params[i] = (char *) lua_tostring(L, -1);
-				lua_pop(L, 1);
-			}
-		}
-	} else {
-		num_params = 1;
-		params = (char **)safe_emalloc(sizeof(char *), 1, 0);
-		if (lua_isstring(L, 3)) { // auto set one param value
-			params[0] = (char *) luaL_checkstring(L, 3);
-		} else {
-			params[0] = NULL;
+	Mget_decoders(my_res);
+	luaM_pushkeys(L, my_res);
+	lua_createtable(L, 0, my_res->numcols); /* result */
+
+	base = lua_gettop(L);
+	for (i = 0; i < my_res->numcols; i++) {
+		lua_createtable(L, pg_numrows, 0);
+	}
+
+	for (pg_row = 0; pg_row < pg_numrows; pg_row++) {
+		for (i = 0; i < my_res->numcols; i++) {
+			luaM_pushcell(L, my_res, pg_row, i);
+			lua_rawseti(L, base + 1 + i, pg_row + 1);
 		}
 	}
 
-	if (PQsetnonblocking(my_conn->conn, 0)) {
-		lua_pushstring(L, "Cannot set connection to blocking mode");
-		return 1;
+	for (i = my_res->numcols - 1; i >= 0; i--) {
+		lua_rawgeti(L, base - 1, i + 1);
+		lua_insert(L, -2);
+		lua_rawset(L, base);
 	}
+	lua_remove(L, base - 1);
 
-    while ((res = PQgetResult(my_conn->conn))) {
-        PQclear(res);
-        leftover = 1;
-    }
+	luaM_set_decode(my_res, decode);
+	return 1;
+}
 
-    if (leftover) {
-        lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
-		return 1;
-    }
+static int Lpg_res_set_decode (lua_State *L) {
+	lua_pg_res *my_res = Mget_res (L);
 
+	luaM_set_decode(my_res, lua_toboolean(L, 2) || PQbinaryTuples(my_res->res));
 
-    res = PQexecPrepared(my_conn->conn, stmtname, num_params,
-                    (const char * const *)params, NULL, NULL, 0);
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-    if (PQstatus(my_conn->conn) != CONNECTION_OK) {
-        PQclear(res);
-        PQreset(my_conn->conn);
-		res = PQexecPrepared(my_conn->conn, stmtname, num_params,
-						(const char * const *)params, NULL, NULL, 0);
-    }
+/**
+* Stream Part
+*/
 
-    if (res) {
-        status = PQresultStatus(res);
-    } else {
-        status = (ExecStatusType) PQstatus(my_conn->conn);
-    }
+/**
+* Iterator of db:stream(): the next row, nil at the end.
+* A server error raises it, after draining the connection.
+*/
+static int Lpg_stream_next (lua_State *L) {
+	lua_pg_stream *my_stream = Mget_stream (L);
+	lua_pg_res row;
+	PGresult *res;
+	int i;
+	double start;
 
-    switch (status) {
-        case PGRES_EMPTY_QUERY:
-        case PGRES_BAD_RESPONSE:
-        case PGRES_NONFATAL_ERROR:
-        case PGRES_FATAL_ERROR:
-			lua_pushboolean(L, 0);
-			luaM_msg(L, 0, PQerrorMessage(my_conn->conn));
-            PQclear(res);
-            return 2;
-            break;
-        case PGRES_COMMAND_OK: /* successful command that did not return rows */
-        default:
-            if (res) {
-				lua_pg_res *my_res = (lua_pg_res *)lua_newuserdata(L, sizeof(lua_pg_res));
-				luaM_setmeta (L, LUA_PGSQL_RES);
+	if (my_stream->closed) {
+		lua_pushnil(L);
+		return 1;
+	}
 
-				/* fill in structure */
-				my_res->closed = 0;
-				my_res->row = 0;
-				my_res->conn = LUA_NOREF;
-				my_res->numcols = PQnfields(res);
-				my_res->res = res;
+	if (my_stream->owner->closed) {
+		luaM_stream_close(L, my_stream, 0);
+		return luaL_error(L, "connection is closed");
+	}
 
-				lua_pushvalue(L, 1);
+	res = luaM_get_result(my_stream->owner);
+
+	switch (res ? PQresultStatus(res) : PGRES_TUPLES_OK) {
+		case PGRES_SINGLE_TUPLE:
+			/* decoders and keys are taken from the first row */
+			row.res = res;
+			row.owner = my_stream->owner;
+			row.numcols = PQnfields(res);
+			row.decode = my_stream->decode || PQbinaryTuples(res);
+			row.decoders = my_stream->decoders;
+			if (my_stream->keys == LUA_NOREF) {
+				Mget_decoders(&row);
+				my_stream->decoders = row.decoders;
+				my_stream->numcols = row.numcols;
+
+				lua_createtable(L, row.numcols, 0);
+				for (i = 0; i < row.numcols; i++) {
+					lua_pushstring(L, PQfname(res, i));
+					lua_rawseti(L, -2, i + 1);
+				}
+				my_stream->keys = luaL_ref(L, LUA_REGISTRYINDEX);
+			}
 
-				my_res->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, my_stream->keys);
+			start = luaM_now();
+			luaM_pushrow(L, &row, 0, PGSQL_ASSOC, lua_gettop(L), NULL, 0);
+			row.owner->stats.convert_time += luaM_now() - start;
+			lua_remove(L, -2);
+			PQclear(res);
+			return 1;
 
-				return 1;
-            } else {
-                PQclear(res);
-				lua_pushboolean (L, 0);
-				return 1;
-            }
-            break;
-    }
+		case PGRES_TUPLES_OK:
+		case PGRES_COMMAND_OK:
+		case PGRES_EMPTY_QUERY:
+			PQclear(res);
+			luaM_stream_close(L, my_stream, 1);
+			lua_pushnil(L);
+			return 1;
+
+		default:
+			lua_pushstring(L, res ? PQresultErrorMessage(res) : PQerrorMessage(my_stream->owner->conn));
+			PQclear(res);
+			luaM_stream_close(L, my_stream, 1);
+			return lua_error(L);
+	}
 }
 
-static int Lpg_query_params (lua_State *L) {
+static int Lpg_stream_close (lua_State *L) {
+	luaM_stream_close(L, Mget_stream (L), 1);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+* Run a query in single row mode and return an iterator over its rows,
+* so only one row at a time is held in client memory.
+*/
+static int Lpg_stream (lua_State *L) {
 	int leftover = 0;
-	ExecStatusType status;
-	PGresult *res;
-	int num_params = 0;
-	char **params = NULL;
+	int ok, num_params;
+	lua_pg_params *p;
 
-    lua_pg_conn *my_conn = Mget_conn (L);
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 	const char *query = luaL_checkstring (L, 2);
+	int result_format = Mget_result_format(L, my_conn, 4);
 
-	if (lua_istable(L, 3)) {
-		luaL_checktype(L, 3, LUA_TTABLE);
-		num_params = lua_objlen(L, 3);
-		if (num_params > 0) {
-			int i = 0;
-			params = (char **)safe_emalloc(sizeof(char *), 1, 0);
-
-			for (i = 0; i < num_params; i++) {
-				lua_rawgeti(L, 3, i);
-				params[i] = (char *) lua_tostring(L, -1);
-				lua_pop(L, 1);
-			}
-		}
-	} else {
-		num_params = 1;
-		params = (char **)safe_emalloc(sizeof(char *), 1, 0);
-		if (lua_isstring(L, 3)) { // auto set one param value
-			params[0] = (char *) luaL_checkstring(L, 3);
-		} else {
-			params[0] = NULL;
-		}
-	}
+	num_params = Mget_params(L, my_conn, 3, 4, NULL);
+	p = &my_conn->params;
+	luaM_track_session(my_conn, query);
 
 	if (PQsetnonblocking(my_conn->conn, 0)) {
+		lua_pushboolean(L, 0);
 		lua_pushstring(L, "Cannot set connection to blocking mode");
-		return 1;
+		return 2;
 	}
 
-    while ((res = PQgetResult(my_conn->conn))) {
-        PQclear(res);
-        leftover = 1;
-    }
+    leftover = luaM_drain(my_conn->conn, NULL) > 0;
 
     if (leftover) {
+		lua_pushboolean(L, 0);
         lua_pushstring(L, "Found results on this connection. Use db:get_result() to get these results first");
-		return 1;
+		return 2;
     }
 
+	if (num_params > 0 || result_format) {
+		luaM_count_sent(my_conn, PGSQL_KIND_PARAMS, 'P', query, num_params);
+		ok = PQsendQueryParams(my_conn->conn, query, num_params, p->types, p->values, p->lengths, p->formats, result_format);
+	} else {
+		luaM_count_sent(my_conn, PGSQL_KIND_SIMPLE, 'Q', query, 0);
+		ok = PQsendQuery(my_conn->conn, query);
+	}
+	my_conn->stats.round_trips++;
+
+	if ( ! ok || ! PQsetSingleRowMode(my_conn->conn)) {
+		luaM_drain(my_conn->conn, NULL);
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		return 2;
+	}
+
+	lua_pushcfunction(L, Lpg_stream_next);
 
-    res = PQexecParams(my_conn->conn, query, num_params,
-                    NULL, (const char * const *)params, NULL, NULL, 0);
+	lua_pg_stream *my_stream = (lua_pg_stream *)lua_newuserdata(L, sizeof(lua_pg_stream));
+	luaM_setmeta (L, LUA_PGSQL_STREAM);
 
-    if (PQstatus(my_conn->conn) != CONNECTION_OK) {
-        PQclear(res);
-        PQreset(my_conn->conn);
-		res = PQexecParams(my_conn->conn, query, num_params,
-					NULL, (const char * const *)params, NULL, NULL, 0);
+	my_stream->closed = 0;
+	my_stream->keys = LUA_NOREF;
+	my_stream->numcols = 0;
+	my_stream->decode = my_conn->decode;
+	my_stream->copy = 0;
+	my_stream->owner = my_conn;
+	my_stream->decoders = NULL;
+	my_conn->stream = my_stream;
+
+	lua_pushvalue(L, 1);
+	my_stream->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	return 2;
+}
+
+static int Lpg_last_oid (lua_State *L) {
+	Oid oid;
+
+    lua_pg_res *my_res = Mget_res (L);
+
+    oid = PQoidValue(my_res->res); // = (char *) PQoidStatus(my_res->res);
+    if (oid == InvalidOid) {
+		lua_pushboolean(L, 0);
     }
+    lua_pushnumber(L, oid);
+    return 1;
+}
 
-    if (res) {
-        status = PQresultStatus(res);
-    } else {
-        status = (ExecStatusType) PQstatus(my_conn->conn);
+static int Lpg_result_error (lua_State *L) {
+	lua_pushstring(L, (char *)PQresultErrorMessage(Mget_res (L)->res));
+    return 1;
+}
+
+static int Lpg_result_seek (lua_State *L) {
+	lua_pg_res *my_res = Mget_res (L);
+
+    lua_Number row = luaL_optnumber(L, 2, -1);
+
+
+    if (row < 0 || row >= PQntuples(my_res->res)) {
+		lua_pushboolean(L, 0);
+		return 1;
     }
 
-    switch (status) {
-        case PGRES_EMPTY_QUERY:
-        case PGRES_BAD_RESPONSE:
-        case PGRES_NONFATAL_ERROR:
-        case PGRES_FATAL_ERROR:
-			lua_pushboolean(L, 0);
-			luaM_msg(L, 0, PQerrorMessage(my_conn->conn));
-            PQclear(res);
-            return 2;
-            break;
-        case PGRES_COMMAND_OK: /* successful command that did not return rows */
-        default:
-            if (res) {
-				lua_pg_res *my_res = (lua_pg_res *)lua_newuserdata(L, sizeof(lua_pg_res));
-				luaM_setmeta (L, LUA_PGSQL_RES);
+    /* seek to offset */
+    my_res->row = row;
 
-				/* fill in structure */
-				my_res->closed = 0;
-				my_res->row = 0;
-				my_res->conn = LUA_NOREF;
-				my_res->numcols = PQnfields(res);
-				my_res->res = res;
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-				lua_pushvalue(L, 1);
+static int Lpg_result_status (lua_State *L) {
+	lua_pg_res *my_res = Mget_res (L);
 
-				my_res->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+    const char *result_type_str = luaL_optstring(L, 2, "PGSQL_STATUS_LONG");
 
-				return 1;
-            } else {
-                PQclear(res);
-				lua_pushboolean (L, 0);
-				return 1;
-            }
-            break;
+    long result_type = luaM_const(L, result_type_str);
+    ExecStatusType status;
+
+    if (result_type == PGSQL_STATUS_LONG) {
+        status = PQresultStatus(my_res->res);
+		lua_pushnumber(L, status);
+		return 1;
+    }
+    else if (result_type == PGSQL_STATUS_STRING) { lua_pushstring(L, PQcmdStatus(my_res->res));
+		return 1;
+    }
+    else {
+        lua_pushfstring(L, "Optional 1th parameter should be PGSQL_STATUS_LONG or PGSQL_STATUS_STRING");
+		return 1;
     }
 }
 
-static int Lpg_field_num (lua_State *L) {
+static int Lpg_result_error_field (lua_State *L) {
+    char *field = NULL;
 	lua_pg_res *my_res = Mget_res (L);
-    const char *field_name = luaL_optstring(L, 2, NULL);
-    lua_pushnumber (L, (lua_Number) PQfnumber (my_res->res, field_name));
-    return 1;
-}
 
-static int Lpg_get_field_info(lua_State *L, int entry_type) {
-	Oid oid;
-	char *fname;
-	int fsize;
-	lua_pg_res *my_res = Mget_res (L);
-    lua_Number field_number = luaL_optnumber(L, 2, 0);
+    long fieldcode = luaL_optnumber(L, 2, -1);
 
-    if (field_number < 0 || field_number >= PQnfields(my_res->res)) {
+    if ( ! my_res->res) {
 		lua_pushboolean(L, 0);
-        lua_pushstring(L, "Bad field offset specified");
-		return 2;
+		return 1;
     }
 
-    switch (entry_type) {
-        case LUA_PG_FIELD_NAME:
-			fname = PQfname(my_res->res, field_number);
-            luaM_pushvalue(L, fname, strlen(fname));
-			return 1;
-            break;
-        case LUA_PG_FIELD_SIZE:
-			fsize = PQfsize(my_res->res, field_number);
-            lua_pushnumber(L, fsize);
-            break;
-        case LUA_PG_FIELD_TYPE:
-            oid = PQftype(my_res->res, field_number);
-			lua_pushnumber(L, oid);
-			return Lpg_do_get_field_name(L, oid);
-            break;
-        case LUA_PG_FIELD_TYPE_OID:
-            oid = PQftype(my_res->res, field_number);
-			lua_pushnumber(L, oid);
-            break;
-        default:
-			lua_pushboolean(L, 0);
+    if (fieldcode & (PG_DIAG_SEVERITY|PG_DIAG_SQLSTATE|PG_DIAG_MESSAGE_PRIMARY|PG_DIAG_MESSAGE_DETAIL
+                |PG_DIAG_MESSAGE_HINT|PG_DIAG_STATEMENT_POSITION
+                |PG_DIAG_INTERNAL_POSITION
+                |PG_DIAG_INTERNAL_QUERY
+                |PG_DIAG_CONTEXT|PG_DIAG_SOURCE_FILE|PG_DIAG_SOURCE_LINE
+                |PG_DIAG_SOURCE_FUNCTION)) {
+        field = (char *)PQresultErrorField(my_res->res, fieldcode);
+        if (field == NULL) {
+			lua_pushnil(L);
+        } else {
+            lua_pushstring(L, field);
+        }
+    } else {
+		lua_pushboolean(L, 0);
     }
 	return 1;
 }
 
-static int Lpg_field_name (lua_State *L) {
-	return Lpg_get_field_info(L, LUA_PG_FIELD_NAME);
-}
-
-static int Lpg_field_size (lua_State *L) {
-	return Lpg_get_field_info(L, LUA_PG_FIELD_SIZE);
-}
-
-static int Lpg_field_type (lua_State *L) {
-	return Lpg_get_field_info(L, LUA_PG_FIELD_TYPE);
+/**
+* Release the libpq memory of a result.
+*/
+static void luaM_free_result (lua_State *L, lua_pg_res *my_res) {
+    /* Nullify structure fields. */
+    my_res->closed = 1;
+	PQclear(my_res->res);
+	my_res->res = NULL;
+	free(my_res->decoders);
+	my_res->decoders = NULL;
+    luaL_unref (L, LUA_REGISTRYINDEX, my_res->conn);
+    luaL_unref (L, LUA_REGISTRYINDEX, my_res->keys);
+	my_res->conn = LUA_NOREF;
+	my_res->keys = LUA_NOREF;
+	luaM_count(live_results, -1);
 }
 
-static int Lpg_field_type_oid (lua_State *L) {
-	return Lpg_get_field_info(L, LUA_PG_FIELD_TYPE_OID);
-}
+static int Lpg_free_result (lua_State *L) {
+    lua_pg_res *my_res = (lua_pg_res *)luaL_checkudata (L, 1, LUA_PGSQL_RES);
+    luaL_argcheck (L, my_res != NULL, 1, "result expected");
+    if (my_res->closed) {
+        lua_pushboolean (L, 0);
+        return 1;
+    }
 
-static int Lpg_num_rows (lua_State *L) {
-    lua_pushnumber(L, PQntuples(Mget_res(L)->res));
-    return 1;
-}
+	luaM_free_result(L, my_res);
 
-static int Lpg_num_fields (lua_State *L) {
-    lua_pushnumber(L, PQnfields(Mget_res(L)->res));
-    return 1;
-}
+    lua_pushboolean (L, 1);
 
-static int Lpg_affected_rows (lua_State *L) {
-    lua_pushnumber(L, atoi(PQcmdTuples(Mget_res(L)->res)));
     return 1;
 }
 
-static int Lpg_data_info (lua_State *L, int entry_type) {
-	int field_offset, pgsql_row;
-
-	lua_pg_res *my_res = Mget_res (L);
-    const char *row = luaL_optstring(L, 2, 0);
-    const char *field = luaL_optstring(L, 3, NULL);
-	
-	if (field == NULL) {
-		pgsql_row = my_res->row;
-		field = row;
-	} else {
-		pgsql_row = atoi(row);
+static int Lpg_res_gc (lua_State *L) {
+    lua_pg_res *my_res = (lua_pg_res *)luaL_checkudata (L, 1, LUA_PGSQL_RES);
+    if (my_res != NULL && ! my_res->closed) {
+		luaM_free_result(L, my_res);
 	}
+    return 0;
+}
 
-	if (pgsql_row >= PQntuples(my_res->res)) {
-		lua_pushfstring(L, "Unable to jump to row %d on PostgreSQL!", pgsql_row);
-		return 1;
-	}
+static int Lpg_lo_create (lua_State *L) {
+	Oid pgsql_oid;
 
-	lua_pushstring(L, field);
-	if (lua_isnumber(L, -1)) {
-		field_offset = atoi(field);		
-	} else {
-		field_offset = PQfnumber(my_res->res, field);
-	}
-	
-	if (field_offset < 0 || field_offset >= PQnfields(my_res->res)) {
-		lua_pushstring(L, "Bad column offset specified");
-		return 1;
-	}
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-    switch (entry_type) {
-        case LUA_PG_DATA_LENGTH:
-            lua_pushnumber(L, PQgetlength(my_res->res, pgsql_row, field_offset));
-            break;
-        case LUA_PG_DATA_ISNULL:
-            lua_pushnumber(L, PQgetisnull(my_res->res, pgsql_row, field_offset));
-            break;
-        case LUA_PG_DATA_RESULT:
-			if (PQgetisnull(my_res->res, pgsql_row, field_offset)) {
-				lua_pushnil(L);
-			} else {
-				char *value = PQgetvalue(my_res->res, pgsql_row, field_offset);
-				int value_len = PQgetlength(my_res->res, pgsql_row, field_offset);
-				luaM_pushvalue(L, value, value_len);
-			}
-			break;
+    if ((pgsql_oid = lo_creat(my_conn->conn, INV_READ|INV_WRITE)) == InvalidOid) {
+		lua_pushboolean(L, 0);
+        lua_pushfstring(L, "Unable to create PostgreSQL large object");
+		return 2;
     }
 
-    return 1;
-}
-
-static int Lpg_field_is_null (lua_State *L) {
-	return Lpg_data_info(L, LUA_PG_DATA_ISNULL);
-}
-
-static int Lpg_field_prtlen(lua_State *L) {
-	return Lpg_data_info(L, LUA_PG_DATA_LENGTH);
+	lua_pushnumber(L, pgsql_oid);
+	return 1;
 }
 
-static int Lpg_do_fetch(lua_State *L, int result_type) {
-	int	i, num_fields;
-    char            *element, *field_name;
-    uint            element_len;
-	lua_pg_res *my_res = Mget_res (L);
-
-    if ( ! result_type) {
-		result_type = PGSQL_BOTH;
-    }
+static int Lpg_lo_unlink (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	long oid = luaL_checknumber (L, 2);
 
-	/* use internal row counter to access next row */
-	if (my_res->row >= PQntuples(my_res->res)) {
+	if (lo_unlink(my_conn->conn, oid) == -1) {
 		lua_pushboolean(L, 0);
+		lua_pushfstring(L, "Unable to delete PostgreSQL large object %u", oid);
 		return 1;
 	}
 
-	lua_newtable (L); /* result */
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-    for (i = 0, num_fields = PQnfields(my_res->res); i < num_fields; i++) {
-        if (PQgetisnull(my_res->res, my_res->row, i)) {
-			if (result_type & PGSQL_NUM) {
-				lua_pushstring (L, ""); //lua_pushnil (L); if use pushnil, it'll loss the all key-value
-				lua_rawseti (L, -2, i);
-			}
-			if (result_type & PGSQL_ASSOC) {
-				field_name = PQfname(my_res->res, i);
-				lua_pushstring(L, field_name);
-				lua_pushstring (L, "");
-				lua_rawset (L, -3);
-			}
-        } else {
-            element = PQgetvalue(my_res->res, my_res->row, i);
-            element_len = (element ? strlen(element) : 0);
+static int Lpg_lo_open (lua_State *L) {
+	int pgsql_mode = 0, pgsql_lofd;
+	int create=0;
 
-			if (element) {
-				if (result_type & PGSQL_NUM) {
-					lua_pushstring(L, element);
-					lua_rawseti (L, -2, i);
-				}
-				if (result_type & PGSQL_ASSOC) {
-					field_name = PQfname(my_res->res, i);
-					lua_pushstring(L, field_name);
-					luaM_pushvalue(L, element, element_len);
-					lua_rawset (L, -3);
-				}
-			}
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+	long oid = luaL_checknumber (L, 2);
+	const char *mode_string = luaL_checkstring (L, 3);
+
+    if (strchr(mode_string, 'r') == mode_string) {
+        pgsql_mode |= INV_READ;
+        if (strchr(mode_string, '+') == mode_string+1) {
+            pgsql_mode |= INV_WRITE;
+        }
+    }
+    if (strchr(mode_string, 'w') == mode_string) {
+        pgsql_mode |= INV_WRITE;
+        create = 1;
+        if (strchr(mode_string, '+') == mode_string+1) {
+            pgsql_mode |= INV_READ;
         }
     }
 
-	my_res->row++;
+    if ((pgsql_lofd = lo_open(my_conn->conn, oid, pgsql_mode)) == -1) {
+        if (create) {
+            if ((oid = lo_creat(my_conn->conn, INV_READ|INV_WRITE)) == 0) {
+				lua_pushboolean(L, 0);
+                lua_pushfstring(L, "Unable to create PostgreSQL large object");
+				return 2;
+            } else {
+                if ((pgsql_lofd = lo_open(my_conn->conn, oid, pgsql_mode)) == -1) {
+                    if (lo_unlink(my_conn->conn, oid) == -1) {
+						lua_pushboolean(L, 0);
+                        lua_pushfstring(L, "Something is really messed up! Your database is badly corrupted in a way NOT related to LUA");
+						return 2;
+                    }
+					lua_pushboolean(L, 0);
+                    lua_pushfstring(L, "Unable to open PostgreSQL large object");
+					return 2;
+                } else {
+					my_conn->lofd = pgsql_lofd;
+					lua_pushnumber(L, pgsql_lofd);
+                }
+            }
+        } else {
+			lua_pushboolean(L, 0);
+            lua_pushfstring(L, "Unable to open PostgreSQL large object");
+			return 2;
+        }
+    } else {
+		my_conn->lofd = pgsql_lofd;
+		lua_pushnumber(L, pgsql_lofd);
+    }
 
 	return 1;
 }
 
-static int Lpg_fetch_row (lua_State *L) {
-    return Lpg_do_fetch(L, PGSQL_NUM);
-}
-
-static int Lpg_fetch_assoc (lua_State *L) {
-    return Lpg_do_fetch(L, PGSQL_ASSOC);
-}
-
-static int Lpg_fetch_array (lua_State *L) {
-    const char *result_type = luaL_optstring (L, 2, "PGSQL_BOTH");
-    return Lpg_do_fetch(L, luaM_const(L, result_type));
-}
-
-static int Lpg_fetch_result (lua_State *L) {
-	return Lpg_data_info(L, LUA_PG_DATA_RESULT);
-}
-
-
-static int Lpg_get_result (lua_State *L) {
-    PGresult *res;
+static int Lpg_lo_close (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-    lua_pg_conn *my_conn = Mget_conn (L);
+	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
 
-    res = PQgetResult(my_conn->conn);
-    if ( ! res) {
-        /* no result */
+	if (lo_close(my_conn->conn, lofd) < 0) {
 		lua_pushboolean(L, 0);
+		lua_pushfstring(L, "Unable to close PostgreSQL large object descriptor %d", lofd);
 		return 1;
-    }
+	}
 
-	lua_pg_res *my_res = (lua_pg_res *)lua_newuserdata(L, sizeof(lua_pg_res));
-	luaM_setmeta (L, LUA_PGSQL_RES);
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-	/* fill in structure */
-	my_res->closed = 0;
-	my_res->row = 0;
-	my_res->conn = LUA_NOREF;
-	my_res->numcols = PQnfields(res);
-	my_res->res = res;
+static int Lpg_lo_read (lua_State *L) {
+	char *buf;
+	int nbytes;
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-	lua_pushvalue(L, 1);
+	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
+	int buf_len = luaL_optnumber(L, 3, PGSQL_LO_READ_BUF_SIZE);
 
-	my_res->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	luaL_argcheck(L, buf_len > 0, 3, "length must be positive");
+	/* collected with the userdata, one round trip whatever the size */
+	buf = (char *)lua_newuserdata(L, buf_len);
+
+	if ((nbytes = lo_read(my_conn->conn, lofd, buf, buf_len)) < 0) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
 
+	luaM_pushvalue(L, buf, nbytes);
 	return 1;
 }
 
-static int Lpg_do_fetch_all (lua_State *L, lua_pg_res *my_res) {
+/**
+* Write the string at index 3, or its first len bytes.
+*/
+static int Lpg_lo_write (lua_State *L) {
+	int nbytes;
+	size_t len;
 
-    char *field_name, *element;
-    size_t num_fields, element_len;
-    int pg_numrows, pg_row;
-    uint i;
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-	//lua_pg_res *my_res = Mget_res (L);
+	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
+	const char *str = luaL_checklstring(L, 3, &len);
+	double max = luaL_optnumber(L, 4, (double)len);
 
-    if ((pg_numrows = PQntuples(my_res->res)) <= 0) {
+	if (max >= 0 && max < len) {
+		len = (size_t)max;
+	}
+
+	if ((nbytes = lo_write(my_conn->conn, lofd, str, len)) == -1) {
 		lua_pushboolean(L, 0);
 		return 1;
-    }
+	}
 
+	lua_pushnumber(L, nbytes);
+	return 1;
+}
 
-	lua_newtable(L); /* result */
+/**
+* Read from the current position to the end, by chunks of
+* PGSQL_LO_CHUNK_SIZE appended to a luaL_Buffer. Returns the number of
+* bytes read and the data.
+*/
+static int Lpg_lo_read_all (lua_State *L) {
+	int nbytes;
+	double tbytes = 0;
+	char *buf;
+	luaL_Buffer b;
 
-    for (pg_row = 0; pg_row < pg_numrows; pg_row++) {
-		
-		lua_newtable(L); /* row result */
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-        for (i = 0, num_fields = PQnfields(my_res->res); i < num_fields; i++) {
+	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
 
-            if (PQgetisnull(my_res->res, pg_row, i)) {
-                field_name = PQfname(my_res->res, i);
-				lua_pushstring(L, field_name);
-				lua_pushstring (L, "");
-				lua_rawset (L, -3);
-            } else {
+	buf = (char *)lua_newuserdata(L, PGSQL_LO_CHUNK_SIZE);
+	luaL_buffinit(L, &b);
+	while ((nbytes = lo_read(my_conn->conn, lofd, buf, PGSQL_LO_CHUNK_SIZE)) > 0) {
+		luaL_addlstring(&b, buf, nbytes);
+		tbytes += nbytes;
+	}
+	if (nbytes < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		return 2;
+	}
+	luaL_pushresult(&b);
 
-                element = PQgetvalue(my_res->res, pg_row, i);
-				element_len = (element ? strlen(element) : 0);
+	lua_pushnumber(L, tbytes);
+	lua_insert(L, -2);
+	return 2;
+}
 
-				if (element) {
-					field_name = PQfname(my_res->res, i);
-					lua_pushstring(L, field_name);
-					luaM_pushvalue(L, element, element_len);
-					lua_rawset (L, -3);
-				}
-            }
-        }
-		lua_rawseti (L, -2, pg_row);
-    }
+static int Lpg_lo_chunks_next (lua_State *L) {
+	lua_pg_conn *my_conn = (lua_pg_conn *)lua_touserdata(L, lua_upvalueindex(1));
+	int lofd = (int)lua_tonumber(L, lua_upvalueindex(2));
+	int size = (int)lua_tonumber(L, lua_upvalueindex(3));
+	char *buf = (char *)lua_touserdata(L, lua_upvalueindex(4));
+	int nbytes;
 
+	if (my_conn->closed) {
+		return luaL_error(L, "connection is closed");
+	}
+	if ((nbytes = lo_read(my_conn->conn, lofd, buf, size)) < 0) {
+		return luaL_error(L, "%s", PQerrorMessage(my_conn->conn));
+	}
+	if (nbytes == 0) {
+		return 0;
+	}
+	lua_pushlstring(L, buf, nbytes);
 	return 1;
 }
 
-static int Lpg_fetch_all (lua_State *L) {
-	lua_pg_res *my_res = Mget_res (L);
-	return Lpg_do_fetch_all(L, my_res);
-}
+/**
+* Iterator over the rest of a large object, chunk_size bytes at a time,
+* so a big object never has to fit in memory.
+*/
+static int Lpg_lo_chunks (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-static int Lpg_fetch_all_columns (lua_State *L) {
+	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
+	int size = luaL_optnumber(L, 3, PGSQL_LO_CHUNK_SIZE);
 
-    char *element;
-    size_t num_fields, element_len;
-    int pg_numrows, pg_row;
+	luaL_argcheck(L, size > 0, 3, "chunk size must be positive");
+	lua_pushvalue(L, 1);
+	lua_pushnumber(L, lofd);
+	lua_pushnumber(L, size);
+	lua_newuserdata(L, size);
+	lua_pushcclosure(L, Lpg_lo_chunks_next, 4);
+	return 1;
+}
 
-	lua_pg_res *my_res = Mget_res (L);
+/**
+* Read `length' bytes (or up to the end) from `offset' of a large object
+* on the server side, with lo_get(), in one round trip and without
+* opening it.
+*/
+static int Lpg_lo_get (lua_State *L) {
+	PGresult *res;
+	char oid[32], offset[32], length[32];
+	const char *params[3] = { oid, offset, length };
+	int num_params = 1;
 
-    long colno = luaL_optnumber(L, 2, 0);
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-    if ((pg_numrows = PQntuples(my_res->res)) <= 0) {
+	snprintf(oid, sizeof(oid), "%.0f", luaL_checknumber(L, 2));
+	if ( ! lua_isnoneornil(L, 3) || ! lua_isnoneornil(L, 4)) {
+		snprintf(offset, sizeof(offset), "%.0f", luaL_optnumber(L, 3, 0));
+		snprintf(length, sizeof(length), "%.0f", luaL_optnumber(L, 4, 2147483647.0));
+		num_params = 3;
+	}
+
+	res = PQexecParams(my_conn->conn, num_params == 1 ? "select lo_get($1)" : "select lo_get($1, $2, $3)",
+			num_params, NULL, params, NULL, NULL, 1);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		lua_pushboolean(L, 0);
-		return 1;
-    }
+		lua_pushstring(L, res ? PQresultErrorMessage(res) : PQerrorMessage(my_conn->conn));
+		PQclear(res);
+		return 2;
+	}
 
-	num_fields = PQnfields(my_res->res);
+	lua_pushlstring(L, PQgetvalue(res, 0, 0), PQgetlength(res, 0, 0));
+	PQclear(res);
+	return 1;
+}
 
-    if (colno >= num_fields || colno < 0) {
+static int Lpg_lo_import (lua_State *L) {
+	Oid oid;
+
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+
+	const char *file_in = luaL_checkstring(L, 2);
+
+	oid = lo_import(my_conn->conn, file_in);
+	
+	if (oid == InvalidOid) {
 		lua_pushboolean(L, 0);
-		lua_pushfstring(L, "Invalid column number '%ld'", colno);
-		return 2;
-    }
+		return 1;
+	}
 
-	lua_newtable(L); /* result */
+	lua_pushnumber(L, oid);
+	return 1;
+}
 
-    for (pg_row = 0; pg_row < pg_numrows; pg_row++) {
-		
-		if (PQgetisnull(my_res->res, pg_row, colno)) {
-			lua_pushstring (L, "");
-			lua_rawseti (L, -2, pg_row);
-		} else {
+static int Lpg_lo_export (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-			element = PQgetvalue(my_res->res, pg_row, colno);
-			element_len = (element ? strlen(element) : 0);
+	Oid oid = luaL_checknumber(L, 2);
+	const char *file_out = luaL_checkstring(L, 3);
 
-			if (element) {
-				luaM_pushvalue(L, element, element_len);
-				lua_rawseti (L, -2, pg_row);
-			}
-		}
-    }
+	if (lo_export(my_conn->conn, oid, file_out)) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
 
+	lua_pushboolean(L, 0);
 	return 1;
 }
 
-static int Lpg_last_oid (lua_State *L) {
-	Oid oid;
+/* SEEK_* of the PGSQL_SEEK_* name at index `arg', SEEK_SET by default */
+static int luaM_whence (lua_State *L, int arg) {
+	const char *name = luaL_optstring(L, arg, "PGSQL_SEEK_SET");
 
-    lua_pg_res *my_res = Mget_res (L);
+	if (strcmp(name, "PGSQL_SEEK_SET") == 0
+			|| strcmp(name, "PGSQL_SEEK_CUR") == 0
+			|| strcmp(name, "PGSQL_SEEK_END") == 0) {
+		return luaM_const(L, name);
+	}
+	return luaL_argerror(L, arg, lua_pushfstring(L, "invalid whence '%s'", name));
+}
 
-    oid = PQoidValue(my_res->res); // = (char *) PQoidStatus(my_res->res);
-    if (oid == InvalidOid) {
+/**
+* Move to a 64-bit offset, returning the new position or FALSE.
+*/
+static int Lpg_lo_seek (lua_State *L) {
+	pg_int64 pos;
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+
+	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
+	pg_int64 offset = (pg_int64)luaL_optnumber(L, 3, 0);
+	int whence = luaM_whence(L, 4);
+
+	if ((pos = lo_lseek64(my_conn->conn, lofd, offset, whence)) > -1) {
+		lua_pushnumber(L, (lua_Number)pos);
+	}
+	else {
 		lua_pushboolean(L, 0);
-    }
-    lua_pushnumber(L, oid);
-    return 1;
-}
+	}
 
-static int Lpg_result_error (lua_State *L) {
-	lua_pushstring(L, (char *)PQresultErrorMessage(Mget_res (L)->res));
-    return 1;
+	return 1;
 }
 
-static int Lpg_result_seek (lua_State *L) {
-	lua_pg_res *my_res = Mget_res (L);
+static int Lpg_lo_tell (lua_State *L) {
+	pg_int64 offset = 0;
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
 
-    lua_Number row = luaL_optnumber(L, 2, -1);
+	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
 
+	offset = lo_tell64(my_conn->conn, lofd);
+	lua_pushnumber(L, (lua_Number)offset);
 
-    if (row < 0 || row >= PQntuples(my_res->res)) {
-		lua_pushboolean(L, 0);
-		return 1;
-    }
+	return 1;
+}
 
-    /* seek to offset */
-    my_res->row = row;
+static int Lpg_lo_truncate (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_idle_conn (L);
+
+	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
+	pg_int64 len = (pg_int64)luaL_checknumber(L, 3);
+
+	if (lo_truncate64(my_conn->conn, lofd, len) < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, PQerrorMessage(my_conn->conn));
+		return 2;
+	}
 
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int Lpg_result_status (lua_State *L) {
-	lua_pg_res *my_res = Mget_res (L);
+/**
+* Pool Part
+*/
 
-    const char *result_type_str = luaL_optstring(L, 2, "PGSQL_STATUS_LONG");
+#ifdef WIN32
+#define luaM_pool_lock(pool)
+#define luaM_pool_unlock(pool)
+#define luaM_pool_signal(pool)
+#else
+#define luaM_pool_lock(pool)    pthread_mutex_lock(&(pool)->mutex)
+#define luaM_pool_unlock(pool)  pthread_mutex_unlock(&(pool)->mutex)
+#define luaM_pool_signal(pool)  pthread_cond_signal(&(pool)->cond)
+#endif
 
-    long result_type = luaM_const(L, result_type_str);
-    ExecStatusType status;
+/**
+* Take the idle connections of `pool' unused for idle_timeout seconds,
+* beyond the min ones, off the idle list. Called with the pool locked,
+* the returned list is to be closed once it is unlocked.
+*/
+static lua_pg_pooled *luaM_pool_reap (lua_pg_pool *pool, double now) {
+	lua_pg_pooled **p = &pool->idles, *reaped = NULL, *entry;
 
-    if (result_type == PGSQL_STATUS_LONG) {
-        status = PQresultStatus(my_res->res);
-		lua_pushnumber(L, status);
-		return 1;
-    }
-    else if (result_type == PGSQL_STATUS_STRING) { lua_pushstring(L, PQcmdStatus(my_res->res));
-		return 1;
-    }
-    else {
-        lua_pushfstring(L, "Optional 1th parameter should be PGSQL_STATUS_LONG or PGSQL_STATUS_STRING");
-		return 1;
-    }
+	if (pool->idle_timeout <= 0) {
+		return NULL;
+	}
+	while (*p != NULL && pool->open > pool->min) {
+		entry = *p;
+		if (now - entry->idle_since >= pool->idle_timeout) {
+			*p = entry->next;
+			entry->next = reaped;
+			reaped = entry;
+			pool->open--;
+			pool->idle--;
+			pool->reaped++;
+		} else {
+			p = &entry->next;
+		}
+	}
+	return reaped;
 }
 
-static int Lpg_result_error_field (lua_State *L) {
-    char *field = NULL;
-	lua_pg_res *my_res = Mget_res (L);
+static void luaM_pool_free_list (lua_pg_pooled *entry) {
+	lua_pg_pooled *next;
 
-    long fieldcode = luaL_optnumber(L, 2, -1);
+	for (; entry != NULL; entry = next) {
+		next = entry->next;
+		if (entry->stmts != NULL) {
+			luaM_stmt_clear(entry->conn, entry->stmts, 0);
+			free(entry->stmts->buckets);
+			free(entry->stmts);
+		}
+		PQfinish(entry->conn);
+		free(entry);
+	}
+}
 
-    if ( ! my_res->res) {
-		lua_pushboolean(L, 0);
-		return 1;
-    }
+/**
+* Give the connection of `my_conn' back to its pool, in a clean state:
+* a running query is cancelled, an open transaction rolled back and a
+* dirty session discarded. A broken connection is closed instead.
+*/
+static void luaM_pool_release (lua_pg_conn *my_conn) {
+	lua_pg_pool *pool = my_conn->pool;
+	PGconn *conn = my_conn->conn;
+	lua_pg_pooled *entry = NULL;
+	int discarded = 0;
+
+	if (PQstatus(conn) == CONNECTION_OK && PQisBusy(conn)) {
+		luaM_cancel(conn);
+	}
+	luaM_drain(conn, NULL);
+	if (PQstatus(conn) == CONNECTION_OK && PQtransactionStatus(conn) != PQTRANS_IDLE) {
+		PQclear(PQexec(conn, "ROLLBACK"));
+	}
+	if (my_conn->dirty && PQstatus(conn) == CONNECTION_OK) {
+		PQclear(PQexec(conn, "DISCARD ALL"));
+		discarded = 1;
+		if (my_conn->stmts != NULL) {
+			luaM_stmt_clear(conn, my_conn->stmts, 0);
+		}
+	}
 
-    if (fieldcode & (PG_DIAG_SEVERITY|PG_DIAG_SQLSTATE|PG_DIAG_MESSAGE_PRIMARY|PG_DIAG_MESSAGE_DETAIL
-                |PG_DIAG_MESSAGE_HINT|PG_DIAG_STATEMENT_POSITION
-                |PG_DIAG_INTERNAL_POSITION
-                |PG_DIAG_INTERNAL_QUERY
-                |PG_DIAG_CONTEXT|PG_DIAG_SOURCE_FILE|PG_DIAG_SOURCE_LINE
-                |PG_DIAG_SOURCE_FUNCTION)) {
-        field = (char *)PQresultErrorField(my_res->res, fieldcode);
-        if (field == NULL) {
-			lua_pushnil(L);
-        } else {
-            lua_pushstring(L, field);
-        }
-    } else {
-		lua_pushboolean(L, 0);
-    }
-	return 1;
+	if (PQstatus(conn) == CONNECTION_OK && PQtransactionStatus(conn) == PQTRANS_IDLE) {
+		entry = (lua_pg_pooled *)malloc(sizeof(lua_pg_pooled));
+	}
+	if (entry == NULL) {
+		luaM_stmt_free(my_conn, 0);
+		PQfinish(conn);
+		luaM_pool_lock(pool);
+		pool->open--;
+	} else {
+		entry->conn = conn;
+		entry->stmts = my_conn->stmts;
+		entry->idle_since = luaM_now();
+		luaM_pool_lock(pool);
+		entry->next = pool->idles;
+		pool->idles = entry;
+		pool->idle++;
+	}
+	pool->discards += discarded;
+	luaM_pool_signal(pool);
+	luaM_pool_unlock(pool);
+
+	my_conn->stmts = NULL;
+	my_conn->pool = NULL;
 }
 
-static int Lpg_free_result (lua_State *L) {
-    lua_pg_res *my_res = (lua_pg_res *)luaL_checkudata (L, 1, LUA_PGSQL_RES);
-    luaL_argcheck (L, my_res != NULL, 1, "result expected");
-    if (my_res->closed) {
+/**
+* Finish the libpq connection of a connection object.
+*/
+static void luaM_close_conn (lua_State *L, lua_pg_conn *my_conn) {
+    my_conn->closed = 1;
+    luaL_unref (L, LUA_REGISTRYINDEX, my_conn->env);
+    luaL_unref (L, LUA_REGISTRYINDEX, my_conn->field_class);
+	luaL_unref (L, LUA_REGISTRYINDEX, my_conn->notify);
+	my_conn->notify = LUA_NOREF;
+    my_conn->env = LUA_NOREF;
+    my_conn->field_class = LUA_NOREF;
+	luaM_untrace(my_conn);
+	luaM_waitset_forget(L, my_conn);
+	my_conn->stream = NULL;
+	if (my_conn->pool != NULL) {
+		luaM_pool_release(my_conn);
+	} else {
+		luaM_stmt_free(my_conn, 0);
+		PQfinish (my_conn->conn);
+	}
+	luaM_params_free(&my_conn->params);
+	luaM_desc_free_all(L, my_conn);
+	luaM_latency_free(my_conn->latency);
+	my_conn->latency = NULL;
+	luaL_unref (L, LUA_REGISTRYINDEX, my_conn->on_slow);
+	my_conn->on_slow = LUA_NOREF;
+	my_conn->conn = NULL;
+	luaM_count(live_conns, -1);
+}
+
+/**
+* Close PgSQL connection
+*/
+static int Lpg_close (lua_State *L) {
+    lua_pg_conn *my_conn = Mget_conn (L);
+    luaL_argcheck (L, my_conn != NULL, 1, "connection expected");
+    if (my_conn->closed) {
         lua_pushboolean (L, 0);
         return 1;
     }
 
-    /* Nullify structure fields. */
-    my_res->closed = 1;
-    luaL_unref (L, LUA_REGISTRYINDEX, my_res->conn);
-    luaL_unref (L, LUA_REGISTRYINDEX, my_res->row);
+	luaM_close_conn(L, my_conn);
+    lua_pushboolean (L, 1);
+    return 1;
+}
+
+static int Lpg_conn_gc (lua_State *L) {
+    lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 1, LUA_PGSQL_CONN);
+    if (my_conn != NULL && ! my_conn->closed) {
+		luaM_close_conn(L, my_conn);
+	}
+	/* kept past db:close() for db:trace_events() */
+	if (my_conn != NULL) {
+		free(my_conn->ring);
+		my_conn->ring = NULL;
+	}
+    return 0;
+}
 
-    lua_pushboolean (L, 1);
+static int Lpg_stream_gc (lua_State *L) {
+	luaM_stream_close(L, Mget_stream (L), 1);
+	return 0;
+}
 
-    return 1;
+static lua_pg_pool *Mget_pool (lua_State *L) {
+	lua_pg_pool **my_pool = (lua_pg_pool **)luaL_checkudata (L, 1, LUA_PGSQL_POOL);
+	luaL_argcheck (L, my_pool != NULL, 1, "pool expected");
+	return *my_pool;
 }
 
-static int Lpg_lo_create (lua_State *L) {
-	Oid pgsql_oid;
+static int luaM_opt_number (lua_State *L, int idx, const char *name, double def, double *value) {
+	lua_getfield(L, idx, name);
+	*value = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : def;
+	lua_pop(L, 1);
+	return *value >= 0;
+}
 
-    lua_pg_conn *my_conn = Mget_conn (L);
+/* the pool of `conninfo', NULL if none. Called with luaM_lock held */
+static lua_pg_pool *luaM_pool_find (const char *conninfo) {
+	lua_pg_pool *pool;
 
-    if ((pgsql_oid = lo_creat(my_conn->conn, INV_READ|INV_WRITE)) == InvalidOid) {
-		lua_pushboolean(L, 0);
-        lua_pushfstring(L, "Unable to create PostgreSQL large object");
-		return 2;
-    }
+	for (pool = pools; pool != NULL; pool = pool->next) {
+		if (strcmp(pool->conninfo, conninfo) == 0) {
+			break;
+		}
+	}
+	return pool;
+}
 
-	lua_pushnumber(L, pgsql_oid);
-	return 1;
+/* free a pool that was never published in `pools' */
+static void luaM_pool_free (lua_pg_pool *pool) {
+	luaM_pool_free_list(pool->idles);
+#ifndef WIN32
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+#endif
+	free(pool->conninfo);
+	free(pool);
 }
 
-static int Lpg_lo_unlink (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
-	long oid = luaL_checknumber (L, 2);
+/**
+* pgsql.pool{conninfo=..., min=..., max=..., idle_timeout=...} returns
+* the pool of `conninfo', creating it, and its min connections, on
+* first use. Later calls share the same connections whatever their
+* limits. The connections are opened without luaM_lock, and the pool
+* is only published once they all are.
+*/
+static int Lpg_pool (lua_State *L) {
+	lua_pg_pool *pool, *found;
+	lua_pg_pool **my_pool;
+	const char *conninfo;
+	double min, max, idle_timeout;
+	PGconn *conn;
+	lua_pg_pooled *entry;
+	int i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "conninfo");
+	conninfo = luaL_optstring(L, -1, "dbname = postgres");
+	if ( ! luaM_opt_number(L, 1, "min", 0, &min) || ! luaM_opt_number(L, 1, "max", 10, &max)
+			|| ! luaM_opt_number(L, 1, "idle_timeout", 60, &idle_timeout) || max < 1 || min > max) {
+		return luaL_argerror(L, 1, "invalid pool limits");
+	}
 
-	if (lo_unlink(my_conn->conn, oid) == -1) {
+	luaM_lock();
+	pool = luaM_pool_find(conninfo);
+	luaM_unlock();
+
+	if (pool == NULL && (pool = (lua_pg_pool *)calloc(1, sizeof(lua_pg_pool))) != NULL) {
+		if ((pool->conninfo = strdup(conninfo)) == NULL) {
+			free(pool);
+			pool = NULL;
+		} else {
+			pool->min = (int)min;
+			pool->max = (int)max;
+			pool->idle_timeout = idle_timeout;
+#ifndef WIN32
+			pthread_mutex_init(&pool->mutex, NULL);
+			pthread_cond_init(&pool->cond, NULL);
+#endif
+
+			/* fill it up to min, failing on the first error */
+			for (i = 0; i < pool->min; i++) {
+				conn = PQconnectdb(conninfo);
+				if (PQstatus(conn) != CONNECTION_OK
+						|| (entry = (lua_pg_pooled *)malloc(sizeof(lua_pg_pooled))) == NULL) {
+					lua_pushboolean(L, 0);
+					lua_pushstring(L, conn ? PQerrorMessage(conn) : "Unable to connect to PostgreSQL server");
+					PQfinish(conn);
+					luaM_pool_free(pool);
+					return 2;
+				}
+				entry->conn = conn;
+				entry->stmts = NULL;
+				entry->idle_since = luaM_now();
+				entry->next = pool->idles;
+				pool->idles = entry;
+				pool->idle++;
+				pool->open++;
+				pool->creations++;
+			}
+
+			/* another lua_State may have created it meanwhile */
+			luaM_lock();
+			if ((found = luaM_pool_find(conninfo)) == NULL) {
+				pool->next = pools;
+				pools = pool;
+			}
+			luaM_unlock();
+			if (found != NULL) {
+				luaM_pool_free(pool);
+				pool = found;
+			}
+		}
+	}
+
+	if (pool == NULL) {
 		lua_pushboolean(L, 0);
-		lua_pushfstring(L, "Unable to delete PostgreSQL large object %u", oid);
-		return 1;
+		lua_pushstring(L, "Cannot allocate the pool");
+		return 2;
 	}
 
-	lua_pushboolean(L, 1);
+	my_pool = (lua_pg_pool **)lua_newuserdata(L, sizeof(lua_pg_pool *));
+	luaM_setmeta (L, LUA_PGSQL_POOL);
+	*my_pool = pool;
 	return 1;
 }
 
-static int Lpg_lo_open (lua_State *L) {
-	int pgsql_mode = 0, pgsql_lofd;
-	int create=0;
-
-    lua_pg_conn *my_conn = Mget_conn (L);
-	long oid = luaL_checknumber (L, 2);
-	const char *mode_string = luaL_checkstring (L, 3);
+/**
+* Check a connection out of the pool: an idle one that still looks
+* healthy, or a new one while less than max are open. Otherwise wait up
+* to `timeout' seconds (default 0) for one to be checked in.
+*/
+static int Lpg_pool_checkout (lua_State *L) {
+	lua_pg_pool *pool = Mget_pool (L);
+	double timeout = luaL_optnumber(L, 2, 0);
+	lua_pg_pooled *entry, *reaped;
+	lua_pg_conn *my_conn;
+	PGconn *conn = NULL;
+	lua_pg_stmt_cache *stmts = NULL;
+	int waited = 0;
+#ifndef WIN32
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += (time_t)timeout;
+	deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+#endif
 
-    if (strchr(mode_string, 'r') == mode_string) {
-        pgsql_mode |= INV_READ;
-        if (strchr(mode_string, '+') == mode_string+1) {
-            pgsql_mode |= INV_WRITE;
-        }
-    }
-    if (strchr(mode_string, 'w') == mode_string) {
-        pgsql_mode |= INV_WRITE;
-        create = 1;
-        if (strchr(mode_string, '+') == mode_string+1) {
-            pgsql_mode |= INV_READ;
-        }
-    }
+	luaM_pool_lock(pool);
+	reaped = luaM_pool_reap(pool, luaM_now());
+	while (conn == NULL) {
+		if ((entry = pool->idles) != NULL) {
+			pool->idles = entry->next;
+			pool->idle--;
+			luaM_pool_unlock(pool);
+			conn = entry->conn;
+			stmts = entry->stmts;
+			free(entry);
+
+			/* no round trip: read what the server may have sent, a closed socket included */
+			if ( ! PQconsumeInput(conn) || PQstatus(conn) != CONNECTION_OK
+					|| PQtransactionStatus(conn) != PQTRANS_IDLE) {
+				if (stmts != NULL) {
+					luaM_stmt_clear(conn, stmts, 0);
+					free(stmts->buckets);
+					free(stmts);
+					stmts = NULL;
+				}
+				PQfinish(conn);
+				conn = NULL;
+				luaM_pool_lock(pool);
+				pool->open--;
+				pool->broken++;
+			}
+		} else if (pool->open < pool->max) {
+			pool->open++;
+			pool->creations++;
+			luaM_pool_unlock(pool);
 
-    if ((pgsql_lofd = lo_open(my_conn->conn, oid, pgsql_mode)) == -1) {
-        if (create) {
-            if ((oid = lo_creat(my_conn->conn, INV_READ|INV_WRITE)) == 0) {
+			conn = PQconnectdb(pool->conninfo);
+			if (PQstatus(conn) != CONNECTION_OK) {
 				lua_pushboolean(L, 0);
-                lua_pushfstring(L, "Unable to create PostgreSQL large object");
+				lua_pushstring(L, conn ? PQerrorMessage(conn) : "Unable to connect to PostgreSQL server");
+				PQfinish(conn);
+				luaM_pool_lock(pool);
+				pool->open--;
+				luaM_pool_signal(pool);
+				luaM_pool_unlock(pool);
+				luaM_pool_free_list(reaped);
 				return 2;
-            } else {
-                if ((pgsql_lofd = lo_open(my_conn->conn, oid, pgsql_mode)) == -1) {
-                    if (lo_unlink(my_conn->conn, oid) == -1) {
-						lua_pushboolean(L, 0);
-                        lua_pushfstring(L, "Something is really messed up! Your database is badly corrupted in a way NOT related to LUA");
-						return 2;
-                    }
-					lua_pushboolean(L, 0);
-                    lua_pushfstring(L, "Unable to open PostgreSQL large object");
-					return 2;
-                } else {
-					my_conn->lofd = pgsql_lofd;
-					lua_pushnumber(L, pgsql_lofd);
-                }
-            }
-        } else {
+			}
+		} else {
+			if ( ! waited) {
+				pool->waits++;
+				waited = 1;
+			}
+#ifndef WIN32
+			if (timeout > 0 && pthread_cond_timedwait(&pool->cond, &pool->mutex, &deadline) == 0) {
+				continue;
+			}
+#endif
+			pool->timeouts++;
+			luaM_pool_unlock(pool);
+			luaM_pool_free_list(reaped);
 			lua_pushboolean(L, 0);
-            lua_pushfstring(L, "Unable to open PostgreSQL large object");
+			lua_pushstring(L, "Timed out waiting for a pool connection");
 			return 2;
-        }
-    } else {
-		my_conn->lofd = pgsql_lofd;
-		lua_pushnumber(L, pgsql_lofd);
-    }
+		}
+	}
+	luaM_pool_free_list(reaped);
 
+	my_conn = Mnew_conn (L, conn);
+	my_conn->pool = pool;
+	my_conn->stmts = stmts;
 	return 1;
 }
 
-static int Lpg_lo_close (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
-
-	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
+/**
+* Return a connection to the pool it was checked out of. `discard'
+* forces a DISCARD ALL when the session was changed in a way the
+* driver cannot see.
+*/
+static int Lpg_pool_checkin (lua_State *L) {
+	lua_pg_pool *pool = Mget_pool (L);
+	lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 2, LUA_PGSQL_CONN);
 
-	if (lo_close(my_conn->conn, lofd) < 0) {
+	luaL_argcheck (L, ! my_conn->closed, 2, "connection is closed");
+	luaL_argcheck (L, ! my_conn->in_hook, 2, "connection in use by its slow query function");
+	if (my_conn->pool != pool) {
 		lua_pushboolean(L, 0);
-		lua_pushfstring(L, "Unable to close PostgreSQL large object descriptor %d", lofd);
-		return 1;
+		lua_pushstring(L, "Connection does not belong to this pool");
+		return 2;
 	}
+	my_conn->dirty = my_conn->dirty || lua_toboolean(L, 3);
+	luaM_close_conn(L, my_conn);
 
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int Lpg_lo_read (lua_State *L) {
-	char *buf;
-	int nbytes;
-    lua_pg_conn *my_conn = Mget_conn (L);
-
-	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
-	int buf_len = luaL_optnumber(L, 3, PGSQL_LO_READ_BUF_SIZE);
+/* close idle connections past idle_timeout now */
+static int Lpg_pool_reap (lua_State *L) {
+	lua_pg_pool *pool = Mget_pool (L);
+	lua_pg_pooled *reaped;
 
-	buf = (char *) safe_emalloc(sizeof(char), (buf_len+1), 0);
+	luaM_pool_lock(pool);
+	reaped = luaM_pool_reap(pool, luaM_now());
+	luaM_pool_unlock(pool);
+	luaM_pool_free_list(reaped);
 
-	if ((nbytes = lo_read(my_conn->conn, lofd, buf, buf_len)) < 0) {
-		lua_pushboolean(L, 0);
-		return 1;
-	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-	buf[nbytes] = '\0';
-	luaM_pushvalue(L, buf, nbytes);
+static int Lpg_pool_stats (lua_State *L) {
+	lua_pg_pool *pool = Mget_pool (L);
+
+	lua_createtable(L, 0, 10);
+	luaM_pool_lock(pool);
+	lua_pushnumber(L, pool->open);
+	lua_setfield(L, -2, "open");
+	lua_pushnumber(L, pool->idle);
+	lua_setfield(L, -2, "idle");
+	lua_pushnumber(L, pool->min);
+	lua_setfield(L, -2, "min");
+	lua_pushnumber(L, pool->max);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, pool->waits);
+	lua_setfield(L, -2, "waits");
+	lua_pushnumber(L, pool->timeouts);
+	lua_setfield(L, -2, "timeouts");
+	lua_pushnumber(L, pool->creations);
+	lua_setfield(L, -2, "creations");
+	lua_pushnumber(L, pool->discards);
+	lua_setfield(L, -2, "discards");
+	lua_pushnumber(L, pool->reaped);
+	lua_setfield(L, -2, "reaped");
+	lua_pushnumber(L, pool->broken);
+	lua_setfield(L, -2, "broken");
+	luaM_pool_unlock(pool);
 	return 1;
 }
 
-static int Lpg_lo_write (lua_State *L) {
-	int nbytes;
+/* pools live as long as the process */
+static int Lpg_pool_gc (lua_State *L) {
+	return 0;
+}
 
-    lua_pg_conn *my_conn = Mget_conn (L);
+/**
+* Waitset Part
+*/
 
-	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
-	const char *str = luaL_optstring(L, 3, NULL);
+#ifdef __linux__
+static lua_pg_waitset *Mget_waitset (lua_State *L) {
+	lua_pg_waitset *my_ws = (lua_pg_waitset *)luaL_checkudata (L, 1, LUA_PGSQL_WAITSET);
+	luaL_argcheck (L, my_ws != NULL, 1, "waitset expected");
+	luaL_argcheck (L, my_ws->epfd >= 0, 1, "waitset is closed");
+	return my_ws;
+}
 
-	if ((nbytes = lo_write(my_conn->conn, lofd, str, strlen(str))) == -1) {
-		lua_pushboolean(L, 0);
-		return 1;
-	}
+/* epoll events of an "r", "w" or "rw" string, "r" by default */
+static unsigned int luaM_events (lua_State *L, int idx) {
+	const char *events = luaL_optstring(L, idx, "r");
+	unsigned int flags = 0;
 
-	lua_pushnumber(L, nbytes);
-	return 1;
+	if (strchr(events, 'r')) {
+		flags |= EPOLLIN;
+	}
+	if (strchr(events, 'w')) {
+		flags |= EPOLLOUT;
+	}
+	return flags;
 }
 
-static int Lpg_lo_read_all (lua_State *L) {
-	int tbytes;
-	volatile int nbytes;
-	char buf[PGSQL_LO_READ_BUF_SIZE];
-
-    lua_pg_conn *my_conn = Mget_conn (L);
+static int Lpg_waitset (lua_State *L) {
+	lua_pg_waitset *my_ws = (lua_pg_waitset *)lua_newuserdata(L, sizeof(lua_pg_waitset));
+	luaM_setmeta (L, LUA_PGSQL_WAITSET);
 
-	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
+	my_ws->epfd = -1;
+	my_ws->conns = LUA_NOREF;
+	my_ws->count = 0;
+	my_ws->size = 0;
+	my_ws->events = NULL;
 
-	tbytes = 0;
-	if ((nbytes = lo_read(my_conn->conn, lofd, buf, PGSQL_LO_READ_BUF_SIZE)) > 0) {
-		lua_pushnumber(L, nbytes);
-		lua_pushstring(L, buf);
+	if ((my_ws->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
 		return 2;
 	}
+	lua_newtable(L);
+	my_ws->conns = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	lua_pushnumber(L, 0);
 	return 1;
 }
 
-static int Lpg_lo_import (lua_State *L) {
-	Oid oid;
-
-    lua_pg_conn *my_conn = Mget_conn (L);
-
-	const char *file_in = luaL_checkstring(L, 2);
-
-	oid = lo_import(my_conn->conn, file_in);
-	
-	if (oid == InvalidOid) {
+/**
+* Register (op EPOLL_CTL_ADD), change or remove the socket of the
+* connection at index 2. A connection is in one waitset at most, which
+* follows its socket through resets and drops it when it is closed.
+*/
+static int luaM_waitset_ctl (lua_State *L, int op) {
+	lua_pg_waitset *my_ws = Mget_waitset (L);
+	lua_pg_conn *my_conn = (lua_pg_conn *)luaL_checkudata (L, 2, LUA_PGSQL_CONN);
+	struct epoll_event ev;
+	int fd;
+
+	luaL_argcheck (L, ! my_conn->closed, 2, "connection is closed");
+	if (op == EPOLL_CTL_ADD ? my_conn->waitset != NULL : my_conn->waitset != my_ws) {
 		lua_pushboolean(L, 0);
+		lua_pushstring(L, op == EPOLL_CTL_ADD ? "Connection is already in a waitset"
+				: "Connection is not in this waitset");
+		return 2;
+	}
+	if (op == EPOLL_CTL_DEL) {
+		luaM_waitset_forget(L, my_conn);
+		lua_pushboolean(L, 1);
 		return 1;
 	}
+	if ((fd = PQsocket(my_conn->conn)) < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Connection has no socket");
+		return 2;
+	}
 
-	lua_pushnumber(L, oid);
+	ev.events = luaM_events(L, 3);
+	ev.data.ptr = my_conn;
+	if (epoll_ctl(my_ws->epfd, op, fd, &ev) != 0) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	my_conn->ws_events = ev.events;
+
+	/* the waitset keeps its connections alive */
+	if (op == EPOLL_CTL_ADD) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, my_ws->conns);
+		lua_pushlightuserdata(L, my_conn);
+		lua_pushvalue(L, 2);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+		my_ws->count++;
+		my_conn->waitset = my_ws;
+	}
+
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int Lpg_lo_export (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
-
-	Oid oid = luaL_checknumber(L, 2);
-	const char *file_out = luaL_checkstring(L, 3);
+static int Lpg_waitset_add (lua_State *L) {
+	return luaM_waitset_ctl(L, EPOLL_CTL_ADD);
+}
 
-	if (lo_export(my_conn->conn, oid, file_out)) {
-		lua_pushboolean(L, 1);
-		return 1;
-	}
+static int Lpg_waitset_modify (lua_State *L) {
+	return luaM_waitset_ctl(L, EPOLL_CTL_MOD);
+}
 
-	lua_pushboolean(L, 0);
-	return 1;
+static int Lpg_waitset_remove (lua_State *L) {
+	return luaM_waitset_ctl(L, EPOLL_CTL_DEL);
 }
 
-static int Lpg_lo_seek (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
+/**
+* Wait up to `timeout' milliseconds (forever when nil) and return the
+* connections ready to be used, with their readiness, "r" or "w". The
+* input of a readable connection is consumed: it is only returned once
+* a result (or a notification) is complete, so db:get_result() will not
+* block. Only ready sockets are visited.
+*/
+static int Lpg_waitset_wait (lua_State *L) {
+	lua_pg_waitset *my_ws = Mget_waitset (L);
+	int timeout = (int)luaL_optnumber(L, 2, -1);
+	int i, n, ready = 0;
+	lua_pg_conn *my_conn;
 
-	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
-	long offset = luaL_optnumber(L, 3, 0);
-    const char *result_type = luaL_optstring (L, 4, "SEEK_CUR");
+	if (my_ws->size < my_ws->count || my_ws->events == NULL) {
+		int size = my_ws->count > 16 ? my_ws->count : 16;
+		struct epoll_event *events = (struct epoll_event *)realloc(my_ws->events, size * sizeof(struct epoll_event));
 
-	if (lo_lseek(my_conn->conn, lofd, offset, luaM_const(L, result_type)) > -1) {
-		lua_pushboolean(L, 1);
+		if (events == NULL) {
+			lua_pushnil(L);
+			lua_pushstring(L, "Cannot allocate the event buffer");
+			return 2;
+		}
+		my_ws->events = events;
+		my_ws->size = size;
 	}
-	else {
-		lua_pushboolean(L, 0);
+
+	n = epoll_wait(my_ws->epfd, my_ws->events, my_ws->size, timeout);
+	if (n < 0 && errno != EINTR) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
 	}
 
-	return 1;
-}
+	lua_createtable(L, n > 0 ? n : 0, 0);
+	lua_createtable(L, n > 0 ? n : 0, 0);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, my_ws->conns);
+	for (i = 0; i < n; i++) {
+		/* the pointer is only followed once the table vouches for it */
+		lua_pushlightuserdata(L, my_ws->events[i].data.ptr);
+		lua_rawget(L, -2);
+		my_conn = (lua_pg_conn *)lua_touserdata(L, -1);
+		if (my_conn == NULL || my_conn->closed) {
+			lua_pop(L, 1);
+			continue;
+		}
 
-static int Lpg_lo_tell (lua_State *L) {
-	int offset = 0;
-    lua_pg_conn *my_conn = Mget_conn (L);
+		if (my_ws->events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			/* a broken connection is ready: get_result() reports the error */
+			PQconsumeInput(my_conn->conn);
+			if ( ! PQisBusy(my_conn->conn)) {
+				ready++;
+				lua_pushvalue(L, -1);
+				lua_rawseti(L, -5, ready);
+				lua_pushliteral(L, "r");
+				lua_rawseti(L, -4, ready);
+			}
+		}
+		if (my_ws->events[i].events & EPOLLOUT) {
+			ready++;
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, -5, ready);
+			lua_pushliteral(L, "w");
+			lua_rawseti(L, -4, ready);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
 
-	int lofd = luaL_optnumber(L, 2, my_conn->lofd);
+	return 2;
+}
 
-	offset = lo_tell(my_conn->conn, lofd);
-	lua_pushnumber(L, offset);
+static int Lpg_waitset_close (lua_State *L) {
+	lua_pg_waitset *my_ws = (lua_pg_waitset *)luaL_checkudata (L, 1, LUA_PGSQL_WAITSET);
 
-	return 1;
+	if (my_ws->epfd >= 0) {
+		close(my_ws->epfd);
+		my_ws->epfd = -1;
+	}
+	if (my_ws->conns != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, my_ws->conns);
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			((lua_pg_conn *)lua_touserdata(L, -1))->waitset = NULL;
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	my_ws->count = 0;
+	free(my_ws->events);
+	my_ws->events = NULL;
+	luaL_unref(L, LUA_REGISTRYINDEX, my_ws->conns);
+	my_ws->conns = LUA_NOREF;
+	return 0;
+}
+#else
+static int Lpg_waitset (lua_State *L) {
+	lua_pushnil(L);
+	lua_pushstring(L, "Waitsets need epoll");
+	return 2;
+}
+
+static int Lpg_waitset_close (lua_State *L) {
+	return 0;
 }
+#endif
 
 /**
-* Close PgSQL connection
+* Count of the live objects of the process, to spot leaks.
 */
-static int Lpg_close (lua_State *L) {
-    lua_pg_conn *my_conn = Mget_conn (L);
-    luaL_argcheck (L, my_conn != NULL, 1, "connection expected");
-    if (my_conn->closed) {
-        lua_pushboolean (L, 0);
-        return 1;
-    }
-
-    my_conn->closed = 1;
-    luaL_unref (L, LUA_REGISTRYINDEX, my_conn->env);
-    luaL_unref (L, LUA_REGISTRYINDEX, my_conn->field_types);
-    PQfinish (my_conn->conn);
-    lua_pushboolean (L, 1);
-    return 1;
+static int Lstats (lua_State *L) {
+	lua_createtable(L, 0, 2);
+	lua_pushnumber(L, luaM_count(live_conns, 0));
+	lua_setfield(L, -2, "connections");
+	lua_pushnumber(L, luaM_count(live_results, 0));
+	lua_setfield(L, -2, "results");
+	return 1;
 }
 
 /**
@@ -2173,10 +7634,33 @@ static int Lversion (lua_State *L) {
 int luaopen_pgsql (lua_State *L) {
     struct luaL_reg driver[] = {
         { "connect",   Lpg_connect },
+        { "connect_start",   Lpg_connect_start },
         { "version",   Lversion },
+        { "stats",   Lstats },
+        { "pool",   Lpg_pool },
+        { "waitset",   Lpg_waitset },
         { NULL, NULL },
     };
 
+    struct luaL_reg waitset_methods[] = {
+#ifdef __linux__
+        { "add",   Lpg_waitset_add },
+        { "modify",   Lpg_waitset_modify },
+        { "remove",   Lpg_waitset_remove },
+        { "wait",   Lpg_waitset_wait },
+#endif
+        { "close",   Lpg_waitset_close },
+        { NULL, NULL }
+    };
+
+    struct luaL_reg pool_methods[] = {
+        { "checkout",   Lpg_pool_checkout },
+        { "checkin",   Lpg_pool_checkin },
+        { "reap",   Lpg_pool_reap },
+        { "stats",   Lpg_pool_stats },
+        { NULL, NULL }
+    };
+
     struct luaL_reg result_methods[] = {
         { "field_num",   Lpg_field_num },
         { "field_name",   Lpg_field_name },
@@ -2191,7 +7675,9 @@ int luaopen_pgsql (lua_State *L) {
         { "fetch_array",   Lpg_fetch_array },
         { "fetch_result",   Lpg_fetch_result },
         { "fetch_all",   Lpg_fetch_all },
+        { "fetch_many",   Lpg_fetch_many },
         { "fetch_all_columns",   Lpg_fetch_all_columns },
+        { "fetch_columns",   Lpg_fetch_columns },
         { "last_oid",   Lpg_last_oid },
         { "result_error",   Lpg_result_error },
         { "result_seek",   Lpg_result_seek },
@@ -2201,10 +7687,13 @@ int luaopen_pgsql (lua_State *L) {
         { "num_fields",   Lpg_num_fields },
         { "num_rows",   Lpg_num_rows },
         { "affected_rows",   Lpg_affected_rows },
+        { "set_decode",   Lpg_res_set_decode },
         { NULL, NULL }
     };
 
     struct luaL_reg connection_methods[] = {
+        { "connect_poll",   Lpg_connect_poll },
+        { "socket",   Lpg_socket },
         { "host",   Lpg_host },
         { "port",   Lpg_port },
         { "dbname",   Lpg_dbname },
@@ -2217,6 +7706,10 @@ int luaopen_pgsql (lua_State *L) {
         { "connection_status",   Lpg_connection_status },
         { "connection_busy", Lpg_connection_busy},
         { "connection_reset", Lpg_connection_reset},
+        { "set_nonblocking", Lpg_set_nonblocking},
+        { "flush", Lpg_flush},
+        { "consume_input", Lpg_consume_input},
+        { "is_busy", Lpg_is_busy},
         { "transaction_status",   Lpg_transaction_status },
         { "options",   Lpg_options },
         { "parameter_status",   Lpg_parameter_status },
@@ -2230,8 +7723,22 @@ int luaopen_pgsql (lua_State *L) {
         { "client_encoding", Lpg_client_encoding},
         { "set_client_encoding", Lpg_set_client_encoding},
         { "set_error_verbosity", Lpg_set_error_verbosity},
+        { "set_decode", Lpg_set_decode},
+        { "set_result_format", Lpg_set_result_format},
         { "query",   Lpg_query },
         { "query_params",   Lpg_query_params },
+        { "set_statement_cache",   Lpg_set_statement_cache },
+        { "statement_cache_stats",   Lpg_statement_cache_stats },
+        { "stats",   Lpg_stats },
+        { "reset_stats",   Lpg_reset_stats },
+        { "set_latency_tracking",   Lpg_set_latency_tracking },
+        { "latency",   Lpg_latency },
+        { "set_slow_query",   Lpg_set_slow_query },
+        { "set_trace_buffer",   Lpg_set_trace_buffer },
+        { "trace_events",   Lpg_trace_events },
+        { "trace_dump",   Lpg_trace_dump },
+        { "set_retry",   Lpg_set_retry },
+        { "pipeline",   Lpg_pipeline },
         { "prepare",   Lpg_prepare },
         { "execute",   Lpg_execute },
         { "send_query",   Lpg_send_query },
@@ -2239,9 +7746,18 @@ int luaopen_pgsql (lua_State *L) {
         { "send_execute",   Lpg_send_execute },
         { "send_query_params",   Lpg_send_query_params },
         { "get_result",   Lpg_get_result },
+        { "stream",   Lpg_stream },
         { "put_line",   Lpg_put_line },
         { "get_notify",   Lpg_get_notify },
+        { "notifications",   Lpg_notifications },
+        { "wait_notify",   Lpg_wait_notify },
+        { "on_notify",   Lpg_on_notify },
         { "end_copy",   Lpg_end_copy },
+        { "copy_in",   Lpg_copy_in },
+        { "describe",   Lpg_describe },
+        { "copy_out",   Lpg_copy_out },
+        { "send_copy_out",   Lpg_send_copy_out },
+        { "get_copy_data",   Lpg_get_copy_data },
         { "meta_data",   Lpg_meta_data },
         { "lo_create",   Lpg_lo_create },
         { "lo_unlink",   Lpg_lo_unlink },
@@ -2254,13 +7770,24 @@ int luaopen_pgsql (lua_State *L) {
         { "lo_export",   Lpg_lo_export },
         { "lo_seek",   Lpg_lo_seek },
         { "lo_tell",   Lpg_lo_tell },
+        { "lo_truncate",   Lpg_lo_truncate },
+        { "lo_chunks",   Lpg_lo_chunks },
+        { "lo_get",   Lpg_lo_get },
         { "close",   Lpg_close },
         { NULL, NULL }
     };
 
-    luaM_register (L, LUA_PGSQL_CONN, connection_methods);
-    luaM_register (L, LUA_PGSQL_RES, result_methods);
-    lua_pop (L, 2);
+    struct luaL_reg stream_methods[] = {
+        { "close",   Lpg_stream_close },
+        { NULL, NULL }
+    };
+
+    luaM_register (L, LUA_PGSQL_CONN, connection_methods, Lpg_conn_gc);
+    luaM_register (L, LUA_PGSQL_RES, result_methods, Lpg_res_gc);
+    luaM_register (L, LUA_PGSQL_STREAM, stream_methods, Lpg_stream_gc);
+    luaM_register (L, LUA_PGSQL_POOL, pool_methods, Lpg_pool_gc);
+    luaM_register (L, LUA_PGSQL_WAITSET, waitset_methods, Lpg_waitset_close);
+    lua_pop (L, 5);
 
     luaL_register (L, LUA_PGSQL_TABLENAME, driver);
 
@@ -2268,5 +7795,10 @@ int luaopen_pgsql (lua_State *L) {
     lua_pushliteral (L, PG_VERSION);   
     lua_settable (L, -3);     
 
+    /* SQL NULL of decoded results */
+    lua_pushliteral (L, "null");
+    lua_pushlightuserdata (L, NULL);
+    lua_settable (L, -3);
+
     return 1;
 }
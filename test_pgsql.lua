@@ -202,3 +202,297 @@ print_r(b)
 print_r(c)
 print("===========================")
 ]=====]--
+
+--[[ regression checks, run against the same database ]]
+print("---- params ----")
+local ok, err = pcall(db.query_params, db, "SELECT $1::text", {n = 2^31 - 1})
+assert(not ok and err:find("parameter count"), err)
+ok, err = pcall(db.query_params, db, "SELECT $1::text", {n = -1})
+assert(not ok and err:find("parameter count"), err)
+local res = assert(db:query_params("SELECT $1::text AS a, $2::text AS b", {"x", nil, n = 2}))
+local row = res:fetch_assoc()
+assert(row.a == "x" and row.b == nil)
+local params, list = {}, {}
+for i = 1, 100 do
+	params[i] = i
+	list[i] = "$" .. i .. "::int4"
+end
+res = assert(db:query_params("SELECT " .. table.concat(list, " + ") .. " AS s", params))
+assert(tonumber(res:fetch_assoc().s) == 5050)
+
+print("---- copy_in ----")
+assert(db:query("CREATE TEMP TABLE copy_test (i int2, f float8, t timestamptz)"))
+local n, err = db:copy_in("COPY copy_test (i, f) FROM STDIN", {{1, 0.1}, {2, 1/3}})
+assert(n == 2, err)
+res = assert(db:query("SELECT count(*) AS n FROM copy_test WHERE f = 0.1 OR f = 1::float8 / 3"))
+assert(tonumber(res:fetch_assoc().n) == 2)
+
+print("---- binary copy_in ----")
+local types = {"int2", "float8", "timestamptz"}
+n, err = db:copy_in("COPY copy_test FROM STDIN (FORMAT binary)", {{3, 0.5, "2021-02-28 12:00:00Z"}}, {types = types})
+assert(n == 1, err)
+n, err = db:copy_in("COPY copy_test FROM STDIN (FORMAT binary)", {{70000, 0.5, 0}}, {types = types})
+assert(n == false and err)
+n, err = db:copy_in("COPY copy_test FROM STDIN (FORMAT binary)", {{1.5, 0.5, 0}}, {types = types})
+assert(n == false and err)
+n, err = db:copy_in("COPY copy_test FROM STDIN (FORMAT binary)", {{4, 0.5, "2021-02-30"}}, {types = types})
+assert(n == false and err)
+n, err = db:copy_in("COPY copy_test FROM STDIN (FORMAT binary)", {{4, 0.5, "2021-02-28 12:00:00+01:00junk"}}, {types = types})
+assert(n == false and err)
+res = assert(db:query("SELECT count(*) AS n FROM copy_test WHERE t IS NOT NULL"))
+assert(tonumber(res:fetch_assoc().n) == 1)
+
+print("---- pipeline ----")
+local results
+results, err = db:pipeline({"SELECT 1"})
+if results or not tostring(err):find("libpq 14") then
+	assert(results, err)
+	ok, err = pcall(db.pipeline, db, {"SELECT 1", 42})
+	assert(not ok, "a malformed statement raises an error")
+	res = assert(db:query("SELECT 1 AS one"), "the connection left pipeline mode")
+	assert(tonumber(res:fetch_assoc().one) == 1)
+	local pos
+	results, err, pos = db:pipeline({"SELECT 1", "SELECT 1/0", "SELECT 2"})
+	assert(results == false and err and pos == 2)
+	assert(db:query("SELECT 1"))
+end
+
+print("---- retry ----")
+assert(db:query("CREATE TEMP SEQUENCE retry_test"))
+db:reset_stats()
+db:set_retry({attempts = 2, delay = 0.01, sqlstates = {"22012"}})
+res = assert(db:query("SELECT CASE WHEN nextval('retry_test') = 1 THEN 1/0 ELSE 1 END AS v"))
+assert(tonumber(res:fetch_assoc().v) == 1)
+assert(db:stats().retries == 1)
+db:set_retry(false)
+assert(not db:query("SELECT 1/0"))
+db:set_retry()
+local other = assert(pgsql.connect("host=localhost dbname=test user=postgres"))
+assert(other:query("SELECT pg_terminate_backend(" .. db:get_pid() .. ")"))
+other:close()
+res = assert(db:query("SELECT 1 AS one"), "an idempotent statement runs again after a reconnect")
+assert(tonumber(res:fetch_assoc().one) == 1)
+assert(db:stats().reconnects == 1)
+
+print("---- decode ----")
+db:set_decode(true)
+row = db:query("SELECT 1::int4 AS n, NULL AS x, true AS b, 2.5::float8 AS f, 'a'::text AS t"):fetch_assoc()
+assert(row.n == 1 and row.x == pgsql.null and row.b == true and row.f == 2.5 and row.t == "a")
+row = db:query("SELECT 9007199254740993::int8 AS big"):fetch_assoc()
+assert(row.big == "9007199254740993", "an int8 beyond 2^53 stays a string")
+db:set_decode(false)
+row = db:query("SELECT 1::int4 AS n"):fetch_assoc()
+assert(row.n == "1")
+
+print("---- binary results ----")
+res = assert(db:query_params("SELECT $1::int8 AS n, $2::text AS t, true AS b, 0.25::float8 AS f, NULL::int4 AS x, '\\x0001'::bytea AS raw", {42, "abc"}, {binary = true}))
+row = res:fetch_assoc()
+assert(row.n == 42 and row.t == "abc" and row.b == true and row.f == 0.25 and row.x == pgsql.null)
+assert(row.raw == "\0\1", "bytea is returned as raw bytes")
+row = assert(db:query_params("SELECT '2021-02-28'::date AS d", {}, {binary = true})):fetch_assoc()
+assert(row.d == "2021-02-28")
+res = assert(db:query_params("SELECT '1 day'::interval AS i", {}, {binary = true}))
+ok = pcall(res.fetch_assoc, res)
+assert(not ok, "a binary value without a decoder raises an error")
+row = assert(db:query_params("SELECT '1 day'::interval::text AS i", {}, {binary = true})):fetch_assoc()
+assert(row.i == "1 day")
+
+print("---- stream ----")
+n = 0
+for r in db:stream("SELECT g AS i FROM generate_series(1, 100000) g") do
+	n = n + 1
+	if n == 10 then break end
+end
+res = assert(db:query("SELECT 1 AS one"), "a stream left early is ended by the next command")
+assert(tonumber(res:fetch_assoc().one) == 1)
+n = 0
+for r in db:stream("SELECT g AS i FROM generate_series(1, $1::int4) g", {5}) do
+	n = n + 1
+end
+assert(n == 5)
+local iter, stream = db:stream("SELECT g FROM generate_series(1, 100000) g")
+assert(iter(stream))
+stream:close()
+assert(db:query("SELECT 1"))
+
+print("---- copy_out ----")
+n = 0
+for line in db:copy_out("COPY (SELECT g FROM generate_series(1, 100000) g) TO STDOUT") do
+	n = n + 1
+	if n == 10 then break end
+end
+res = assert(db:query("SELECT 1 AS one"), "a COPY left early is ended by the next command")
+assert(tonumber(res:fetch_assoc().one) == 1)
+local lines = {}
+for fields in db:copy_out("COPY (SELECT 1, NULL::text, 'a\tb') TO STDOUT", true) do
+	lines[#lines + 1] = fields
+end
+assert(#lines == 1 and lines[1][1] == "1" and lines[1][2] == pgsql.null and lines[1][3] == "a\tb")
+assert(db:send_copy_out("COPY (SELECT g FROM generate_series(1, 3) g) TO STDOUT"))
+n = 0
+while db:get_copy_data() do
+	n = n + 1
+end
+assert(n == 3)
+assert(db:send_copy_out("COPY (SELECT 1/0) TO STDOUT"))
+local line
+line, err = db:get_copy_data()
+assert(line == nil and err, "the error of the COPY is returned")
+assert(db:query("SELECT 1"))
+
+print("---- fetch_many ----")
+res = assert(db:query("SELECT g AS id, g * 2 AS double FROM generate_series(1, 5) g"))
+local rows = res:fetch_many(2)
+assert(#rows == 2 and rows[1].id == "1" and rows[2].double == "4")
+rows = res:fetch_many(10, "PGSQL_NUM", {"double"})
+assert(#rows == 3 and rows[1][1] == "6" and rows[3][2] == nil)
+assert(res:fetch_many(10) == false)
+res = assert(db:query("SELECT 1 AS id"))
+ok, err = res:fetch_many(1, "PGSQL_ASSOC", {"nope"})
+assert(ok == false and err == "Bad column 'nope' specified", err)
+
+print("---- waitset ----")
+local ws = pgsql.waitset()
+if ws then
+	local w = assert(pgsql.connect("host=localhost dbname=test user=postgres"))
+	w:set_nonblocking(true)
+	assert(w:send_query("SELECT 7 AS v"))
+	ws:add(w)
+	local conns, events
+	repeat
+		conns, events = ws:wait(5000)
+		assert(conns, events)
+	until #conns > 0
+	assert(conns[1] == w and events[1] == "r")
+	res = assert(w:get_result(true))
+	assert(tonumber(res:fetch_assoc().v) == 7)
+	assert(w:get_result() == false)
+	w:close()
+	conns = ws:wait(0)
+	assert(#conns == 0, "a closed connection leaves the waitset")
+	ws:close()
+end
+
+print("---- notifications ----")
+assert(db:query("LISTEN test_channel"))
+assert(db:wait_notify(0.05) == false, "no notification times out")
+local sender = assert(pgsql.connect("host=localhost dbname=test user=postgres"))
+assert(sender:query("NOTIFY test_channel, 'one'"))
+local notes = assert(db:wait_notify(5))
+assert(#notes == 1 and notes[1].channel == "test_channel" and notes[1].payload == "one")
+assert(notes[1].pid == sender:get_pid())
+local seen
+db:on_notify("test_channel", function(channel, payload, pid) seen = payload end)
+assert(sender:query("NOTIFY test_channel, 'two'"))
+notes = assert(db:wait_notify(5))
+assert(#notes == 0 and seen == "two", "a handled notification is not returned")
+db:on_notify("test_channel", nil)
+sender:close()
+assert(db:query("UNLISTEN test_channel"))
+
+print("---- large objects ----")
+assert(db:query("BEGIN"))
+local oid = assert(db:lo_create())
+local fd = assert(db:lo_open(oid, "r+"))
+assert(db:lo_write(fd, "hello large world"))
+assert(db:lo_tell(fd) == 17)
+assert(db:lo_seek(fd, 6) == 6, "whence defaults to PGSQL_SEEK_SET")
+assert(db:lo_read(fd, 5) == "large")
+assert(db:lo_seek(fd, 1, "PGSQL_SEEK_CUR") == 12)
+assert(db:lo_seek(fd, -5, "PGSQL_SEEK_END") == 12)
+ok = pcall(db.lo_seek, db, fd, 0, "SEEK_SET")
+assert(not ok, "an unknown whence raises an error")
+assert(db:lo_seek(fd, 0) == 0)
+local chunks = {}
+for chunk in db:lo_chunks(fd, 4) do
+	chunks[#chunks + 1] = chunk
+end
+assert(#chunks == 5 and table.concat(chunks) == "hello large world")
+assert(db:lo_close(fd))
+assert(db:lo_unlink(oid))
+assert(db:query("COMMIT"))
+
+print("---- prepared statements ----")
+assert(db:prepare("add_one", "SELECT $1 + 1 AS v", {"int4"}))
+res = assert(db:execute("add_one", {41}))
+assert(tonumber(res:fetch_assoc().v) == 42)
+res = assert(db:execute("add_one", {1}, {binary = true}))
+assert(res:fetch_assoc().v == 2)
+local desc = assert(db:describe("SELECT $1::int4 AS a, 'x'::text AS b"))
+assert(desc.names[1] == "a" and desc.names[2] == "b" and desc.types[1] == 23 and desc.params[1] == 23)
+assert(db:query("DEALLOCATE add_one"))
+assert(not db:execute("add_one", {1}), "a statement the server dropped fails")
+assert(db:prepare("add_one", "SELECT $1 + 2 AS w", {"int4"}), "its description is dropped with it")
+res = assert(db:execute("add_one", {1}))
+assert(tonumber(res:fetch_assoc().w) == 3)
+assert(db:send_prepare("broken", "SELECT FROM nowhere_at_all"))
+repeat res = db:get_result() until not res
+ok, err = db:execute("broken", {})
+assert(ok == false and err, "the statement of a failed send_prepare is not described")
+assert(db:query("SELECT 1"))
+
+print("---- latency ----")
+assert(db:latency() == nil, "latency tracking is off by default")
+db:set_latency_tracking(8)
+for i = 1, 10 do
+	assert(db:query_params("SELECT $1::int4 AS v", {i}))
+end
+assert(db:query("SELECT 1 /* one */"))
+assert(db:query("select   2"))
+local lat = assert(db:latency())
+local l = assert(lat["select $1::int4 as v"], "query_params is keyed by its fingerprint")
+assert(l.count == 10 and l.p50 > 0 and l.p50 <= l.p99 and l.p99 <= l.max)
+assert(lat["select ?"] and lat["select ?"].count == 2, "literals and comments are folded")
+db:reset_stats()
+assert(db:latency()["select $1::int4 as v"] == nil or db:latency()["select $1::int4 as v"].count == 0)
+db:set_latency_tracking(0)
+assert(db:latency() == nil)
+
+print("---- slow queries ----")
+local slow = {}
+db:set_slow_query(0, function(sql, nparams, duration, rows)
+	-- errors raised here are ignored, so they are recorded instead
+	local pool = pgsql.pool{conninfo = "host=localhost dbname=test user=postgres"}
+	slow[#slow + 1] = {sql = sql, nparams = nparams, duration = duration, rows = rows,
+		query = pcall(db.query, db, "SELECT 1"), checkin = pcall(pool.checkin, pool, db)}
+end)
+assert(db:query_params("SELECT $1::int4", {1}))
+db:set_slow_query(0)
+assert(db:query("SELECT 1"))
+assert(#slow == 1 and slow[1].sql == "SELECT $1::int4" and slow[1].nparams == 1 and slow[1].rows == 1)
+assert(slow[1].duration >= 0)
+assert(not slow[1].query and not slow[1].checkin, "the connection cannot be used nor checked in from the hook")
+
+print("---- trace ring ----")
+local traced = assert(pgsql.connect("host=localhost dbname=test user=postgres"))
+traced:set_trace_buffer(4)
+assert(traced:query("SELECT 1"))
+assert(not traced:query("SELECT 1/0"))
+local events = traced:trace_events()
+assert(#events == 4, "the ring keeps the last exchanges")
+assert(events[1].dir == ">" and events[1].type == "Q" and events[1].name == "SELECT 1")
+assert(events[4].dir == "<" and events[4].type == "E" and events[4].sqlstate == "22012")
+assert(events[1].time <= events[4].time and events[4].age >= 0)
+assert(traced:trace_dump():find("22012", 1, true))
+traced:set_trace_buffer(0)
+assert(traced:query("SELECT 1"))
+assert(#traced:trace_events() == 0, "a ring of size 0 records nothing")
+traced:set_trace_buffer(4)
+assert(not traced:query("SELECT 1/0"))
+traced:close()
+assert(#traced:trace_events() == 2, "the ring can be read after close")
+
+print("---- statement cache ----")
+db:set_statement_cache(2)
+for i = 1, 3 do
+	res = assert(db:query_params("SELECT $1::int4 + " .. i .. " AS v", {1}))
+	assert(tonumber(res:fetch_assoc().v) == 1 + i)
+end
+assert(db:query("BEGIN"))
+ok, err = db:query_params("SELECT * FROM no_such_table_at_all", {})
+assert(ok == false and err:find("no_such_table_at_all", 1, true), "a miss in a transaction reports the error of the query")
+assert(db:query("ROLLBACK"))
+assert(db:query("DEALLOCATE ALL"))
+res = assert(db:query_params("SELECT $1::int4 + 3 AS v", {1}), "a statement the server lost is sent unprepared")
+assert(tonumber(res:fetch_assoc().v) == 4)
+db:set_statement_cache(0)